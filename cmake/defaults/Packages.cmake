@@ -2,6 +2,9 @@
 set(LABTEXT_LOCATION "${LOCAL_ROOT}")
 find_package(LabText REQUIRED)
 
+# --zlib, optional, for .fountain.gz input
+find_package(ZLIB)
+
 # --math
 if (CMAKE_SYSTEM_NAME STREQUAL "Linux")
     find_library(M_LIB m)
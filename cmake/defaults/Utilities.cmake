@@ -1,12 +1,16 @@
 
-function(source_file fname)
+function(target_source_file target fname)
     if(IS_ABSOLUTE ${fname})
-        target_sources(${PROJECT_NAME} PRIVATE ${fname})
+        target_sources(${target} PRIVATE ${fname})
     else()
-        target_sources(${PROJECT_NAME} PRIVATE ${CMAKE_CURRENT_SOURCE_DIR}/${fname})
+        target_sources(${target} PRIVATE ${CMAKE_CURRENT_SOURCE_DIR}/${fname})
     endif()
 endfunction()
 
+function(source_file fname)
+    target_source_file(${PROJECT_NAME} ${fname})
+endfunction()
+
 function(include_dir fpath)
     set_property(TARGET ${PROJECT_NAME} APPEND PROPERTY INTERFACE_INCLUDE_DIRECTORIES ${fpath})
 endfunction()
@@ -0,0 +1,923 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "FileIO.h"
+#include "SpscRing.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef LAB_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LAB_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace lab
+{
+
+#ifdef _MSC_VER
+	int open_output_fd(const std::string& path)
+	{
+		if (path == "-")
+			return 1;
+		int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open " + path + " for writing");
+		return fd;
+	}
+
+	int open_append_fd(const std::string& path, uint64_t size)
+	{
+		int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open " + path + " for writing");
+		if (_chsize_s(fd, static_cast<__int64>(size)) != 0 || _lseeki64(fd, 0, SEEK_END) < 0)
+		{
+			_close(fd);
+			throw std::runtime_error("Couldn't append to " + path);
+		}
+		return fd;
+	}
+
+	void close_output_fd(int fd)
+	{
+		if (fd > 2)
+			_close(fd);
+	}
+
+	void write_fully(int fd, const void* data, size_t len)
+	{
+		const char* p = static_cast<const char*>(data);
+		while (len > 0)
+		{
+			unsigned int chunk = len > 0x40000000 ? 0x40000000 : static_cast<unsigned int>(len);
+			int n = _write(fd, p, chunk);
+			if (n < 0)
+				throw std::runtime_error("Write failed");
+			p += n;
+			len -= n;
+		}
+	}
+
+	void write_fully(int fd, const std::string_view* pieces, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+			write_fully(fd, pieces[i].data(), pieces[i].length());
+	}
+
+	MappedFile::MappedFile(const std::string& path)
+	{
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f)
+			throw std::runtime_error("Couldn't open " + path);
+		fseek(f, 0, SEEK_END);
+		_size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		_fallback.resize(_size);
+		if (_size && fread(_fallback.data(), 1, _size, f) != _size)
+		{
+			fclose(f);
+			throw std::runtime_error("Couldn't read " + path);
+		}
+		fclose(f);
+		_data = _fallback.data();
+	}
+
+	MappedFile::~MappedFile()
+	{
+	}
+#else
+	int open_output_fd(const std::string& path)
+	{
+		if (path == "-")
+			return 1;
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open " + path + " for writing");
+		return fd;
+	}
+
+	int open_append_fd(const std::string& path, uint64_t size)
+	{
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open " + path + " for writing");
+		if (ftruncate(fd, static_cast<off_t>(size)) != 0 || lseek(fd, 0, SEEK_END) < 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Couldn't append to " + path);
+		}
+		return fd;
+	}
+
+	void close_output_fd(int fd)
+	{
+		if (fd > 2)
+			::close(fd);
+	}
+
+	void write_fully(int fd, const void* data, size_t len)
+	{
+		const char* p = static_cast<const char*>(data);
+		while (len > 0)
+		{
+			ssize_t n = ::write(fd, p, len);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("Write failed");
+			}
+			p += n;
+			len -= static_cast<size_t>(n);
+		}
+	}
+
+	void write_fully(int fd, const std::string_view* pieces, size_t count)
+	{
+		// IOV_MAX is 1024 on Linux and the BSDs
+		const size_t max_iov = 1024;
+		struct iovec iov[max_iov];
+		size_t i = 0;
+		size_t skip = 0;	// bytes of pieces[i] already written
+		while (i < count)
+		{
+			size_t n_iov = 0;
+			for (size_t j = i; j < count && n_iov < max_iov; ++j)
+			{
+				size_t offset = j == i ? skip : 0;
+				if (pieces[j].length() == offset)
+					continue;
+				iov[n_iov].iov_base = const_cast<char*>(pieces[j].data() + offset);
+				iov[n_iov].iov_len = pieces[j].length() - offset;
+				++n_iov;
+			}
+			if (!n_iov)
+				return;
+			ssize_t n = ::writev(fd, iov, static_cast<int>(n_iov));
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("Write failed");
+			}
+			size_t written = static_cast<size_t>(n);
+			while (i < count && written >= pieces[i].length() - skip)
+			{
+				written -= pieces[i].length() - skip;
+				skip = 0;
+				++i;
+			}
+			skip += written;
+		}
+	}
+
+	MappedFile::MappedFile(const std::string& path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open " + path);
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Couldn't stat " + path);
+		}
+		_size = static_cast<size_t>(st.st_size);
+		if (_size > 0)
+		{
+			void* p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED)
+			{
+				::close(fd);
+				throw std::runtime_error("Couldn't map " + path);
+			}
+			_data = static_cast<const char*>(p);
+		}
+		::close(fd);
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (_data)
+			munmap(const_cast<char*>(_data), _size);
+	}
+#endif
+
+	OutputBuffer::OutputBuffer(int fd, size_t capacity)
+		: _fd(fd), _buffer(capacity > 0 ? capacity : 1)
+	{
+	}
+
+	OutputBuffer::OutputBuffer(std::string& sink, size_t capacity)
+		: _sink(&sink), _buffer(capacity > 0 ? capacity : 1)
+	{
+	}
+
+	OutputBuffer::~OutputBuffer()
+	{
+		try
+		{
+			flush();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	void OutputBuffer::flush()
+	{
+		if (_used)
+		{
+			size_t used = _used;
+			_used = 0;
+			drain(_buffer.data(), used);
+		}
+	}
+
+	void OutputBuffer::drain(const char* data, size_t len)
+	{
+		if (_sink)
+			_sink->append(data, len);
+		else
+			write_fully(_fd, data, len);
+	}
+
+
+	namespace
+	{
+		const int pipeline_buffers = 8;
+
+		// a filled buffer on its way to the consumer; buffer is chunk_end
+		// or chunk_error instead at the end of the file or on failure
+		struct Chunk
+		{
+			int buffer;
+			size_t length;
+		};
+		const int chunk_end = -1;
+		const int chunk_error = -2;
+
+#ifdef _MSC_VER
+		int open_input(const std::string& path)
+		{
+			int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+			if (fd < 0)
+				throw std::runtime_error("Couldn't open " + path);
+			return fd;
+		}
+
+		void close_input(int fd)
+		{
+			_close(fd);
+		}
+
+		long long read_some(int fd, char* p, size_t len)
+		{
+			return _read(fd, p, len > 0x40000000 ? 0x40000000 : static_cast<unsigned int>(len));
+		}
+
+		bool regular_file_size(int fd, uint64_t& size)
+		{
+			struct _stat64 st;
+			if (_fstat64(fd, &st) != 0 || !(st.st_mode & _S_IFREG))
+				return false;
+			size = static_cast<uint64_t>(st.st_size);
+			return true;
+		}
+
+		// reads at offset, leaving the file position where it was
+		bool read_at(int fd, char* p, size_t len, uint64_t offset)
+		{
+			long long pos = _telli64(fd);
+			bool ok = _lseeki64(fd, static_cast<long long>(offset), SEEK_SET) >= 0
+				&& _read(fd, p, static_cast<unsigned int>(len)) == static_cast<int>(len);
+			_lseeki64(fd, pos, SEEK_SET);
+			return ok;
+		}
+#else
+		int open_input(const std::string& path)
+		{
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error("Couldn't open " + path);
+			return fd;
+		}
+
+		void close_input(int fd)
+		{
+			::close(fd);
+		}
+
+		long long read_some(int fd, char* p, size_t len)
+		{
+			return ::read(fd, p, len);
+		}
+
+		bool regular_file_size(int fd, uint64_t& size)
+		{
+			struct stat st;
+			if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+				return false;
+			size = static_cast<uint64_t>(st.st_size);
+			return true;
+		}
+
+		// reads at offset, leaving the file position where it was
+		bool read_at(int fd, char* p, size_t len, uint64_t offset)
+		{
+			return ::pread(fd, p, len, static_cast<off_t>(offset)) == static_cast<ssize_t>(len);
+		}
+#endif
+
+#ifdef LAB_IO_URING
+		// The little of io_uring that the reader needs, over the raw system
+		// calls so that there is no dependency on liburing.
+		class ReadRing
+		{
+		public:
+			ReadRing() = default;
+			ReadRing(const ReadRing&) = delete;
+			ReadRing& operator=(const ReadRing&) = delete;
+
+			~ReadRing()
+			{
+				if (_sqes)
+					munmap(_sqes, _sqes_size);
+				if (_cq && _cq != _sq)
+					munmap(_cq, _cq_size);
+				if (_sq)
+					munmap(_sq, _sq_size);
+				if (_fd >= 0)
+					::close(_fd);
+			}
+
+			// false if the kernel has no io_uring, forbids it, or predates
+			// IORING_OP_READ
+			bool init(unsigned entries)
+			{
+				io_uring_params params = {};
+				_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+				if (_fd < 0)
+					return false;
+
+				// the probe arrived in the same release as IORING_OP_READ
+				std::vector<char> probe_space(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+				io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_space.data());
+				if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, 256) < 0
+					|| probe->last_op < IORING_OP_READ
+					|| !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+					return false;
+
+				_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+				_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+				bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+				if (single)
+					_sq_size = _cq_size = std::max(_sq_size, _cq_size);
+				_sq = map(_sq_size, IORING_OFF_SQ_RING);
+				_cq = single ? _sq : map(_cq_size, IORING_OFF_CQ_RING);
+				_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+				_sqes = static_cast<io_uring_sqe*>(map(_sqes_size, IORING_OFF_SQES));
+				if (!_sq || !_cq || !_sqes)
+					return false;
+
+				char* sq = static_cast<char*>(_sq);
+				char* cq = static_cast<char*>(_cq);
+				_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+				_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+				_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+				_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+				_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+				_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+				_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+				return true;
+			}
+
+			void read(int fd, char* buffer, size_t length, uint64_t offset, uint64_t tag)
+			{
+				unsigned tail = *_sq_tail;
+				unsigned i = tail & _sq_mask;
+				io_uring_sqe& e = _sqes[i];
+				memset(&e, 0, sizeof(e));
+				e.opcode = IORING_OP_READ;
+				e.fd = fd;
+				e.addr = reinterpret_cast<uint64_t>(buffer);
+				e.len = static_cast<unsigned>(length);
+				e.off = offset;
+				e.user_data = tag;
+				_sq_array[i] = i;
+				__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+				while (syscall(__NR_io_uring_enter, _fd, 1, 0, 0, nullptr, 0) < 0)
+					if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+						throw std::runtime_error("io_uring submission failed");
+			}
+
+			// blocks until a read completes
+			io_uring_cqe wait()
+			{
+				for (;;)
+				{
+					unsigned head = *_cq_head;
+					if (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+					{
+						io_uring_cqe c = _cqes[head & _cq_mask];
+						__atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+						return c;
+					}
+					if (syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+						throw std::runtime_error("io_uring wait failed");
+				}
+			}
+
+		private:
+			void* map(size_t size, off_t offset)
+			{
+				void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+				return p == MAP_FAILED ? nullptr : p;
+			}
+
+			int _fd = -1;
+			void* _sq = nullptr;
+			void* _cq = nullptr;
+			io_uring_sqe* _sqes = nullptr;
+			size_t _sq_size = 0;
+			size_t _cq_size = 0;
+			size_t _sqes_size = 0;
+			unsigned* _sq_tail = nullptr;
+			unsigned _sq_mask = 0;
+			unsigned* _sq_array = nullptr;
+			unsigned* _cq_head = nullptr;
+			unsigned* _cq_tail = nullptr;
+			unsigned _cq_mask = 0;
+			io_uring_cqe* _cqes = nullptr;
+		};
+#endif
+
+		// Buffers circulate between the two rings: the producer takes an
+		// empty one, fills it, and passes it on through filled; the consumer
+		// hands it back through empty when it asks for the next.
+		struct BufferHandoff
+		{
+			size_t buffer_size = 0;
+			std::unique_ptr<char[]> storage;
+			SpscRing<Chunk, 16> filled;
+			SpscRing<int, 16> empty;
+			std::atomic<bool> stop{ false };
+			std::atomic<bool> never{ false };
+			std::string error;
+			int held = -1;
+			bool done = false;
+
+			void allocate(size_t size)
+			{
+				buffer_size = size > 0 ? size : 1;
+				storage.reset(new char[pipeline_buffers * buffer_size]);
+				for (int i = 0; i < pipeline_buffers; ++i)
+					empty.try_push(i);
+			}
+
+			char* buffer(int i) { return storage.get() + static_cast<size_t>(i) * buffer_size; }
+
+			// the producer's way out when it can't go on
+			void fail(const char* what)
+			{
+				error = what;
+				filled.push({ chunk_error, 0 }, stop);
+			}
+
+			// the consumer's side: gives back the buffer it held, and waits
+			// for the next one in order
+			const char* next(size_t& length)
+			{
+				if (held >= 0)
+				{
+					empty.try_push(held);	// never full; there are fewer buffers than slots
+					held = -1;
+				}
+				if (done)
+					return nullptr;
+
+				Chunk c = { chunk_end, 0 };
+				filled.pop(c, never);
+				if (c.buffer == chunk_end)
+				{
+					done = true;
+					return nullptr;
+				}
+				if (c.buffer == chunk_error)
+				{
+					done = true;
+					throw std::runtime_error(error);
+				}
+				held = c.buffer;
+				length = c.length;
+				return buffer(c.buffer);
+			}
+		};
+	}
+
+	struct PipelinedReader::Pipeline : BufferHandoff
+	{
+		int fd = -1;
+		uint64_t size = 0;
+		bool regular = false;
+#ifdef LAB_IO_URING
+		std::unique_ptr<ReadRing> ring;
+#endif
+		std::thread producer;
+
+		void produce()
+		{
+			try
+			{
+#ifdef LAB_IO_URING
+				if (ring)
+				{
+					ring_loop(*ring);
+					return;
+				}
+#endif
+				read_loop();
+			}
+			catch (std::exception& e)
+			{
+				fail(e.what());
+			}
+		}
+
+		// one read at a time, in order; works on anything, pipes included
+		void read_loop()
+		{
+			int b;
+			while (empty.pop(b, stop))
+			{
+				char* p = buffer(b);
+				size_t got = 0;
+				while (got < buffer_size)
+				{
+					long long n = read_some(fd, p + got, buffer_size - got);
+					if (n < 0)
+					{
+						if (errno == EINTR)
+							continue;
+						throw std::runtime_error("Read failed");
+					}
+					if (n == 0)
+						break;
+					got += static_cast<size_t>(n);
+				}
+				if (got && !filled.push({ b, got }, stop))
+					return;
+				if (got < buffer_size)
+				{
+					filled.push({ chunk_end, 0 }, stop);
+					return;
+				}
+			}
+		}
+
+#ifdef LAB_IO_URING
+		// Keeps a read in flight for every buffer the consumer isn't
+		// holding. Reads complete in any order; buffers are passed on in
+		// file order.
+		void ring_loop(ReadRing& ring)
+		{
+			struct Slot
+			{
+				uint64_t offset;
+				size_t want;
+				size_t got;
+				bool ready;
+			};
+			Slot slots[pipeline_buffers] = {};
+			uint64_t next = 0;		// offset of the next read to start
+			uint64_t deliver = 0;	// offset of the next buffer to pass on
+			int in_flight = 0;
+
+			// the kernel may be writing into buffers until every read is reaped
+			struct Drain
+			{
+				ReadRing& ring;
+				int& in_flight;
+				~Drain()
+				{
+					try
+					{
+						for (; in_flight > 0; --in_flight)
+							ring.wait();
+					}
+					catch (...)
+					{
+					}
+				}
+			} drain = { ring, in_flight };
+
+			auto submit = [&](int b)
+			{
+				Slot& s = slots[b];
+				s.offset = next;
+				s.want = static_cast<size_t>(std::min<uint64_t>(buffer_size, size - next));
+				s.got = 0;
+				s.ready = false;
+				next += s.want;
+				ring.read(fd, buffer(b), s.want, s.offset, static_cast<uint64_t>(b));
+				++in_flight;
+			};
+
+			while (deliver < size && !stop.load(std::memory_order_acquire))
+			{
+				int b;
+				while (next < size && empty.try_pop(b))
+					submit(b);
+				if (!in_flight)
+				{
+					if (!empty.pop(b, stop))
+						return;
+					submit(b);
+					continue;
+				}
+
+				io_uring_cqe c = ring.wait();
+				--in_flight;
+				b = static_cast<int>(c.user_data);
+				Slot& s = slots[b];
+				if (c.res < 0 && c.res != -EINTR && c.res != -EAGAIN)
+					throw std::runtime_error("Read failed");
+				if (c.res == 0)
+					throw std::runtime_error("File shrank while being read");
+				if (c.res > 0)
+					s.got += static_cast<size_t>(c.res);
+				if (s.got < s.want)
+				{
+					ring.read(fd, buffer(b) + s.got, s.want - s.got, s.offset + s.got, static_cast<uint64_t>(b));
+					++in_flight;
+					continue;
+				}
+				s.ready = true;
+
+				for (bool found = true; found;)
+				{
+					found = false;
+					for (int i = 0; i < pipeline_buffers; ++i)
+					{
+						if (slots[i].ready && slots[i].offset == deliver)
+						{
+							slots[i].ready = false;
+							if (!filled.push({ i, slots[i].got }, stop))
+								return;
+							deliver += slots[i].got;
+							found = true;
+						}
+					}
+				}
+			}
+			filled.push({ chunk_end, 0 }, stop);
+		}
+#endif
+	};
+
+	PipelinedReader::PipelinedReader(const std::string& path, size_t buffer_size)
+		: PipelinedReader(open_input(path), buffer_size)
+	{
+	}
+
+	PipelinedReader::PipelinedReader(int fd, size_t buffer_size)
+		: _pipeline(new Pipeline)
+	{
+		Pipeline& p = *_pipeline;
+		p.fd = fd;
+		p.regular = regular_file_size(fd, p.size);
+		p.allocate(buffer_size);
+#ifdef LAB_IO_URING
+		// a pipe can't be read at an offset, and io_uring may be missing
+		// or forbidden, as it often is in containers
+		if (p.regular && p.size)
+		{
+			p.ring.reset(new ReadRing());
+			if (!p.ring->init(pipeline_buffers))
+				p.ring.reset();
+		}
+#endif
+		p.producer = std::thread([&p] { p.produce(); });
+	}
+
+	PipelinedReader::~PipelinedReader()
+	{
+		_pipeline->stop = true;
+		if (_pipeline->producer.joinable())
+			_pipeline->producer.join();
+		close_input(_pipeline->fd);
+	}
+
+	uint64_t PipelinedReader::size() const
+	{
+		return _pipeline->regular ? _pipeline->size : 0;
+	}
+
+	bool PipelinedReader::uses_io_uring() const
+	{
+#ifdef LAB_IO_URING
+		return _pipeline->ring != nullptr;
+#else
+		return false;
+#endif
+	}
+
+	const char* PipelinedReader::next(size_t& length)
+	{
+		return _pipeline->next(length);
+	}
+
+
+	namespace
+	{
+		// a gzip file's last four bytes are its inflated size, little endian
+		uint64_t gzip_trailer_size(int fd)
+		{
+			uint64_t size;
+			unsigned char trailer[4];
+			if (!regular_file_size(fd, size) || size < 18
+				|| !read_at(fd, reinterpret_cast<char*>(trailer), 4, size - 4))
+				return 0;
+			return uint64_t(trailer[0]) | uint64_t(trailer[1]) << 8 | uint64_t(trailer[2]) << 16 | uint64_t(trailer[3]) << 24;
+		}
+	}
+
+	struct GzipReader::Inflater : BufferHandoff
+	{
+		Inflater(int fd, size_t buffer_size)
+			: size(gzip_trailer_size(fd))	// before the input's reads begin
+			, input(fd, buffer_size)
+		{
+		}
+
+		uint64_t size;
+		PipelinedReader input;
+		std::thread producer;
+
+		void produce()
+		{
+			try
+			{
+				inflate_loop();
+			}
+			catch (std::exception& e)
+			{
+				fail(e.what());
+			}
+		}
+
+#ifdef LAB_ZLIB
+		void inflate_loop()
+		{
+			z_stream z = {};
+			if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+				throw std::runtime_error("Couldn't start inflating");
+			struct End
+			{
+				z_stream& z;
+				~End() { inflateEnd(&z); }
+			} end = { z };
+
+			int b;
+			if (!empty.pop(b, stop))
+				return;
+			z.next_out = reinterpret_cast<Bytef*>(buffer(b));
+			z.avail_out = static_cast<uInt>(buffer_size);
+
+			bool member_ended = false;
+			bool padded = false;
+			size_t length;
+			while (const char* in = input.next(length))
+			{
+				z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+				z.avail_in = static_cast<uInt>(length);
+				for (;;)
+				{
+					// Zeros after a whole member, as a tape or a block
+					// device pads a file, end the stream; no member begins
+					// with one. Anything after them is corrupt.
+					if (member_ended && z.avail_in && (padded || !*z.next_in))
+					{
+						padded = true;
+						while (z.avail_in && !*z.next_in)
+						{
+							++z.next_in;
+							--z.avail_in;
+						}
+						if (z.avail_in)
+							throw std::runtime_error("Corrupt gzip data");
+						break;
+					}
+
+					int r = inflate(&z, Z_NO_FLUSH);
+					if (r == Z_STREAM_END)
+					{
+						// another member may follow
+						member_ended = true;
+						inflateReset(&z);
+					}
+					else if (r == Z_OK)
+						member_ended = false;
+					else if (r != Z_BUF_ERROR || (z.avail_in && z.avail_out))
+						throw std::runtime_error("Corrupt gzip data");
+
+					if (!z.avail_out)
+					{
+						if (!filled.push({ b, buffer_size }, stop) || !empty.pop(b, stop))
+							return;
+						z.next_out = reinterpret_cast<Bytef*>(buffer(b));
+						z.avail_out = static_cast<uInt>(buffer_size);
+						continue;
+					}
+					if (!z.avail_in)
+						break;
+				}
+				if (stop.load(std::memory_order_acquire))
+					return;
+			}
+			if (!member_ended)
+				throw std::runtime_error("Truncated gzip data");
+
+			size_t got = buffer_size - z.avail_out;
+			if (got && !filled.push({ b, got }, stop))
+				return;
+			filled.push({ chunk_end, 0 }, stop);
+		}
+#else
+		void inflate_loop()
+		{
+		}
+#endif
+	};
+
+	GzipReader::GzipReader(const std::string& path, size_t buffer_size)
+		: GzipReader(open_input(path), buffer_size)
+	{
+	}
+
+	GzipReader::GzipReader(int fd, size_t buffer_size)
+	{
+#ifndef LAB_ZLIB
+		close_input(fd);
+		throw std::runtime_error("Reading gzip files needs a build with zlib");
+#endif
+		// zlib counts in 32 bits
+		buffer_size = std::min<size_t>(buffer_size, size_t(1) << 30);
+		_inflater.reset(new Inflater(fd, buffer_size));
+		Inflater& p = *_inflater;
+		p.allocate(buffer_size);
+		p.producer = std::thread([&p] { p.produce(); });
+	}
+
+	GzipReader::~GzipReader()
+	{
+		_inflater->stop = true;
+		if (_inflater->producer.joinable())
+			_inflater->producer.join();
+	}
+
+	uint64_t GzipReader::size() const
+	{
+		return _inflater->size;
+	}
+
+	const char* GzipReader::next(size_t& length)
+	{
+		return _inflater->next(length);
+	}
+
+	bool is_gzip_path(const std::string& path)
+	{
+		return path.length() > 3 && path.compare(path.length() - 3, 3, ".gz") == 0;
+	}
+
+	std::unique_ptr<ChunkReader> open_chunk_reader(const std::string& path)
+	{
+		if (is_gzip_path(path))
+			return std::unique_ptr<ChunkReader>(new GzipReader(path));
+		return std::unique_ptr<ChunkReader>(new PipelinedReader(path));
+	}
+
+} // lab
@@ -0,0 +1,187 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+
+	// The binary formats store values in the host's byte order, and are
+	// read in place or copied out with memcpy, never swapped. Their files
+	// say little endian, and each of their readers refuses a big endian
+	// host at compile time.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+	const bool host_little_endian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+#elif defined(_WIN32)
+	const bool host_little_endian = true;	// every Windows target is
+#else
+#error "The byte order of this host is unknown"
+#endif
+
+	// opens path for writing, truncating it. "-" is standard output.
+	int open_output_fd(const std::string& path);
+	void close_output_fd(int fd);
+
+	// opens path for appending after its first size bytes, creating it if
+	// need be; whatever followed them is cut off
+	int open_append_fd(const std::string& path, uint64_t size);
+
+	// writes all of data, retrying on partial writes. throws on failure.
+	void write_fully(int fd, const void* data, size_t len);
+
+	// writes count pieces in order, as if one after another, gathering as
+	// many as it can into each writev where the platform has it
+	void write_fully(int fd, const std::string_view* pieces, size_t count);
+
+	// A fixed size write buffer over a file descriptor, or over a string
+	// that it appends to. Small appends are coalesced; appends larger than
+	// the buffer bypass it.
+	class OutputBuffer
+	{
+	public:
+		explicit OutputBuffer(int fd, size_t capacity = 64 * 1024);
+		explicit OutputBuffer(std::string& sink, size_t capacity = 64 * 1024);
+		~OutputBuffer();
+
+		OutputBuffer(const OutputBuffer&) = delete;
+		OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+		void append(const char* data, size_t len)
+		{
+			if (len > _buffer.size() - _used)
+			{
+				flush();
+				if (len >= _buffer.size())
+				{
+					drain(data, len);
+					return;
+				}
+			}
+			memcpy(&_buffer[_used], data, len);
+			_used += len;
+		}
+		void append(char c)
+		{
+			if (_used == _buffer.size())
+				flush();
+			_buffer[_used++] = c;
+		}
+		void append(const char* str) { append(str, strlen(str)); }
+		void append(std::string_view s) { append(s.data(), s.length()); }
+
+		void flush();
+
+	private:
+		void drain(const char* data, size_t len);
+
+		int _fd = -1;
+		std::string* _sink = nullptr;
+		std::vector<char> _buffer;
+		size_t _used = 0;
+	};
+
+	// A read only view of a whole file. The file is memory mapped where the
+	// platform allows, otherwise it is read into memory.
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const char* data() const { return _data; }
+		size_t size() const { return _size; }
+
+	private:
+		const char* _data = nullptr;
+		size_t _size = 0;
+		std::vector<char> _fallback;
+	};
+
+	// The bytes of a file, delivered in order a chunk at a time.
+	class ChunkReader
+	{
+	public:
+		virtual ~ChunkReader() {}
+
+		// the number of bytes expected in all, or 0 if that isn't known;
+		// only a hint, for sizing
+		virtual uint64_t size() const = 0;
+
+		// The next chunk, or nullptr at the end. A chunk stays valid until
+		// the next call. Throws if the data can't be read.
+		virtual const char* next(size_t& length) = 0;
+	};
+
+	// Reads a file ahead of its consumer, so that reading overlaps with
+	// whatever is done with the data. A producer fills a few fixed size
+	// buffers, through io_uring on Linux where the kernel allows it and
+	// with a reading thread otherwise, and hands them over in file order
+	// through an SpscRing. The file may be a pipe.
+	class PipelinedReader : public ChunkReader
+	{
+	public:
+		explicit PipelinedReader(const std::string& path, size_t buffer_size = 1024 * 1024);
+		// takes ownership of an open file descriptor
+		explicit PipelinedReader(int fd, size_t buffer_size = 1024 * 1024);
+		~PipelinedReader();
+
+		PipelinedReader(const PipelinedReader&) = delete;
+		PipelinedReader& operator=(const PipelinedReader&) = delete;
+
+		// the size of a regular file when opened, otherwise 0
+		uint64_t size() const override;
+		bool uses_io_uring() const;
+
+		const char* next(size_t& length) override;
+
+	private:
+		struct Pipeline;
+		std::unique_ptr<Pipeline> _pipeline;
+	};
+
+	// Inflates a gzip file as it is read. The compressed file comes in
+	// through a PipelinedReader and is inflated on a thread of its own, so
+	// reading, inflating, and the consumer all overlap, and no more than a
+	// few buffers of either form are held at once. Concatenated members
+	// are inflated in turn, as gunzip does, and zeros padding the file
+	// after the last member are ignored. Builds without zlib throw on
+	// construction.
+	class GzipReader : public ChunkReader
+	{
+	public:
+		explicit GzipReader(const std::string& path, size_t buffer_size = 1024 * 1024);
+		// takes ownership of an open file descriptor
+		explicit GzipReader(int fd, size_t buffer_size = 1024 * 1024);
+		~GzipReader();
+
+		GzipReader(const GzipReader&) = delete;
+		GzipReader& operator=(const GzipReader&) = delete;
+
+		// the inflated size recorded in the trailer of a regular file,
+		// which gzip keeps modulo 4GB, otherwise 0
+		uint64_t size() const override;
+
+		const char* next(size_t& length) override;
+
+	private:
+		struct Inflater;
+		std::unique_ptr<Inflater> _inflater;
+	};
+
+	bool is_gzip_path(const std::string& path);
+
+	// a GzipReader for a path ending in .gz, otherwise a PipelinedReader
+	std::unique_ptr<ChunkReader> open_chunk_reader(const std::string& path);
+
+} // lab
@@ -484,7 +484,7 @@ bool OptionParser::Verbose()
     return optionParserVerbose;
 }
 
-void Verbose(bool v)
+void OptionParser::Verbose(bool v)
 {
     optionParserVerbose = v;
 }
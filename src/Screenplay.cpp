@@ -3,8 +3,20 @@
 // Copyright: Nick Porcino, 2017
 
 #include "Screenplay.h"
+#include "FileIO.h"
+#include "Utf8.h"
 #include <LabText/TextScanner.h>
 #include <LabText/TextScanner.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#endif
 
 
 namespace lab
@@ -14,47 +26,99 @@ namespace lab
 
 	std::string ScriptNode::as_string() const
 	{
+		std::string key(this->key);
+		std::string content(this->content);
 		switch (kind)
 		{
-		case NodeKind::KeyValue: return key + ": " + content;
-		case NodeKind::Divider: return content + "\n";
+		case NodeKind::KeyValue:
+			if (content.find('\n') == std::string::npos)
+				return content.length() ? key + ": " + content : key + ":";
+			else
+			{
+				std::string r = key + ":";
+				size_t b = 0;
+				for (size_t e; (e = content.find('\n', b)) != std::string::npos; b = e + 1)
+					r += "\n    " + content.substr(b, e - b);
+				return r + "\n    " + content.substr(b);
+			}
+		case NodeKind::Divider: return content;
 		case NodeKind::Character:
-		case NodeKind::Location: return content + "\n";
-		case NodeKind::Action: return content + "\n";
-		case NodeKind::Dialog: return key + "\n" + content;
-		case NodeKind::Direction: return content + "\n";
-		case NodeKind::Transition: return ToUpper(content) + "\n";
+		case NodeKind::Location: return content;
+		case NodeKind::Action: return content;
+		case NodeKind::Dialog:
+		case NodeKind::DualDialog:
+			if (extension.length())
+				key += " " + std::string(extension);
+			if (kind == NodeKind::DualDialog)
+				key += " ^";
+			return content.length() ? key + "\n" + content : key;
+		case NodeKind::Direction: return content;
+		case NodeKind::Transition: return ToUpper(content);
+		case NodeKind::Parenthetical: return content;
+		case NodeKind::Centered: return "> " + content + " <";
+		case NodeKind::Lyric:
+			{
+				std::string r = "~";
+				for (char c : content)
+				{
+					r += c;
+					if (c == '\n')
+						r += '~';
+				}
+				return r;
+			}
+		case NodeKind::Section: return key + " " + content;
+		case NodeKind::Synopsis: return "= " + content;
+		case NodeKind::Note: return "[[" + content + "]]";
+		case NodeKind::Boneyard: return "/*" + content + "*/";
+		case NodeKind::Unknown:
 			break;
 		}
 
 		return "";
 	}
 
-	Sequence::Sequence(const std::string & name_, const std::string & location_, bool interior, bool exterior)
-		: interior(interior), exterior(exterior)
+	Sequence::Sequence(const std::string & name_, const std::string & location_, bool interior, bool exterior, const allocator_type& a)
+		: name(a), location(a), scene_number(a), interior(interior), exterior(exterior), nodes(a)
 	{
 		name = TextScanner::StripLeadingWhitespace(name_);
 		if (name.length() < 5)
-		{
-			std::string zeroes("00000");
-			name = zeroes.substr(0, 5 - name.length()) + name;
-		}
+			name.insert(size_t(0), 5 - name.length(), '0');
 		location = TextScanner::StripLeadingWhitespace(location_);
 	}
 
-	Sequence::Sequence(Sequence && rh)
-		: name(rh.name), location(rh.location), interior(rh.interior), exterior(rh.exterior)
+	// a vector grows by moving its elements only if they can't throw
+	static_assert(std::is_nothrow_move_constructible<ScriptNode>::value, "ScriptNode must move without throwing");
+	static_assert(std::is_nothrow_move_constructible<Sequence>::value, "Sequence must move without throwing");
+
+	// nodes are moved rather than swapped; swapping containers with
+	// different memory resources is undefined
+	Sequence::Sequence(Sequence && rh) noexcept
+		: name(std::move(rh.name)), location(std::move(rh.location)), scene_number(std::move(rh.scene_number))
+		, interior(rh.interior), exterior(rh.exterior), nodes(std::move(rh.nodes))
+	{
+	}
+
+	Sequence::Sequence(const Sequence & rh, const allocator_type& a)
+		: name(rh.name, a), location(rh.location, a), scene_number(rh.scene_number, a)
+		, interior(rh.interior), exterior(rh.exterior), nodes(rh.nodes, a)
 	{
-		nodes.swap(rh.nodes);
 	}
 
-	Sequence & Sequence::operator=(Sequence && rh)
+	Sequence::Sequence(Sequence && rh, const allocator_type& a)
+		: name(std::move(rh.name), a), location(std::move(rh.location), a), scene_number(std::move(rh.scene_number), a)
+		, interior(rh.interior), exterior(rh.exterior), nodes(std::move(rh.nodes), a)
+	{
+	}
+
+	Sequence & Sequence::operator=(Sequence && rh) noexcept
 	{
 		interior = rh.interior;
 		exterior = rh.exterior;
-		name = rh.name;
-		location = rh.location;
-		nodes.swap(rh.nodes);
+		name = std::move(rh.name);
+		location = std::move(rh.location);
+		scene_number = std::move(rh.scene_number);
+		nodes = std::move(rh.nodes);
 		return *this;
 	}
 
@@ -67,120 +131,144 @@ namespace lab
 			res = "INT. ";
 		else if (exterior)
 			res = "EXT. ";
-		return /*name + ": " +*/ res + location;
+		return /*name + ": " +*/ res + std::string(location);
 	}
 
+	Script::Script(std::pmr::memory_resource* resource)
+		: title(resource)
+		, characters(resource)
+		, sets(resource)
+		, sequences(resource)
+		, sequence_index(resource)
+		, character_names(resource)
+		, character_ids(resource)
+	{
+	}
 
 	Script::Script(Script && rh) noexcept
-		: title(std::move(rh.title))
+		: _arena_upstream(std::move(rh._arena_upstream))
+		, _arena(std::move(rh._arena))
+		, title(std::move(rh.title))
 		, characters(std::move(rh.characters))
 		, sets(std::move(rh.sets))
 		, sequences(std::move(rh.sequences))
 		, sequence_index(std::move(rh.sequence_index))
+		, source_map(std::move(rh.source_map))
+		, character_names(std::move(rh.character_names))
+		, character_ids(std::move(rh.character_ids))
 	{
 	}
 
 #ifdef _MSC_VER
-	inline FILE* open_file(const filesystem::path& p)
+	inline int open_file(const filesystem::path& p)
 	{
-		return _wfopen(p.c_str(), L"r");
+		return _wopen(p.c_str(), _O_RDONLY | _O_BINARY);
 	}
 #else
-	inline FILE* open_file(const filesystem::path& p)
+	inline int open_file(const filesystem::path& p)
 	{
-		return std::fopen(p.c_str(), "r");
+		return ::open(p.c_str(), O_RDONLY);
 	}
 #endif
 
 
-	bool isLineContinuation(const string & s)
+	// The line classifiers below work on views of the source and never
+	// allocate. Each one looks at a line a bounded number of times, so
+	// parsing is linear in the size of the input however it is shaped.
+
+	inline bool is_blank(char c)
 	{
-		if (s.length() < 1)
-			return false;
-		return s[0] == '\t' || (s[0] == ' ');
+		return c == ' ' || c == '\t';
 	}
 
-	string parseValue(const string & s, const vector<string> & lines, size_t & i)
+	string_view strip_leading(string_view s)
 	{
-		string result;
-		size_t off = s.find(':');
-		if (off != string::npos)
-			result = s.substr(off);
-
-		size_t line = i + 1;
-		while (isLineContinuation(lines[line])) {
-			result += lines[line];
-			++line;
-		}
-		i = line - 1;
-		return StripLeadingWhitespace(result);
+		size_t i = 0;
+		while (i < s.length() && is_blank(s[i]))
+			++i;
+		return s.substr(i);
 	}
 
-	bool lineIsUpperCase(const char * curr, const char * end)
+	string_view strip_trailing(string_view s)
 	{
-		const char * next = tsScanForBeginningOfNextLine(curr, end);
-		while (next > curr) {
-			if (*curr >= 'a' && *curr <= 'z')
-				return false;
-			++curr;
-		}
-		return true;
+		size_t i = s.length();
+		while (i > 0 && (is_blank(s[i - 1]) || s[i - 1] == '\r' || s[i - 1] == '\n'))
+			--i;
+		return s.substr(0, i);
 	}
 
-	bool charIsEmphasis(char c) {
-		return c == '*' || c == '_';
+	bool isLineContinuation(string_view s)
+	{
+		if (s.length() < 1)
+			return false;
+		return s[0] == '\t' || (s[0] == ' ');
 	}
 
-#ifdef _MSC_VER
-#define strnicmp _strnicmp
-#endif
+	// true if the line has no lowercase letters, in ASCII or in the Latin,
+	// Greek, and Cyrillic ranges, so that cues such as JOSÉ or ЕЛЕНА are
+	// recognized and lowercase action in those scripts is not taken for one
+	inline bool lineIsUpperCase(string_view s)
+	{
+		return utf8_has_no_lowercase(s.data(), s.data() + s.length());
+	}
 
+	inline char ascii_lower(char c)
+	{
+		return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+	}
 
-	bool beginsWith(const std::string& input, const char * match)
+	// case insensitive prefix test, bounded by the length of match
+	bool beginsWith(string_view input, const char * match)
 	{
-		return !strnicmp(input.c_str(), match, (strlen(match)));
+		size_t i = 0;
+		for (; match[i]; ++i)
+		{
+			if (i >= input.length() || ascii_lower(input[i]) != ascii_lower(match[i]))
+				return false;
+		}
+		return true;
 	}
 
 
-	string parseShot(const std::string & input, bool & interior, bool & exterior)
+	string_view parseShot(string_view input, bool & interior, bool & exterior)
 	{
 		interior = false;
 		exterior = false;
 
 		if (input.length() < 2)
-			return "";
+			return string_view();
 
 		if (input[0] == '.')
-			return StripLeadingWhitespace(input.substr(1));
+			return strip_leading(input.substr(1));
 
 		if (beginsWith(input, "INT./EXT.") || beginsWith(input, "EXT./INT.")) {
 			interior = true;
 			exterior = true;
-			return StripLeadingWhitespace(input.substr(9));
+			return strip_leading(input.substr(9));
 		}
 
 		if (beginsWith(input, "INT./EXT") || beginsWith(input, "EXT./INT")) {
 			interior = true;
 			exterior = true;
-			return StripLeadingWhitespace(input.substr(8));
+			return strip_leading(input.substr(8));
 		}
 
 		if (beginsWith(input, "INT/EXT") || beginsWith(input, "EXT/INT")) {
 			interior = true;
 			exterior = true;
-			return StripLeadingWhitespace(input.substr(7));
+			return strip_leading(input.substr(7));
 		}
 
 		if (beginsWith(input, "INT ") || beginsWith(input, "EXT ") || beginsWith(input, "INT.") || beginsWith(input, "EXT.") || beginsWith(input, "I/E "))
 		{
 			interior = beginsWith(input, "I");
 			exterior = beginsWith(input, "E") || beginsWith(input, "I/E ");
-			return StripLeadingWhitespace(input.substr(4));
+			return strip_leading(input.substr(4));
 		}
-		return "";
+		return string_view();
 	}
 
-	bool isShot(const std::string& input)
+	bool isShot(string_view input)
 	{
 		if (input.length() < 2)
 			return false;
@@ -194,23 +282,22 @@ namespace lab
 			|| beginsWith(input, "I/E ");
 	}
 
-	bool isTransition(const std::string & input)
+	bool isTransition(string_view input)
 	{
 		if (!input.length())
 			return false;
 
-		string s = StripLeadingWhitespace(input);
-		size_t len = s.length() - 1;
-		if (len < 4)
+		string_view s = strip_leading(input);
+		if (s.length() < 5)
 			return false;
 
 		if (s[0] == '>')
 			return true;
 
-		if (!lineIsUpperCase(input.c_str(), input.c_str() + input.length()))
+		if (!lineIsUpperCase(input))
 			return false;
 
-		const char * transitions[] =
+		static const char * transitions[] =
 		{
 			"CUT TO BLACK:",
 			"CUT TO:",
@@ -225,24 +312,29 @@ namespace lab
 			"END CREDITS:"
 		};
 
-		for (auto str : transitions)
-			if (s.find(str) != string::npos)
-				return true;
+		// every transition ends in a colon; only search if there is one
+		if (s.find(':') != string_view::npos)
+			for (auto str : transitions)
+				if (s.find(str) != string_view::npos)
+					return true;
 
-		string end = s.substr(len - 3, len - 2);
+		// the last four characters, as in "CUT TO:" or "SMASH IN."
+		string_view end = s.substr(s.length() - 4);
 		return beginsWith(end, " TO") || beginsWith(end, " IN");
 	}
 
-	string parseTransition(const std::string & input)
+	string_view parseTransition(string_view input)
 	{
-		string r = StripLeadingWhitespace(input);
-		if (r[0] == '>')
+		string_view r = strip_leading(input);
+		if (r.length() && r[0] == '>')
 			r = r.substr(1);
 
-		return StripTrailingWhitespace(StripLeadingWhitespace(r));
+		return strip_trailing(strip_leading(r));
 	}
 
-	bool isDialog(const std::string & input)
+	// a cue is a name in capitals, holding at least one letter, and may
+	// be followed by an extension in either case, as in HANS (on the radio)
+	bool isDialog(string_view input)
 	{
 		if (input.length() < 2)
 			return false;
@@ -253,190 +345,1472 @@ namespace lab
 		if (isTransition(input))
 			return false;
 
-		return lineIsUpperCase(input.c_str(), input.c_str() + input.length());
+		string_view name = input.substr(0, input.find('('));
+		bool letter = false;
+		for (char c : name)
+			if ((c >= 'A' && c <= 'Z') || static_cast<unsigned char>(c) >= 0x80)
+			{
+				letter = true;
+				break;
+			}
+
+		return letter && lineIsUpperCase(name);
 	}
 
-	string parseDialog(const string& s, string& character, const vector<string>& lines, size_t & i)
+	string_view splitCue(string_view cue, string_view& extension)
 	{
-		if (s[0] == '@')
-			character = s.substr(1);
-		else
-			character = s;
+		size_t open = cue.find('(');
+		string_view name = strip_trailing(cue.substr(0, open));
+		// a cue that is only a parenthetical, as @(HUMMING), is all name
+		if (open == string_view::npos || name.empty())
+		{
+			extension = string_view();
+			return strip_trailing(cue);
+		}
+		extension = strip_trailing(cue.substr(open));
+		return name;
+	}
 
-		string result;
+	// ASCII letters to upper case, and white space to a space; every other
+	// ASCII byte is itself
+	struct CharacterFold
+	{
+		unsigned char map[128];
 
-		size_t line = i + 1;
-		while (line < lines.size() && lines[line].length() > 0) {
-			result += lines[line] + "\n";
-			++line;
+		CharacterFold()
+		{
+			for (int c = 0; c < 128; ++c)
+				map[c] = static_cast<unsigned char>(c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
+			for (unsigned char c : { '\t', '\n', '\v', '\f', '\r' })
+				map[c] = ' ';
 		}
-		i = line - 1;
-		return result;
+	};
+	static const CharacterFold character_fold;
+
+	void canonicalCharacter(string_view name, string& canonical)
+	{
+		canonical.clear();
+		canonical.reserve(name.length());
+		bool space = false;
+		const char* end = name.data() + name.length();
+		for (const char* p = name.data(); p < end;)
+		{
+			unsigned char c = static_cast<unsigned char>(*p);
+			char folded[4] = { *p };
+			size_t length = 1;
+			size_t n = 1;
+			if (c < 0x80)
+				folded[0] = static_cast<char>(character_fold.map[c]);
+			else
+			{
+				// letters of other scripts by the UTF-8 case table; a byte
+				// that is not valid UTF-8 is kept as it is
+				uint32_t cp;
+				n = utf8_decode(p, end, cp);
+				if (n)
+					length = utf8_encode(to_upper(cp), folded);
+				else
+					n = 1;
+			}
+			p += n;
+			if (folded[0] == ' ')
+				space = canonical.length() > 0;
+			else
+			{
+				if (space)
+					canonical += ' ';
+				canonical.append(folded, length);
+				space = false;
+			}
+		}
+	}
+
+	uint32_t Script::add_character(string_view name)
+	{
+		string canonical;
+		canonicalCharacter(name, canonical);
+		if (canonical.empty())
+			return ScriptNode::no_character;
+		auto i = character_ids.find(string_view(canonical));
+		if (i != character_ids.end())
+			return i->second;
+		uint32_t id = static_cast<uint32_t>(character_names.size());
+		character_ids.emplace(canonical, id);
+		character_names.emplace_back(strip_trailing(strip_leading(name)));
+		characters.emplace(character_names.back());
+		return id;
+	}
+
+	uint32_t Script::character_id(string_view cue) const
+	{
+		string_view extension;
+		string canonical;
+		canonicalCharacter(splitCue(strip_leading(cue), extension), canonical);
+		auto i = character_ids.find(string_view(canonical));
+		return i == character_ids.end() ? ScriptNode::no_character : i->second;
+	}
+
+	// Fountain is parsed one line at a time by a state machine. Each line is
+	// classified on its own, then line_ops gives what to do with that class
+	// of line in the current state. Boneyards and notes may span lines and
+	// hide everything in them, so they are followed before classification.
+	// A possible cue must be followed by a line of dialogue, so it is held
+	// for one line; nothing is ever scanned twice.
+
+	enum class LineClass : uint8_t
+	{
+		Blank, Heading, TitleKey, PageBreak, Section, Synopsis, Centered,
+		Transition, Lyric, Parenthetical, Cue, ForcedAction, Text,
+		Count
+	};
+
+	enum class ParseState : uint8_t
+	{
+		TitlePage, Idle, Action, Dialogue, Lyric,
+		Count
+	};
+
+	enum class LineOp : uint8_t
+	{
+		Text,			// action, continuing the paragraph in Action
+		ForcedAction,	// ! action
+		EndBlock,		// a blank line closes the open node
+		TitleEnd,		// a blank line ends the title page, once it has a key
+		Heading,
+		TitleKey,
+		TitleValue,		// an indented continuation of a title page value
+		PageBreak,
+		Section,
+		Synopsis,
+		Centered,
+		Transition,
+		Lyric,
+		Cue,			// held until the next line shows whether it is one
+		DialogueText,
+		Parenthetical,
+	};
+
+	const size_t line_class_count = static_cast<size_t>(LineClass::Count);
+
+	// [ParseState][LineClass], columns in LineClass order
+	const LineOp line_ops[static_cast<size_t>(ParseState::Count)][line_class_count] =
+	{
+		// TitlePage; anything but a key or its value ends the title page
+		{ LineOp::TitleEnd, LineOp::Heading, LineOp::TitleKey, LineOp::TitleValue, LineOp::TitleValue, LineOp::TitleValue, LineOp::TitleValue,
+		  LineOp::TitleValue, LineOp::TitleValue, LineOp::TitleValue, LineOp::TitleValue, LineOp::TitleValue, LineOp::TitleValue },
+		// Idle, after a blank line
+		{ LineOp::EndBlock, LineOp::Heading, LineOp::Text, LineOp::PageBreak, LineOp::Section, LineOp::Synopsis, LineOp::Centered,
+		  LineOp::Transition, LineOp::Lyric, LineOp::Text, LineOp::Cue, LineOp::ForcedAction, LineOp::Text },
+		// Action; transitions and cues need a blank line before them
+		{ LineOp::EndBlock, LineOp::Heading, LineOp::Text, LineOp::PageBreak, LineOp::Section, LineOp::Synopsis, LineOp::Centered,
+		  LineOp::Text, LineOp::Lyric, LineOp::Text, LineOp::Text, LineOp::ForcedAction, LineOp::Text },
+		// Dialogue; everything up to a blank line is spoken
+		{ LineOp::EndBlock, LineOp::Heading, LineOp::DialogueText, LineOp::PageBreak, LineOp::DialogueText, LineOp::DialogueText, LineOp::DialogueText,
+		  LineOp::DialogueText, LineOp::DialogueText, LineOp::Parenthetical, LineOp::DialogueText, LineOp::DialogueText, LineOp::DialogueText },
+		// Lyric
+		{ LineOp::EndBlock, LineOp::Heading, LineOp::Text, LineOp::PageBreak, LineOp::Section, LineOp::Synopsis, LineOp::Centered,
+		  LineOp::Text, LineOp::Lyric, LineOp::Text, LineOp::Text, LineOp::ForcedAction, LineOp::Text },
+	};
+
+	inline LineOp line_op(ParseState state, LineClass cls)
+	{
+		return line_ops[static_cast<size_t>(state)][static_cast<size_t>(cls)];
+	}
+
+	const char* title_page_tags[] =
+	{
+		"Title:", "Credit:", "Author:", "Source:", "Draft Date:",
+		"Notes:", "Contact:", "Copyright:"
+	};
+
+	// length of the title page key s begins with, without the colon, or 0
+	size_t title_key_length(string_view s)
+	{
+		for (auto t : title_page_tags)
+			if (beginsWith(s, t))
+				return strlen(t) - 1;
+		return 0;
+	}
+
+	// s has no leading or trailing blanks
+	LineClass classify_line(string_view s, bool title_page)
+	{
+		if (s.empty())
+			return LineClass::Blank;
+
+		switch (s[0])
+		{
+		case '.':
+			if (isShot(s))
+				return LineClass::Heading;
+			break;
+		case '=':
+			return beginsWith(s, "===") ? LineClass::PageBreak : LineClass::Synopsis;
+		case '#':
+			return LineClass::Section;
+		case '>':
+			return s.length() > 1 && s.back() == '<' ? LineClass::Centered : LineClass::Transition;
+		case '~':
+			return LineClass::Lyric;
+		case '(':
+			return LineClass::Parenthetical;
+		case '!':
+			return LineClass::ForcedAction;
+		case '@':
+			return LineClass::Cue;
+		}
+
+		if (title_page && title_key_length(s))
+			return LineClass::TitleKey;
+		if (isShot(s))
+			return LineClass::Heading;
+		if (isTransition(s))
+			return LineClass::Transition;
+		if (isDialog(s))
+			return LineClass::Cue;
+		return LineClass::Text;
+	}
+
+	enum class BlockKind : uint8_t { None, Boneyard, Note };
+
+	// Follows boneyards, /* */, and notes, [[ ]], that begin a line. Returns
+	// the kind of block line belongs to, if any, with text set to the part
+	// of the line inside it and closed set if it ends on this line. rest is
+	// set to whatever follows the close, to be parsed as a line of its own.
+	BlockKind track_block(BlockKind& block, string_view line, string_view& text, bool& closed, string_view& rest)
+	{
+		if (block == BlockKind::None)
+		{
+			string_view s = strip_leading(line);
+			if (s.length() < 2)
+				return BlockKind::None;
+			if (s[0] == '/' && s[1] == '*')
+				block = BlockKind::Boneyard;
+			else if (s[0] == '[' && s[1] == '[')
+				block = BlockKind::Note;
+			else
+				return BlockKind::None;
+			line = s.substr(2);
+		}
+
+		BlockKind kind = block;
+		size_t close = line.find(kind == BlockKind::Boneyard ? "*/" : "]]");
+		closed = close != string_view::npos;
+		text = line.substr(0, close);
+		rest = closed ? strip_leading(line.substr(close + 2)) : string_view();
+		if (closed)
+			block = BlockKind::None;
+		return kind;
+	}
+
+	// a heading ending in #1A# carries a scene number
+	string_view split_scene_number(string_view& location)
+	{
+		string_view s = strip_trailing(location);
+		if (s.length() < 3 || s.back() != '#')
+			return string_view();
+		size_t open = s.rfind('#', s.length() - 2);
+		if (open == string_view::npos || open + 2 == s.length())
+			return string_view();
+		string_view number = s.substr(open + 1, s.length() - open - 2);
+		for (char c : number)
+			if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '.')
+				return string_view();
+		location = strip_trailing(s.substr(0, open));
+		return number;
 	}
 
 	struct ScriptEdit
 	{
+		ScriptEdit(Script* script, Sequence* sequence, ParseState state = ParseState::Idle)
+			: script(script), curr_sequence(sequence), curr_node(script->get_allocator()), state(state)
+		{
+		}
+
 		Script* script = nullptr;
 		Sequence* curr_sequence = nullptr;
-		ScriptNode curr_node;
-
-		void start_node(NodeKind kind, const std::string& value)
+		ScriptNode curr_node;	// in the script's resource, so it moves into place without a copy
+
+		ParseState state;
+		BlockKind block = BlockKind::None;
+		// copies, so that a line need not outlive its call to parse_line;
+		// the streaming parser reuses its buffers
+		string pending_cue;		// the line of a possible cue, not yet confirmed
+		string cue;				// the speaker of the current dialogue
+		string cue_extension;	// and the cue's extensions, as (V.O.)
+		NodeKind cue_kind = NodeKind::Dialog;
+
+		void start_node(NodeKind kind, string_view value)
 		{
 			finalize_current_node();
-			curr_node = { kind, value, "" };
+			curr_node.kind = kind;
+			curr_node.key.assign(value.data(), value.length());
 
-			if (kind == NodeKind::Dialog)
+			// the value of a dialog or parenthetical node is the name from
+			// the current cue; the extension is kept apart from it so that
+			// MARY and MARY (V.O.) are the same character
+			if (isDialogKind(kind) || kind == NodeKind::Parenthetical)
 			{
-				/// @TODO how to interpret a value with parentheses? What does the spec say...?
-				script->characters.insert(value);
+				curr_node.extension.assign(cue_extension);
+				curr_node.character = script->add_character(value);
 			}
 		}
 		void finalize_current_node()
 		{
 			if (curr_node.kind != NodeKind::Unknown)
 			{
-				curr_sequence->nodes.push_back(curr_node);
+				curr_sequence->nodes.push_back(std::move(curr_node));
 				curr_node.kind = NodeKind::Unknown;
-				curr_node.key = "";
-				curr_node.content = "";
+				curr_node.key.clear();
+				curr_node.extension.clear();
+				curr_node.content.clear();
+				curr_node.character = ScriptNode::no_character;
 			}
 		}
-		void append_text(const std::string& s)
+		void append_text(string_view s)
 		{
 			if (curr_node.kind == NodeKind::Unknown)
 				curr_node.kind = NodeKind::Action;
 			if (curr_node.content.size())
 				curr_node.content += '\n';
-			curr_node.content += s;
+			curr_node.content.append(s.data(), s.length());
+		}
+		void add_node(NodeKind kind, string_view key, string_view content)
+		{
+			start_node(kind, key);
+			curr_node.content.assign(content.data(), content.length());
+			finalize_current_node();
+		}
+
+		// a held cue with no dialogue after it was action all along
+		void pending_cue_is_action()
+		{
+			start_node(NodeKind::Action, string_view());
+			append_text(pending_cue);
+			pending_cue.clear();
+			state = ParseState::Action;
+		}
+		void pending_cue_is_cue()
+		{
+			start_node(cue_kind, cue);
+			pending_cue.clear();
+			state = ParseState::Dialogue;
 		}
 
 		void start_sequence(const string& name, const string& location, bool interior, bool exterior)
 		{
 			finalize_current_sequence();
-			script->sequences.emplace_back(Sequence(name, location, interior, exterior));
+			script->sequences.emplace_back(name, location, interior, exterior);
 
-            auto set_name = ToUpper(script->sequences.back().as_string());                        
-            script->sets.insert(set_name);
+            auto set_name = ToUpper(script->sequences.back().as_string());
+            script->sets.emplace(set_name);
 			curr_sequence = &script->sequences.back();
 			script->sequence_index[curr_sequence->name] = script->sequences.size() - 1;
+			state = ParseState::Idle;
 		}
 		void finalize_current_sequence()
 		{
+			if (pending_cue.length())
+				pending_cue_is_action();
 			finalize_current_node();
 			curr_sequence = nullptr;
 		}
 	};
 
 
-	Script Script::parseFountain(const std::string& text)
+	// Calls fn(begin, end) for each line of text, without the terminator.
+	// Lines end at \n, \r\n, or \r; a final terminator does not start
+	// another, empty, line. The eager and lazy parsers both split with this
+	// so that they see exactly the same lines.
+	template <typename Fn>
+	void for_each_line(const char* begin, const char* end, Fn fn)
 	{
-		Script script;
-		ScriptEdit edit = { &script, &script.title };
-		std::vector<std::string> lines = TextScanner::SplitLines(text);
+		const char* curr = begin;
+		while (curr < end)
+		{
+			const char* eol = curr;
+			while (eol < end && *eol != '\n' && *eol != '\r')
+				++eol;
+			const char* next = eol;
+			if (next < end && *next == '\r')
+				++next;
+			if (next < end && *next == '\n' && (next == eol || *eol == '\r'))
+				++next;
+			if (next == eol)
+				next = end;
+			fn(curr, eol, next);
+			curr = next;
+		}
+	}
 
-		const char* title_page_tags[] =
+	void start_heading(ScriptEdit& edit, string_view s)
+	{
+		bool interior, exterior;
+		string_view location = parseShot(s, interior, exterior);
+		string_view number = split_scene_number(location);
+		string shot_name = std::to_string(edit.script->sequences.size() + 1);
+		edit.start_sequence(shot_name, string(location), interior, exterior);
+		edit.curr_sequence->scene_number.assign(number.data(), number.length());
+	}
+
+	void parse_line(ScriptEdit& edit, string_view line)
+	{
+		// A line may hold any number of notes and boneyards, each opening
+		// where the one before closed. What follows the last to close is
+		// parsed as a line of its own, but never as a heading, so that the
+		// skim of a LazyScript need not look past blocks for one.
+		bool after_block = false;
+		for (;;)
 		{
-			"Title:", "Credit:", "Author:", "Source:", "Draft Date:",
-			"Notes:", "Contact:", "Copyright:"
-		};
+			bool open = edit.block != BlockKind::None;
+			string_view text;
+			bool closed;
+			string_view rest;
+			BlockKind block = track_block(edit.block, line, text, closed, rest);
+			if (block == BlockKind::None)
+				break;
+			if (!open)
+			{
+				if (edit.pending_cue.length())
+					edit.pending_cue_is_action();
+				edit.start_node(block == BlockKind::Note ? NodeKind::Note : NodeKind::Boneyard, string_view());
+				edit.state = ParseState::Idle;
+			}
+			else
+				edit.curr_node.content += '\n';
+			edit.curr_node.content.append(text.data(), text.length());
+			if (!closed)
+				return;
+			edit.finalize_current_node();
+			if (!strip_trailing(rest).length())
+				return;
+			line = rest;
+			after_block = true;
+		}
+
+		string_view s = strip_trailing(strip_leading(line));
+		LineClass cls = classify_line(s, edit.state == ParseState::TitlePage);
+		if (after_block && cls == LineClass::Heading)
+			cls = LineClass::Text;
 
-		for (auto& line : lines)
+		if (edit.pending_cue.length())
 		{
-			auto s = StripLeadingWhitespace(line);
+			if (cls == LineClass::Blank || cls == LineClass::Heading || cls == LineClass::PageBreak)
+				edit.pending_cue_is_action();
+			else
+				edit.pending_cue_is_cue();
+		}
 
-			if (beginsWith(s, "==="))
+		switch (line_op(edit.state, cls))
+		{
+		case LineOp::TitleValue:
+			if (edit.curr_node.kind == NodeKind::KeyValue && isLineContinuation(line))
 			{
-				edit.start_node(NodeKind::Divider, s);
-				edit.finalize_current_node();
-				continue;
+				edit.append_text(s);
+				return;
 			}
+			// not part of the title page after all
+			edit.state = ParseState::Idle;
+			cls = classify_line(s, false);
+			break;
+		default:
+			break;
+		}
 
-			bool titled = false;
-			for (auto t : title_page_tags)
-			{
-				if (beginsWith(s, t))
+		switch (line_op(edit.state, cls))
+		{
+		case LineOp::Text:
+			if (edit.state != ParseState::Action)
+				edit.start_node(NodeKind::Action, string_view());
+			edit.append_text(s);
+			edit.state = ParseState::Action;
+			break;
+
+		case LineOp::ForcedAction:
+			if (edit.state != ParseState::Action)
+				edit.start_node(NodeKind::Action, string_view());
+			edit.append_text(s.substr(1));
+			edit.state = ParseState::Action;
+			break;
+
+		case LineOp::EndBlock:
+			edit.finalize_current_node();
+			edit.state = ParseState::Idle;
+			break;
+
+		case LineOp::TitleEnd:
+			edit.finalize_current_node();
+			for (auto& n : edit.curr_sequence->nodes)
+				if (n.kind == NodeKind::KeyValue)
 				{
-					edit.start_node(NodeKind::KeyValue, std::string(t, strlen(t) - 1));
-					titled = true;
+					edit.state = ParseState::Idle;
 					break;
 				}
+			break;
+
+		case LineOp::Heading:
+			start_heading(edit, s);
+			break;
+
+		case LineOp::TitleKey:
+		{
+			size_t key = title_key_length(s);
+			edit.start_node(NodeKind::KeyValue, s.substr(0, key));
+			edit.append_text(strip_leading(s.substr(key + 1)));
+			break;
+		}
+
+		case LineOp::TitleValue:
+			break;	// handled above
+
+		case LineOp::PageBreak:
+			edit.add_node(NodeKind::Divider, string_view(), s);
+			edit.state = ParseState::Idle;
+			break;
+
+		case LineOp::Section:
+		{
+			size_t depth = s.find_first_not_of('#');
+			if (depth == string_view::npos)
+				depth = s.length();
+			edit.add_node(NodeKind::Section, s.substr(0, depth), strip_leading(s.substr(depth)));
+			edit.state = ParseState::Idle;
+			break;
+		}
+
+		case LineOp::Synopsis:
+			edit.add_node(NodeKind::Synopsis, string_view(), strip_leading(s.substr(1)));
+			edit.state = ParseState::Idle;
+			break;
+
+		case LineOp::Centered:
+			edit.add_node(NodeKind::Centered, string_view(), strip_trailing(strip_leading(s.substr(1, s.length() - 2))));
+			edit.state = ParseState::Idle;
+			break;
+
+		case LineOp::Transition:
+			edit.add_node(NodeKind::Transition, string_view(), ToUpper(string(parseTransition(s))));
+			edit.state = ParseState::Idle;
+			break;
+
+		case LineOp::Lyric:
+			if (edit.state != ParseState::Lyric)
+				edit.start_node(NodeKind::Lyric, string_view());
+			edit.append_text(s.substr(1));
+			edit.state = ParseState::Lyric;
+			break;
+
+		case LineOp::Cue:
+		{
+			edit.finalize_current_node();
+			edit.pending_cue.assign(s.data(), s.length());
+			string_view cue = s[0] == '@' ? s.substr(1) : s;
+			edit.cue_kind = NodeKind::Dialog;
+			if (cue.length() && cue.back() == '^')
+			{
+				edit.cue_kind = NodeKind::DualDialog;
+				cue = strip_trailing(cue.substr(0, cue.length() - 1));
 			}
-			if (titled)
-				continue;
+			string_view extension;
+			cue = splitCue(strip_leading(cue), extension);
+			edit.cue.assign(cue.data(), cue.length());
+			edit.cue_extension.assign(extension.data(), extension.length());
+			break;
+		}
 
-			if (isShot(s))
+		case LineOp::DialogueText:
+			// dialogue resumes after a parenthetical in a node of its own
+			if (!isDialogKind(edit.curr_node.kind))
+				edit.start_node(edit.cue_kind, edit.cue);
+			edit.append_text(s);
+			break;
+
+		case LineOp::Parenthetical:
+			edit.add_node(NodeKind::Parenthetical, edit.cue, s);
+			break;
+		}
+	}
+
+	// true if a line of an action node would parse as something else where
+	// it falls, and so must be written with a leading !
+	bool action_line_needs_force(string_view line, bool first, bool last, bool title_page)
+	{
+		string_view s = strip_trailing(strip_leading(line));
+		string_view text, rest;
+		bool closed;
+		BlockKind block = BlockKind::None;
+		if (track_block(block, s, text, closed, rest) != BlockKind::None)
+			return true;
+		LineOp op = line_op(first ? ParseState::Idle : ParseState::Action, classify_line(s, first && title_page));
+		if (op == LineOp::Cue)
+			return !last;	// a lone cue followed by a blank line is action
+		return op != LineOp::Text;
+	}
+
+	// nodes that run on from the one before, without a blank line between
+	bool joins_previous(const ScriptNode& prev, const ScriptNode& node)
+	{
+		if (node.kind == NodeKind::KeyValue)
+			return prev.kind == NodeKind::KeyValue;
+		if (node.kind == NodeKind::Parenthetical)
+			return isDialogKind(prev.kind) || prev.kind == NodeKind::Parenthetical;
+		return isDialogKind(node.kind) && prev.kind == NodeKind::Parenthetical
+			&& prev.key == node.key && prev.extension == node.extension;
+	}
+
+	void append_fountain(string& r, const ScriptNode& node, const ScriptNode* prev, bool title_page)
+	{
+		switch (node.kind)
+		{
+		case NodeKind::Action:
+		{
+			string_view content(node.content);
+			bool first = true;
+			for (;;)
 			{
-				bool interior, exterior;
-				string location = parseShot(s, interior, exterior);
-				string shot_name = std::to_string(script.sequences.size() + 1);
-				edit.start_sequence(shot_name, location, interior, exterior);
-				continue;
+				size_t e = content.find('\n');
+				string_view line = content.substr(0, e);
+				if (action_line_needs_force(line, first, e == string_view::npos, title_page))
+					r += '!';
+				r.append(line.data(), line.length());
+				if (e == string_view::npos)
+					break;
+				r += '\n';
+				content = content.substr(e + 1);
+				first = false;
 			}
+			return;
+		}
 
-			if (isTransition(s))
+		case NodeKind::Dialog:
+		case NodeKind::DualDialog:
+			if (prev && joins_previous(*prev, node))
 			{
-				edit.start_node(NodeKind::Transition, ToUpper(parseTransition(s)));
-				edit.finalize_current_node();
-				continue;
+				r.append(node.content.data(), node.content.length());
+				return;
 			}
+			// a cue that was forced with @ is forced again
+			if (node.extension.empty() ? !isDialog(strip_leading(string_view(node.key)))
+				: !isDialog(strip_leading(string(node.key) + " " + string(node.extension))))
+				r += '@';
+			break;
+
+		case NodeKind::Transition:
+			if (!isTransition(ToUpper(string(node.content))))
+				r += "> ";
+			break;
+
+		default:
+			break;
+		}
+		r += node.as_string();
+	}
 
-			if (isDialog(s))
+	void FountainWriter::sequence(const Sequence& seq, std::string& r)
+	{
+		if (_script_written)
+			r += '\n';
+		_sequence = &seq;
+		_prev = nullptr;
+		_sequence_written = false;
+		if (seq.name.length())
+		{
+			if (!seq.interior && !seq.exterior)
+				r += '.';
+			r += seq.as_string();
+			if (seq.scene_number.length())
 			{
-				if (s[0] == '@')
-					s = s.substr(1);
-				s = StripLeadingWhitespace(s);
+				r += " #";
+				r.append(seq.scene_number.data(), seq.scene_number.length());
+				r += '#';
+			}
+			r += '\n';
+			_script_written = _sequence_written = true;
+		}
+	}
 
-				edit.start_node(NodeKind::Dialog, s);
-				continue;
+	void FountainWriter::node(const ScriptNode& node, std::string& r)
+	{
+		if (_sequence_written && !(_prev && joins_previous(*_prev, node)))
+			r += '\n';
+		// only the first node of the title page could be read as a key
+		append_fountain(r, node, _prev, !_sequence->name.length() && !_prev);
+		r += '\n';
+		_prev = &node;
+		_script_written = _sequence_written = true;
+	}
+
+	std::string Sequence::as_fountain() const
+	{
+		string r;
+		FountainWriter writer;
+		writer.sequence(*this, r);
+		for (auto& node : nodes)
+			writer.node(node, r);
+		return r;
+	}
+
+	std::string Script::as_fountain() const
+	{
+		string r;
+		FountainWriter writer;
+		writer.sequence(title, r);
+		for (auto& node : title.nodes)
+			writer.node(node, r);
+		for (auto& seq : sequences)
+		{
+			writer.sequence(seq, r);
+			for (auto& node : seq.nodes)
+				writer.node(node, r);
+		}
+		return r;
+	}
+
+	Script Script::parseFountain(const std::string& text)
+	{
+		Script script;
+		parse(script, text);
+		return script;
+	}
+
+	Script Script::parseFountain(const std::string& text, std::pmr::memory_resource* resource)
+	{
+		Script script(resource);
+		parse(script, text);
+		return script;
+	}
+
+	Script Script::parseFountainInArena(const std::string& text)
+	{
+		Script script = inArena(text.length());
+		parse(script, text);
+		return script;
+	}
+
+	Script Script::parseFountainInArena(ChunkReader& reader, uint64_t* invalid_utf8)
+	{
+		Script script = inArena(static_cast<size_t>(reader.size()));
+		FountainStream stream(script);
+		size_t length;
+		while (const char* chunk = reader.next(length))
+			stream.feed(chunk, length);
+		stream.finish();
+		if (invalid_utf8)
+			*invalid_utf8 = stream.invalid_utf8();
+		return script;
+	}
+
+	Script Script::inArena(size_t text_length)
+	{
+		// parsed scripts take roughly twice their text; start the arena
+		// there so that most scripts fit in its first block, but let a
+		// very large corpus grow the arena rather than reserve it all
+		const size_t largest_first_block = 256 * 1024 * 1024;
+		size_t first_block = std::min(text_length, largest_first_block / 2) * 2 + 4096;
+		auto upstream = std::make_unique<CountingResource>();
+		auto arena = std::make_unique<std::pmr::monotonic_buffer_resource>(first_block, upstream.get());
+		Script script(arena.get());
+		script._arena_upstream = std::move(upstream);
+		script._arena = std::move(arena);
+		return script;
+	}
+
+	namespace
+	{
+		// what malloc takes for a block, typically: an eight byte header,
+		// rounded up to sixteen, and no less than 32
+		size_t heap_block(size_t bytes)
+		{
+			return std::max<size_t>(32, (bytes + 8 + 15) & ~size_t(15));
+		}
+
+		// a red-black tree node: color and three links, then the value
+		template <typename T>
+		constexpr size_t tree_node_bytes()
+		{
+			return (4 * sizeof(void*) + sizeof(T) + alignof(T) - 1) / alignof(T) * alignof(T);
+		}
+
+		// adds up blocks as memory_usage counts them
+		struct MemoryTally
+		{
+			explicit MemoryTally(bool arena) : arena(arena) {}
+
+			bool arena;			// blocks cost only what they ask of an arena
+			size_t allocations = 0;
+			size_t overhead = 0;
+
+			size_t block(size_t bytes)
+			{
+				if (!bytes)
+					return 0;
+				++allocations;
+				if (!arena)
+					overhead += heap_block(bytes) - bytes;
+				return bytes;
 			}
 
-			edit.append_text(s);
+			size_t string(const std::pmr::string& s)
+			{
+				// a short string lives within its object
+				const char* object = reinterpret_cast<const char*>(&s);
+				if (s.data() >= object && s.data() < object + sizeof(s))
+					return 0;
+				return block(s.capacity() + 1);
+			}
+
+			template <typename T>
+			size_t vector(const std::pmr::vector<T>& v)
+			{
+				return block(v.capacity() * sizeof(T));
+			}
+
+			template <typename Tree>
+			size_t tree_node(const Tree&)
+			{
+				return block(tree_node_bytes<typename Tree::value_type>());
+			}
+		};
+	}
+
+	MemoryUsage Script::memory_usage() const
+	{
+		MemoryUsage r;
+		MemoryTally tally(_arena != nullptr);
+		auto add_sequence = [&](const Sequence& seq)
+		{
+			r.node_strings += tally.string(seq.name) + tally.string(seq.location) + tally.string(seq.scene_number);
+			r.node_vectors += tally.vector(seq.nodes);
+			for (auto& n : seq.nodes)
+			{
+				r.node_strings += tally.string(n.key) + tally.string(n.extension) + tally.string(n.content);
+				r.node_vectors += tally.vector(n._spans);
+			}
+		};
+		add_sequence(title);
+		r.node_vectors += tally.vector(sequences);
+		for (auto& seq : sequences)
+			add_sequence(seq);
+
+		for (auto& c : characters)
+			r.containers += tally.tree_node(characters) + tally.string(c);
+		for (auto& s : sets)
+			r.containers += tally.tree_node(sets) + tally.string(s);
+		for (auto& i : sequence_index)
+			r.containers += tally.tree_node(sequence_index) + tally.string(i.first);
+		r.containers += tally.vector(character_names);
+		for (auto& name : character_names)
+			r.containers += tally.string(name);
+		for (auto& i : character_ids)
+			r.containers += tally.tree_node(character_ids) + tally.string(i.first);
+		r.allocations = tally.allocations;
+		r.overhead = tally.overhead;
+
+		// In an arena, whatever the arena has taken from the heap and not
+		// handed out live is overhead: its unused reserve, and the blocks
+		// left behind as vectors and strings grew.
+		if (_arena_upstream)
+		{
+			r.arena = _arena_upstream->bytes();
+			size_t live = r.node_strings + r.node_vectors + r.containers;
+			r.overhead = r.arena > live ? r.arena - live : 0;
 		}
 
+		// the source map is on the heap, whatever the script's resource
+		r.source_map = source_map.memory_usage();
+		if (r.source_map)
+			r.overhead += heap_block(r.source_map) - r.source_map;
+		return r;
+	}
+
+	// parses one line, and records where it and any sequence it starts are
+	void parse_source_line(ScriptEdit& edit, string_view line, uint64_t offset)
+	{
+		Script& script = *edit.script;
+		size_t sequences = script.sequences.size();
+		script.source_map.add_line(offset);
+		parse_line(edit, line);
+		if (script.sequences.size() != sequences)
+			script.source_map.add_sequence(offset);
+	}
+
+	void Script::parse(Script& script, const std::string& text)
+	{
+		ScriptEdit edit = { &script, &script.title, ParseState::TitlePage };
+
+		const char* begin = text.c_str();
+		for_each_line(begin, begin + text.length(), [&](const char* b, const char* e, const char*)
+		{
+			parse_source_line(edit, string_view(b, e - b), b - begin);
+		});
+
 		edit.finalize_current_sequence();
-		return script;
+	}
+
+	struct FountainStream::State
+	{
+		explicit State(Script& script)
+			: edit{ &script, &script.title, ParseState::TitlePage }
+		{
+		}
+
+		ScriptEdit edit;
+		string carry;				// a line begun in an earlier piece
+		uint64_t carry_offset = 0;
+		bool carry_cr = false;		// carry ended at a CR, and an LF may begin the next piece
+		uint64_t offset = 0;		// of the next piece
+		uint64_t invalid = npos;
+		bool finished = false;
+
+		void validate(const char* data, size_t length, uint64_t at)
+		{
+			if (invalid != npos)
+				return;
+			size_t bad = utf8_find_invalid(data, length);
+			if (bad != length)
+				invalid = at + bad;
+		}
+
+		void parse_carry()
+		{
+			validate(carry.data(), carry.length(), carry_offset);
+			parse_source_line(edit, carry, carry_offset);
+			carry.clear();
+			carry_cr = false;
+		}
+	};
+
+	FountainStream::FountainStream(Script& script)
+		: _state(new State(script))
+	{
+	}
+
+	FountainStream::~FountainStream()
+	{
+	}
+
+	uint64_t FountainStream::invalid_utf8() const
+	{
+		return _state->invalid;
+	}
+
+	// Lines are split exactly as for_each_line splits them. Whole lines
+	// are parsed in place; only the line running off the end of the piece
+	// is copied, to be completed by the next.
+	void FountainStream::feed(const char* data, size_t length)
+	{
+		if (!length)
+			return;
+
+		State& st = *_state;
+		const char* end = data + length;
+		const char* curr = data;
+
+		if (st.carry_cr)
+		{
+			if (curr < end && *curr == '\n')
+				++curr;
+			st.parse_carry();
+		}
+		else if (st.carry.length())
+		{
+			const char* eol = curr;
+			while (eol < end && *eol != '\n' && *eol != '\r')
+				++eol;
+			st.carry.append(curr, eol - curr);
+			if (eol == end)
+			{
+				st.offset += length;
+				return;
+			}
+			curr = eol + 1;
+			if (*eol == '\r')
+			{
+				if (curr == end)
+					st.carry_cr = true;
+				else if (*curr == '\n')
+					++curr;
+			}
+			if (!st.carry_cr)
+				st.parse_carry();
+		}
+
+		const char* region = curr;
+		while (curr < end)
+		{
+			const char* eol = curr;
+			while (eol < end && *eol != '\n' && *eol != '\r')
+				++eol;
+			if (eol == end || (*eol == '\r' && eol + 1 == end))
+			{
+				st.carry.assign(curr, eol - curr);
+				st.carry_offset = st.offset + (curr - data);
+				st.carry_cr = eol < end;
+				break;
+			}
+			const char* next = eol + 1;
+			if (*eol == '\r' && *next == '\n')
+				++next;
+			parse_source_line(st.edit, string_view(curr, eol - curr), st.offset + (curr - data));
+			curr = next;
+		}
+
+		// line breaks are ASCII, so no sequence straddles the region's ends
+		st.validate(region, curr - region, st.offset + (region - data));
+		st.offset += length;
+	}
+
+	void FountainStream::finish()
+	{
+		State& st = *_state;
+		if (st.finished)
+			return;
+		if (st.carry_cr || st.carry.length())
+			st.parse_carry();
+		st.edit.finalize_current_sequence();
+		st.finished = true;
+	}
+
+	struct ScriptBuilder::State
+	{
+		explicit State(Script& script)
+			: edit{ &script, &script.title, ParseState::Idle }
+		{
+		}
+
+		ScriptEdit edit;
+	};
+
+	ScriptBuilder::ScriptBuilder(Script& script)
+		: _state(new State(script))
+	{
+	}
+
+	ScriptBuilder::~ScriptBuilder()
+	{
+	}
+
+	void ScriptBuilder::title_entry(string_view key, string_view value)
+	{
+		// before anything that came ahead of the first heading
+		auto& nodes = _state->edit.script->title.nodes;
+		auto at = find_if(nodes.begin(), nodes.end(), [](const ScriptNode& n) { return n.kind != NodeKind::KeyValue; });
+		nodes.emplace(at, NodeKind::KeyValue, key, value);
+	}
+
+	void ScriptBuilder::heading(string_view text, string_view scene_number, uint64_t offset)
+	{
+		ScriptEdit& edit = _state->edit;
+		string_view s = strip_trailing(strip_leading(text));
+		bool interior = false, exterior = false;
+		string_view location = isShot(s) ? parseShot(s, interior, exterior) : s;
+		string_view number = split_scene_number(location);
+		if (scene_number.length())
+			number = strip_trailing(strip_leading(scene_number));
+		edit.start_sequence(std::to_string(edit.script->sequences.size() + 1), string(location), interior, exterior);
+		edit.curr_sequence->scene_number.assign(number.data(), number.length());
+		edit.script->source_map.add_sequence(offset);
+	}
+
+	void ScriptBuilder::add(NodeKind kind, string_view content)
+	{
+		ScriptEdit& edit = _state->edit;
+		switch (kind)
+		{
+		case NodeKind::Transition:
+			edit.add_node(kind, string_view(), ToUpper(string(content)));
+			break;
+		case NodeKind::Section:
+			edit.add_node(kind, "#", content);
+			break;
+		default:
+			edit.add_node(kind, string_view(), content);
+			break;
+		}
+		edit.state = ParseState::Idle;
+	}
+
+	void ScriptBuilder::cue(string_view cue, bool dual)
+	{
+		ScriptEdit& edit = _state->edit;
+		string_view extension;
+		string_view name = splitCue(strip_trailing(strip_leading(cue)), extension);
+		edit.cue_kind = dual ? NodeKind::DualDialog : NodeKind::Dialog;
+		edit.cue.assign(name.data(), name.length());
+		edit.cue_extension.assign(extension.data(), extension.length());
+		// a cue followed at once by a parenthetical keeps an empty node, as
+		// the parser gives it
+		edit.start_node(edit.cue_kind, edit.cue);
+		edit.state = ParseState::Dialogue;
+	}
+
+	void ScriptBuilder::parenthetical(string_view text)
+	{
+		ScriptEdit& edit = _state->edit;
+		if (edit.state != ParseState::Dialogue)
+			return add(NodeKind::Action, text);
+		edit.add_node(NodeKind::Parenthetical, edit.cue, text);
+	}
+
+	void ScriptBuilder::dialog(string_view text)
+	{
+		ScriptEdit& edit = _state->edit;
+		if (edit.state != ParseState::Dialogue)
+			return add(NodeKind::Action, text);
+		if (!isDialogKind(edit.curr_node.kind))
+			edit.start_node(edit.cue_kind, edit.cue);
+		edit.append_text(text);
+	}
+
+	void ScriptBuilder::finish()
+	{
+		_state->edit.finalize_current_sequence();
+	}
+
+	// true if the line could be a scene heading or open a boneyard or note;
+	// a cheap test on the first non blank character that lets the skim skip
+	// almost every line
+	inline bool may_be_shot(const char* curr, const char* end)
+	{
+		while (curr < end && (*curr == ' ' || *curr == '\t'))
+			++curr;
+		if (curr == end)
+			return false;
+		char c = *curr;
+		return c == '.' || c == 'I' || c == 'i' || c == 'E' || c == 'e' || c == '/' || c == '[';
+	}
+
+	LazyScript::LazyScript(std::string text, std::pmr::memory_resource* resource)
+		: _text(std::move(text))
+		, _script(resource)
+	{
+		const char* begin = _text.c_str();
+		const char* end = begin + _text.length();
+		size_t title_end = _text.length();
+
+		// a heading inside a boneyard or note is not one, so the skim
+		// follows them exactly as parse_line does
+		ScriptEdit edit = { &_script, nullptr };
+		BlockKind block = BlockKind::None;
+		for_each_line(begin, end, [&](const char* b, const char* e, const char* next)
+		{
+			_script.source_map.add_line(b - begin);
+			if (block == BlockKind::None && !may_be_shot(b, e))
+				return;
+			// blocks closed on the line may be followed by another, and
+			// text after the last is never a heading
+			string_view line(b, e - b);
+			string_view text, rest;
+			bool closed;
+			if (track_block(block, line, text, closed, rest) != BlockKind::None)
+			{
+				while (closed && track_block(block, rest, text, closed, rest) != BlockKind::None)
+					;
+				return;
+			}
+			string_view s = strip_trailing(strip_leading(line));
+			if (!isShot(s))
+				return;
+
+			if (_ranges.empty())
+				title_end = b - begin;
+			else
+				_ranges.back().end = b - begin;
+
+			start_heading(edit, s);
+			_ranges.push_back({ static_cast<size_t>(next - begin), _text.length() });
+			_script.source_map.add_sequence(b - begin);
+		});
+		_parsed.assign(_ranges.size(), false);
+		_unparsed = _ranges.size();
+
+		// the title page is small, and holds whatever precedes the first scene
+		parse_range(&_script.title, 0, title_end);
+	}
+
+	void LazyScript::parse_range(Sequence* seq, size_t begin, size_t end)
+	{
+		// a range starts after a heading, where the eager parser is idle
+		ScriptEdit edit = { &_script, seq, seq == &_script.title ? ParseState::TitlePage : ParseState::Idle };
+		const char* text = _text.c_str();
+		for_each_line(text + begin, text + end, [&](const char* b, const char* e, const char*)
+		{
+			parse_line(edit, string_view(b, e - b));
+		});
+		edit.finalize_current_sequence();
+	}
+
+	const Sequence& LazyScript::sequence(size_t i)
+	{
+		if (!_parsed[i])
+		{
+			_in_order = _in_order && i == _ranges.size() - _unparsed;
+			parse_range(&_script.sequences[i], _ranges[i].begin, _ranges[i].end);
+			_parsed[i] = true;
+			if (!--_unparsed && !_in_order)
+				number_characters();
+		}
+		return _script.sequences[i];
+	}
+
+	// as the eager parser numbers them, by first cue in the script
+	void LazyScript::number_characters()
+	{
+		_script.characters.clear();
+		_script.character_names.clear();
+		_script.character_ids.clear();
+		auto number = [this](Sequence& seq)
+		{
+			for (auto& n : seq.nodes)
+				if (isDialogKind(n.kind) || n.kind == NodeKind::Parenthetical)
+					n.character = _script.add_character(n.key);
+		};
+		number(_script.title);
+		for (auto& seq : _script.sequences)
+			number(seq);
+	}
+
+	Script& LazyScript::script()
+	{
+		for (size_t i = 0; i < _ranges.size() && _unparsed; ++i)
+			sequence(i);
+		return _script;
 	}
 
 	Script Script::parseFountain(const filesystem::path& fountainFile)
 	{
-		FILE* f = open_file(fountainFile);
-		if (!f)
+		int fd = open_file(fountainFile);
+		if (fd < 0)
 			throw std::runtime_error("Couldn't open file");
 
-		fseek(f, 0, SEEK_END);
-		size_t len = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		char* text = new char[len + 1];
-		fread(text, 1, len, f);
-		text[len] = '\0';
-		fclose(f);
-		char* end = text + len;
-		std::string txt(text, end);
-		delete[] text;
-		return parseFountain(txt);
+		// the file is read, and inflated if need be, ahead of the parse
+		std::unique_ptr<ChunkReader> reader;
+		if (fountainFile.extension() == ".gz")
+			reader.reset(new GzipReader(fd));
+		else
+			reader.reset(new PipelinedReader(fd));
+		Script script;
+		FountainStream stream(script);
+		size_t length;
+		while (const char* chunk = reader->next(length))
+			stream.feed(chunk, length);
+		stream.finish();
+		return script;
 	}
 
-	ScriptMeta::ScriptMeta(const Script& script)
+	ScriptMeta::ScriptMeta(const Script& script, std::pmr::memory_resource* resource)
+		: ScriptMeta(resource)
 	{
-		for (auto& seq : script.sequences)
-			sequence_characters.insert(std::make_pair(seq.name, std::set<std::string>()));
-		for (auto& chr : script.characters)
-			character_dialog.insert(std::make_pair(chr, std::vector<std::string>()));
-
+		begin(script);
 		for (auto& seq : script.sequences)
 		{
-			auto& data = sequence_characters.find(seq.name);
+			add_sequence(seq);
 			for (auto& n : seq.nodes)
+				add_node(n);
+		}
+	}
+
+	ScriptMeta::ScriptMeta(std::pmr::memory_resource* resource)
+		: sequence_characters(resource)
+		, character_dialog(resource)
+	{
+	}
+
+	namespace
+	{
+		// runs fn(i) for each of tasks on up to threads threads, the
+		// caller's among them
+		template <typename Fn>
+		void run_tasks(int threads, size_t tasks, Fn fn)
+		{
+			atomic<size_t> next(0);
+			auto worker = [&]()
+			{
+				for (size_t i = next++; i < tasks; i = next++)
+					fn(i);
+			};
+			threads = max(1, static_cast<int>(min<size_t>(static_cast<size_t>(max(threads, 1)), tasks)));
+			vector<thread> pool;
+			for (int i = 1; i < threads; ++i)
+				pool.emplace_back(worker);
+			worker();
+			for (auto& t : pool)
+				t.join();
+		}
+	}
+
+	ScriptMeta ScriptMeta::build(const Script& script, int threads, std::pmr::memory_resource* resource)
+	{
+		using Name = const std::pmr::string*;
+		const size_t ids = script.character_names.size();
+		if (threads <= 0)
+		{
+			size_t wanted = script.sequences.size() / meta_thread_sequences;
+			threads = static_cast<int>(max<size_t>(1, min<size_t>(wanted, thread::hardware_concurrency())));
+		}
+		if (threads == 1)
+			return ScriptMeta(script, resource);
+
+		// a node built without an id, but keyed by a character's name,
+		// belongs with that character
+		unordered_map<string_view, uint32_t> by_name;
+		for (uint32_t id = 0; id < ids; ++id)
+			by_name.emplace(string_view(script.character_names[id]), id);
+
+		// a run of sequences, summarized with no lookup by name
+		struct Shard
+		{
+			size_t begin = 0, end = 0;
+			vector<vector<Name>> cast;			// per sequence, sorted and unique
+			vector<vector<Name>> dialog;		// by character id
+			vector<pair<Name, Name>> other;		// name and dialog, for names with no id
+		};
+
+		// a few shards per thread, so that a thread given long sequences
+		// doesn't hold up the rest
+		const size_t count = script.sequences.size();
+		vector<Shard> shards(min(count, static_cast<size_t>(threads) * 4));
+		for (size_t s = 0; s < shards.size(); ++s)
+		{
+			shards[s].begin = count * s / shards.size();
+			shards[s].end = count * (s + 1) / shards.size();
+		}
+
+		run_tasks(threads, shards.size(), [&](size_t s)
+		{
+			Shard& shard = shards[s];
+			shard.cast.resize(shard.end - shard.begin);
+			shard.dialog.resize(ids);
+			for (size_t q = shard.begin; q < shard.end; ++q)
 			{
-				if (n.kind == NodeKind::Dialog)
+				vector<Name>& cast = shard.cast[q - shard.begin];
+				for (auto& n : script.sequences[q].nodes)
 				{
-					data->second.insert(n.key);
-					auto& dialog = character_dialog.find(n.key);
-					dialog->second.push_back(n.content);
+					if (!isDialogKind(n.kind))
+						continue;
+					uint32_t id = n.character;
+					if (id >= ids)
+					{
+						auto i = by_name.find(string_view(n.key));
+						id = i == by_name.end() ? ScriptNode::no_character : i->second;
+					}
+					Name name = id < ids ? &script.character_names[id] : &n.key;
+					cast.push_back(name);
+					if (n.content.empty())
+						continue;
+					if (id < ids)
+						shard.dialog[id].push_back(&n.content);
+					else
+						shard.other.emplace_back(name, &n.content);
 				}
+				sort(cast.begin(), cast.end(), [](Name a, Name b) { return *a < *b; });
+				cast.erase(unique(cast.begin(), cast.end(), [](Name a, Name b) { return *a == *b; }), cast.end());
 			}
+		});
+
+		ScriptMeta meta(resource);
+		meta.begin(script);
+		for (auto& shard : shards)
+			for (size_t q = shard.begin; q < shard.end; ++q)
+			{
+				auto& cast = meta.sequence_characters[script.sequences[q].name];
+				for (Name name : shard.cast[q - shard.begin])
+					cast.emplace_hint(cast.end(), *name);
+			}
+
+		// each character's lines are given their places in script order,
+		// then filled in
+		vector<std::pmr::vector<std::pmr::string>*> targets(ids, nullptr);
+		vector<size_t> firsts(ids, 0);
+		for (uint32_t id = 0; id < ids; ++id)
+		{
+			size_t total = 0;
+			for (auto& shard : shards)
+				total += shard.dialog[id].size();
+			if (!total)
+				continue;
+			const std::pmr::string& name = script.character_names[id];
+			auto i = meta.character_dialog.find(name);
+			if (i == meta.character_dialog.end())
+				i = meta.character_dialog.emplace(name, std::pmr::vector<std::pmr::string>()).first;
+			targets[id] = &i->second;
+			firsts[id] = i->second.size();
+			i->second.resize(firsts[id] + total);
+		}
+		auto fill = [&](size_t id)
+		{
+			if (!targets[id])
+				return;
+			std::pmr::string* out = targets[id]->data() + firsts[id];
+			for (auto& shard : shards)
+				for (Name line : shard.dialog[id])
+					(out++)->assign(*line);
+		};
+		if (resource->is_equal(*std::pmr::new_delete_resource()))
+			run_tasks(threads, ids, fill);
+		else
+			for (size_t id = 0; id < ids; ++id)
+				fill(id);
+
+		for (auto& shard : shards)
+			for (auto& other : shard.other)
+			{
+				auto i = meta.character_dialog.find(*other.first);
+				if (i == meta.character_dialog.end())
+					i = meta.character_dialog.emplace(*other.first, std::pmr::vector<std::pmr::string>()).first;
+				i->second.push_back(*other.second);
+			}
+		return meta;
+	}
+
+	MemoryUsage ScriptMeta::memory_usage() const
+	{
+		// the meta's resource is not known to be an arena, so its blocks
+		// are costed as the heap's
+		MemoryUsage r;
+		MemoryTally tally(false);
+		for (auto& sc : sequence_characters)
+		{
+			r.metadata += tally.tree_node(sequence_characters) + tally.string(sc.first);
+			for (auto& name : sc.second)
+				r.metadata += tally.tree_node(sc.second) + tally.string(name);
 		}
+		for (auto& cd : character_dialog)
+		{
+			r.metadata += tally.tree_node(character_dialog) + tally.string(cd.first) + tally.vector(cd.second);
+			for (auto& line : cd.second)
+				r.metadata += tally.string(line);
+		}
+		r.allocations = tally.allocations;
+		r.overhead = tally.overhead;
+		return r;
+	}
+
+	void ScriptMeta::begin(const Script& script)
+	{
+		_script = &script;
+		for (auto& chr : script.characters)
+			character_dialog[chr];
 	}
 
+	void ScriptMeta::add_sequence(const Sequence& seq)
+	{
+		_sequence = &sequence_characters[seq.name];
+	}
+
+	void ScriptMeta::add_node(const ScriptNode& n)
+	{
+		if (!isDialogKind(n.kind))
+			return;
+		const std::pmr::string& name = _script ? _script->character_name(n) : n.key;
+		_sequence->insert(name);
+		// a cue directly followed by a parenthetical has no text
+		if (n.content.empty())
+			return;
+		auto i = character_dialog.find(name);
+		if (i == character_dialog.end())
+			i = character_dialog.emplace(name, std::pmr::vector<std::pmr::string>()).first;
+		i->second.push_back(n.content);
+	}
 
 }
@@ -3,9 +3,17 @@
 
 #pragma once
 
+#include "ScriptInline.h"
+#include "SourceMap.h"
+
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
+#include <memory_resource>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
 
@@ -14,81 +22,442 @@ namespace lab
 
 	namespace filesystem = std::experimental::filesystem;
 
+	class ChunkReader;
+
 enum class NodeKind
 {
 	KeyValue,
 	Divider,
 	Character, Action, Location, Dialog, Direction, Transition,
+	Parenthetical,	// key is the speaking character
+	DualDialog,		// dialog spoken over the dialog before it, cue marked with ^
+	Centered,		// > text <
+	Lyric,			// ~ lines, one node per run
+	Section,		// key is the run of #, its depth
+	Synopsis,		// = text
+	Note,			// [[ text ]] beginning a line, may span lines
+	Boneyard,		// /* text */ beginning a line, may span lines
 	Unknown
 };
 
+inline bool isDialogKind(NodeKind kind)
+{
+	return kind == NodeKind::Dialog || kind == NodeKind::DualDialog;
+}
+
+// Splits a cue into the character's name and its extensions, so that
+// "MARY (V.O.) (CONT'D)" is MARY and "(V.O.) (CONT'D)". The extension is
+// empty if there is none.
+std::string_view splitCue(std::string_view cue, std::string_view& extension);
+
+// The form of a character's name that identifies the character however a
+// cue writes it: letters in upper case, those of Latin, Greek, and
+// Cyrillic as well as ASCII, runs of white space as a single space, and
+// none leading or trailing.
+void canonicalCharacter(std::string_view name, std::string& canonical);
+
+// Bytes a parsed script, or its meta, holds beyond the object itself, by
+// what holds them. Each category counts the blocks its strings and
+// containers have allocated; a string short enough to live inside its
+// object costs nothing more. overhead is what the allocator takes beyond
+// that: for a script in its own arena, the arena's reserve not yet handed
+// out, and otherwise an estimate of a typical malloc's header and
+// rounding for each block.
+struct MemoryUsage
+{
+	size_t node_strings = 0;	// nodes' keys, extensions, and content; sequences' names, locations, and numbers
+	size_t node_vectors = 0;	// the sequences, their nodes, and cached inline spans
+	size_t containers = 0;		// characters, sets, sequence_index, character_names, and character_ids
+	size_t source_map = 0;
+	size_t metadata = 0;		// the copies a ScriptMeta holds
+	size_t overhead = 0;
+	size_t allocations = 0;		// blocks, counted once each
+	size_t arena = 0;			// the arena's blocks from the heap, if the script has one
+
+	size_t total() const
+	{
+		return node_strings + node_vectors + containers + source_map + metadata + overhead;
+	}
+
+	MemoryUsage& operator+=(const MemoryUsage& rh)
+	{
+		node_strings += rh.node_strings;
+		node_vectors += rh.node_vectors;
+		containers += rh.containers;
+		source_map += rh.source_map;
+		metadata += rh.metadata;
+		overhead += rh.overhead;
+		allocations += rh.allocations;
+		arena += rh.arena;
+		return *this;
+	}
+};
+
+// A resource that counts the bytes and blocks it has taken from upstream
+// and not yet returned. Not safe for concurrent use.
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+	explicit CountingResource(std::pmr::memory_resource* upstream = std::pmr::new_delete_resource()) : _upstream(upstream) {}
+
+	size_t bytes() const { return _bytes; }
+	size_t blocks() const { return _blocks; }
+
+private:
+	void* do_allocate(size_t bytes, size_t alignment) override
+	{
+		void* p = _upstream->allocate(bytes, alignment);
+		_bytes += bytes;
+		++_blocks;
+		return p;
+	}
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override
+	{
+		_upstream->deallocate(p, bytes, alignment);
+		_bytes -= bytes;
+		--_blocks;
+	}
+	bool do_is_equal(const std::pmr::memory_resource& rh) const noexcept override { return this == &rh; }
+
+	std::pmr::memory_resource* _upstream;
+	size_t _bytes = 0;
+	size_t _blocks = 0;
+};
+
+// Every string and container in a Script is allocator aware and draws on
+// the memory resource the Script was constructed with. By default that is
+// the global heap; a Script parsed into a monotonic arena makes all of its
+// allocations there, and frees nothing until the arena goes.
+
 struct ScriptNode
 {
+	using allocator_type = std::pmr::polymorphic_allocator<char>;
+
 	ScriptNode() = default;
 	~ScriptNode() = default;
 
-    ScriptNode(NodeKind kind, const std::string& content) : kind(kind), content(content) {}
-	ScriptNode(NodeKind kind, const std::string& key, const std::string& content) : kind(kind), key(key), content(content) {}
-	ScriptNode(const ScriptNode & rh) : kind(rh.kind), key(rh.key), content(rh.content) {}
-    ScriptNode(ScriptNode && rh) : kind(rh.kind), key(rh.key), content(rh.content) {}
-	ScriptNode& operator=(ScriptNode && rh)
+	explicit ScriptNode(const allocator_type& a) : key(a), extension(a), content(a), _spans(a) {}
+    ScriptNode(NodeKind kind, std::string_view content, const allocator_type& a = {}) : kind(kind), key(a), extension(a), content(content, a), _spans(a) {}
+	ScriptNode(NodeKind kind, std::string_view key, std::string_view content, const allocator_type& a = {}) : kind(kind), key(key, a), extension(a), content(content, a), _spans(a) {}
+	ScriptNode(const ScriptNode & rh, const allocator_type& a = {}) : kind(rh.kind), key(rh.key, a), extension(rh.extension, a), content(rh.content, a), character(rh.character), _spans(rh._spans, a), _spans_ready(rh._spans_ready) {}
+	// noexcept, so that a growing vector of nodes moves them rather than
+	// copying each string, which in an arena would leave the old copies
+	// behind for good
+    ScriptNode(ScriptNode && rh) noexcept : kind(rh.kind), key(std::move(rh.key)), extension(std::move(rh.extension)), content(std::move(rh.content)), character(rh.character), _spans(std::move(rh._spans)), _spans_ready(rh._spans_ready) { rh._spans_ready = false; }
+	ScriptNode(ScriptNode && rh, const allocator_type& a) : kind(rh.kind), key(std::move(rh.key), a), extension(std::move(rh.extension), a), content(std::move(rh.content), a), character(rh.character), _spans(std::move(rh._spans), a), _spans_ready(rh._spans_ready) { rh._spans_ready = false; }
+	ScriptNode& operator=(ScriptNode && rh) noexcept
 	{
 		kind = rh.kind;
-		key = rh.key;
-		content = rh.content;
+		key = std::move(rh.key);
+		extension = std::move(rh.extension);
+		content = std::move(rh.content);
+		character = rh.character;
+		_spans = std::move(rh._spans);
+		_spans_ready = rh._spans_ready;
+		rh._spans_ready = false;
 		return *this;
 	}
 	ScriptNode& operator=(const ScriptNode & rh)
 	{
 		kind = rh.kind;
 		key = rh.key;
+		extension = rh.extension;
 		content = rh.content;
+		character = rh.character;
+		_spans = rh._spans;
+		_spans_ready = rh._spans_ready;
 		return *this;
 	}
 
+	allocator_type get_allocator() const { return key.get_allocator(); }
+
+	static const uint32_t no_character = ~uint32_t(0);
+
 	NodeKind kind = NodeKind::Unknown;
-	std::string key;
-    std::string content;
+	std::pmr::string key;
+	// Dialog and Parenthetical nodes: key is the character's name as the
+	// cue writes it, extension the cue's parentheticals, such as (V.O.) or
+	// (O.S.) (CONT'D), and character the id Script assigns the name
+	std::pmr::string extension;
+    std::pmr::string content;
+	uint32_t character = no_character;
+
+	// The styled runs of content, tokenized on the first call and cached;
+	// call invalidate_spans after changing content. Not safe to call
+	// concurrently on the same node.
+	const std::pmr::vector<InlineSpan>& spans() const
+	{
+		if (!_spans_ready)
+		{
+			tokenizeInline(content, _spans);
+			_spans_ready = true;
+		}
+		return _spans;
+	}
+	void invalidate_spans() { _spans_ready = false; }
 
 	std::string as_string() const;
+
+private:
+	friend struct Script;
+
+	mutable std::pmr::vector<InlineSpan> _spans;
+	mutable bool _spans_ready = false;
 };
 
 struct Sequence
 {
+	using allocator_type = std::pmr::polymorphic_allocator<char>;
+
 	Sequence() = default;
-	Sequence(const std::string & name_, const std::string & location_, bool interior, bool exterior);
-	Sequence(Sequence && rh);
-	Sequence & operator=(Sequence && rh);
+	explicit Sequence(const allocator_type& a) : name(a), location(a), scene_number(a), nodes(a) {}
+	Sequence(const std::string & name_, const std::string & location_, bool interior, bool exterior, const allocator_type& a = {});
+	// a copy in a, nodes and their cached spans included
+	Sequence(const Sequence & rh, const allocator_type& a);
+	Sequence(Sequence && rh) noexcept;
+	Sequence(Sequence && rh, const allocator_type& a);
+	Sequence & operator=(Sequence && rh) noexcept;
+
+	allocator_type get_allocator() const { return name.get_allocator(); }
 
 	std::string as_string() const;
 
-	std::string name;
-	std::string location;
+	// the heading, if any, and the nodes as Fountain text
+	std::string as_fountain() const;
+
+	std::pmr::string name;
+	std::pmr::string location;
+	std::pmr::string scene_number;	// from a heading ending in #1A#, else empty
 	bool interior = false;
 	bool exterior = false;
-	std::vector<ScriptNode> nodes;
+	std::pmr::vector<ScriptNode> nodes;
 };
 
 struct Script
 {
+	using allocator_type = std::pmr::polymorphic_allocator<char>;
+
 	Script() = default;
+	// all storage comes from resource, which must outlive the script
+	explicit Script(std::pmr::memory_resource* resource);
 	Script(Script && rh) noexcept;
 
+	allocator_type get_allocator() const { return title.get_allocator(); }
+
+private:
+	// declared first, so that they are destroyed after everything they hold
+	std::unique_ptr<CountingResource> _arena_upstream;
+	std::unique_ptr<std::pmr::monotonic_buffer_resource> _arena;
+
+public:
 	Sequence title;
-	std::set<std::string> characters;
-	std::set<std::string> sets;
-	std::vector<Sequence> sequences;
-	std::map<std::string, int> sequence_index;
+	std::pmr::set<std::pmr::string> characters;	// each as first written
+	std::pmr::set<std::pmr::string> sets;
+	std::pmr::vector<Sequence> sequences;
+	std::pmr::map<std::pmr::string, int> sequence_index;
+	SourceMap source_map;	// line and sequence offsets in the parsed text
+
+	// Characters by id, numbered in the order they are first parsed, each
+	// named as its first cue writes it. MARY, MARY (V.O.), and Mary are
+	// one character, indexed by the canonical form of the name.
+	std::pmr::vector<std::pmr::string> character_names;
+	std::pmr::map<std::pmr::string, uint32_t, std::less<>> character_ids;
+
+	// The id of the character a name or a whole cue refers to, assigning
+	// a new one to a name not seen before. No name, no character.
+	uint32_t add_character(std::string_view name);
+	uint32_t character_id(std::string_view cue) const;
+
+	// the name a dialog node's character is known by; the node's key if it
+	// has no id
+	const std::pmr::string& character_name(const ScriptNode& node) const
+	{
+		return node.character < character_names.size() ? character_names[node.character] : node.key;
+	}
+
+	// the whole script as Fountain text, which parses back to an equal script
+	std::string as_fountain() const;
 
+	// what the script holds, by category; a walk over its nodes without
+	// allocating
+	MemoryUsage memory_usage() const;
+
+	// parses into the default resource
 	static Script parseFountain(const std::string& fountainFile);
 	static Script parseFountain(const filesystem::path& fountainFile);
+
+	// parses into resource, which must outlive the script
+	static Script parseFountain(const std::string& fountainFile, std::pmr::memory_resource* resource);
+
+	// parses into a monotonic arena owned by the script. Nodes are never
+	// freed one at a time; teardown releases a few large blocks.
+	static Script parseFountainInArena(const std::string& fountainFile);
+
+	// parses all that reader delivers, into an arena sized by its size
+	// hint. The offset of the first byte that isn't valid UTF-8, or
+	// FountainStream::npos, goes to invalid_utf8 if it is given.
+	static Script parseFountainInArena(ChunkReader& reader, uint64_t* invalid_utf8 = nullptr);
+
+	// an empty script owning an arena sized for text_length bytes of
+	// source, to be filled by a FountainStream
+	static Script inArena(size_t text_length);
+
+private:
+	static void parse(Script& script, const std::string& text);
+};
+
+// Opens a script by skimming it for scene headings only. The title page,
+// headings, sets, and sequence_index are available at once; the nodes of a
+// sequence are parsed the first time it is accessed. Once every sequence
+// has been accessed the script is identical to Script::parseFountain's.
+// Character ids are assigned as nodes are parsed, so until then they
+// follow the order of access; if that was not source order, they are
+// numbered again in source order as the last sequence is parsed.
+// Not safe for concurrent access.
+class LazyScript
+{
+public:
+	explicit LazyScript(std::string text, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+	struct Range
+	{
+		size_t begin;	// byte offset of the first line after the heading
+		size_t end;		// byte offset of the next heading, or the end
+	};
+
+	// headings, title, sets, and sequence_index; nodes only where parsed
+	const Script& skimmed() const { return _script; }
+
+	size_t sequence_count() const { return _ranges.size(); }
+	const Range& range(size_t i) const { return _ranges[i]; }
+	bool parsed(size_t i) const { return _parsed[i]; }
+
+	const Sequence& sequence(size_t i);
+
+	// parses every remaining sequence
+	Script& script();
+
+	const std::string& text() const { return _text; }
+
+private:
+	void parse_range(Sequence* seq, size_t begin, size_t end);
+	void number_characters();
+
+	std::string _text;
+	Script _script;
+	std::vector<Range> _ranges;
+	std::vector<bool> _parsed;
+	size_t _unparsed = 0;
+	bool _in_order = true;	// every sequence parsed so far was the next in the script
+};
+
+// Parses text that arrives in pieces, such as the buffers of a
+// PipelinedReader, into script. A piece may end anywhere, even within a
+// line or between the CR and LF of a line break; the result is the same
+// as Script::parseFountain on the whole text. Only a partial line is ever
+// held, so the text need not fit in memory.
+class FountainStream
+{
+public:
+	explicit FountainStream(Script& script);
+	~FountainStream();
+
+	void feed(const char* data, size_t length);
+
+	// parses the last line and closes the open sequence
+	void finish();
+
+	// offset of the first byte fed that is not valid UTF-8, or npos
+	static const uint64_t npos = ~uint64_t(0);
+	uint64_t invalid_utf8() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> _state;
+};
+
+// Builds a script from elements another format has already classified,
+// such as the paragraphs of a Final Draft file, by the same steps the
+// Fountain parser takes: headings register their sets, cues are split
+// into name and extension, and characters are given their ids.
+class ScriptBuilder
+{
+public:
+	explicit ScriptBuilder(Script& script);
+	~ScriptBuilder();
+
+	// an entry of the title page, as Title or Author
+	void title_entry(std::string_view key, std::string_view value);
+
+	// Starts a sequence. A heading without INT. or EXT. is taken whole as
+	// the location, as if forced with a leading period. offset is the
+	// heading's position in the source, for Script::source_map.
+	void heading(std::string_view text, std::string_view scene_number, uint64_t offset);
+
+	// a node of its own, such as Action, Transition, or Lyric
+	void add(NodeKind kind, std::string_view content);
+
+	void cue(std::string_view cue, bool dual);
+	void parenthetical(std::string_view text);
+	// runs on from dialog directly before it, as further lines
+	void dialog(std::string_view text);
+
+	void finish();
+
+private:
+	struct State;
+	std::unique_ptr<State> _state;
+};
+
+// Writes Fountain text a sequence and a node at a time, exactly as
+// Script::as_fountain writes it all at once, for callers that visit the
+// nodes for other reasons as well. The title page is the first sequence.
+class FountainWriter
+{
+public:
+	void sequence(const Sequence& seq, std::string& out);
+	void node(const ScriptNode& node, std::string& out);
+
+private:
+	const Sequence* _sequence = nullptr;
+	const ScriptNode* _prev = nullptr;
+	bool _script_written = false;
+	bool _sequence_written = false;
 };
 
 struct ScriptMeta
 {
-	ScriptMeta(const Script&);
-	std::map<std::string, std::set<std::string>> sequence_characters;
-	std::map<std::string, std::vector<std::string>> character_dialog;
+	ScriptMeta(const Script&, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+	// The same meta, built on up to threads threads. With threads 0 it
+	// uses a thread per meta_thread_sequences sequences, up to every
+	// hardware thread, so a short script is built serially on the calling
+	// thread. Runs of sequences are summarized in parallel, by character
+	// id rather than by name, then merged in script order, so the result
+	// equals the serial one whatever the thread count. When resource is
+	// new_delete_resource, which threads may share, the dialog is copied
+	// in parallel too; into any other resource, the merge copies it.
+	static const size_t meta_thread_sequences = 256;
+	static ScriptMeta build(const Script& script, int threads = 0,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+	// An empty meta, to be filled by a walk over a script: begin, then
+	// add_sequence for each sequence followed by add_node for its nodes.
+	explicit ScriptMeta(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+	void begin(const Script& script);
+	void add_sequence(const Sequence& seq);
+	void add_node(const ScriptNode& node);
+
+	// keyed by character, as Script::character_name names them
+	std::pmr::map<std::pmr::string, std::pmr::set<std::pmr::string>> sequence_characters;
+	std::pmr::map<std::pmr::string, std::pmr::vector<std::pmr::string>> character_dialog;
+
+	// what the maps hold, all of it as metadata
+	MemoryUsage memory_usage() const;
+
+private:
+	const Script* _script = nullptr;
+	std::pmr::set<std::pmr::string>* _sequence = nullptr;
 };
 
 } // lab
@@ -0,0 +1,247 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScreenplayC.h"
+#include "FileIO.h"
+#include "Screenplay.h"
+#include "ScriptFdx.h"
+
+#include <exception>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// the handles are the library's own objects
+struct lab_script
+{
+	lab::Script script;
+	std::vector<const std::pmr::string*> sets;	// Script::sets, indexable
+};
+
+namespace
+{
+	using namespace lab;
+
+	static_assert(LAB_NODE_KEY_VALUE == int(NodeKind::KeyValue) && LAB_NODE_DIVIDER == int(NodeKind::Divider)
+		&& LAB_NODE_CHARACTER == int(NodeKind::Character) && LAB_NODE_ACTION == int(NodeKind::Action)
+		&& LAB_NODE_LOCATION == int(NodeKind::Location) && LAB_NODE_DIALOG == int(NodeKind::Dialog)
+		&& LAB_NODE_DIRECTION == int(NodeKind::Direction) && LAB_NODE_TRANSITION == int(NodeKind::Transition)
+		&& LAB_NODE_PARENTHETICAL == int(NodeKind::Parenthetical) && LAB_NODE_DUAL_DIALOG == int(NodeKind::DualDialog)
+		&& LAB_NODE_CENTERED == int(NodeKind::Centered) && LAB_NODE_LYRIC == int(NodeKind::Lyric)
+		&& LAB_NODE_SECTION == int(NodeKind::Section) && LAB_NODE_SYNOPSIS == int(NodeKind::Synopsis)
+		&& LAB_NODE_NOTE == int(NodeKind::Note) && LAB_NODE_BONEYARD == int(NodeKind::Boneyard)
+		&& LAB_NODE_UNKNOWN == int(NodeKind::Unknown),
+		"lab_node_kind must match NodeKind");
+	static_assert(LAB_NO_CHARACTER == ScriptNode::no_character, "LAB_NO_CHARACTER must match ScriptNode::no_character");
+
+	thread_local std::string last_error;
+
+	const Sequence* sequence(const lab_sequence* seq) { return reinterpret_cast<const Sequence*>(seq); }
+	const lab_sequence* handle(const Sequence* seq) { return reinterpret_cast<const lab_sequence*>(seq); }
+	const ScriptNode* node(const lab_node* n) { return reinterpret_cast<const ScriptNode*>(n); }
+
+	lab_string view(const std::pmr::string& s)
+	{
+		return { s.data(), s.length() };
+	}
+
+	lab_script* wrap(Script&& script)
+	{
+		lab_script* r = new lab_script{ std::move(script), {} };
+		r->sets.reserve(r->script.sets.size());
+		for (auto& s : r->script.sets)
+			r->sets.push_back(&s);
+		return r;
+	}
+
+	// exceptions stop at the C boundary
+	template <typename Fn>
+	lab_script* guarded(Fn fn)
+	{
+		try
+		{
+			last_error.clear();
+			return fn();
+		}
+		catch (std::exception& e)
+		{
+			last_error = e.what();
+		}
+		catch (...)
+		{
+			last_error = "Unknown error";
+		}
+		return nullptr;
+	}
+}
+
+extern "C"
+{
+
+uint32_t lab_screenplay_abi_version(void)
+{
+	return LAB_SCREENPLAY_ABI_VERSION;
+}
+
+const char* lab_screenplay_last_error(void)
+{
+	return last_error.c_str();
+}
+
+lab_script* lab_script_parse(const char* text, size_t length)
+{
+	return guarded([&]
+	{
+		// fed in place, so the text is not copied before it is parsed
+		Script script = Script::inArena(length);
+		{
+			FountainStream stream(script);
+			stream.feed(text, length);
+			stream.finish();
+		}
+		return wrap(std::move(script));
+	});
+}
+
+lab_script* lab_script_open(const char* path)
+{
+	return guarded([&]() -> lab_script*
+	{
+		if (!path || !filesystem::exists(path))
+		{
+			last_error = std::string(path ? path : "(null)") + " not found";
+			return nullptr;
+		}
+		std::unique_ptr<ChunkReader> reader = open_chunk_reader(path);
+		return wrap(parseScriptInArena(*reader, path));
+	});
+}
+
+void lab_script_free(lab_script* script)
+{
+	delete script;
+}
+
+const lab_sequence* lab_script_title(const lab_script* script)
+{
+	return handle(&script->script.title);
+}
+
+size_t lab_script_sequence_count(const lab_script* script)
+{
+	return script->script.sequences.size();
+}
+
+const lab_sequence* lab_script_sequence(const lab_script* script, size_t index)
+{
+	if (index >= script->script.sequences.size())
+		return nullptr;
+	return handle(&script->script.sequences[index]);
+}
+
+const lab_sequence* lab_script_find_sequence(const lab_script* script, const char* name, size_t length)
+{
+	const Script& s = script->script;
+	std::string_view key(name, length);
+	auto i = s.sequence_index.find(std::pmr::string(key));
+	if (i != s.sequence_index.end())
+		return handle(&s.sequences[i->second]);
+	for (auto& seq : s.sequences)
+		if (seq.scene_number.length() && std::string_view(seq.scene_number) == key)
+			return handle(&seq);
+	return nullptr;
+}
+
+size_t lab_script_character_count(const lab_script* script)
+{
+	return script->script.character_names.size();
+}
+
+lab_string lab_script_character(const lab_script* script, uint32_t id)
+{
+	if (id >= script->script.character_names.size())
+		return { nullptr, 0 };
+	return view(script->script.character_names[id]);
+}
+
+uint32_t lab_script_character_id(const lab_script* script, const char* cue, size_t length)
+{
+	return script->script.character_id(std::string_view(cue, length));
+}
+
+size_t lab_script_set_count(const lab_script* script)
+{
+	return script->sets.size();
+}
+
+lab_string lab_script_set(const lab_script* script, size_t index)
+{
+	if (index >= script->sets.size())
+		return { nullptr, 0 };
+	return view(*script->sets[index]);
+}
+
+lab_string lab_sequence_name(const lab_sequence* seq)
+{
+	return view(sequence(seq)->name);
+}
+
+lab_string lab_sequence_location(const lab_sequence* seq)
+{
+	return view(sequence(seq)->location);
+}
+
+lab_string lab_sequence_scene_number(const lab_sequence* seq)
+{
+	return view(sequence(seq)->scene_number);
+}
+
+int lab_sequence_interior(const lab_sequence* seq)
+{
+	return sequence(seq)->interior;
+}
+
+int lab_sequence_exterior(const lab_sequence* seq)
+{
+	return sequence(seq)->exterior;
+}
+
+size_t lab_sequence_node_count(const lab_sequence* seq)
+{
+	return sequence(seq)->nodes.size();
+}
+
+const lab_node* lab_sequence_node(const lab_sequence* seq, size_t index)
+{
+	const Sequence* s = sequence(seq);
+	if (index >= s->nodes.size())
+		return nullptr;
+	return reinterpret_cast<const lab_node*>(&s->nodes[index]);
+}
+
+lab_node_kind lab_node_get_kind(const lab_node* n)
+{
+	return static_cast<lab_node_kind>(node(n)->kind);
+}
+
+lab_string lab_node_key(const lab_node* n)
+{
+	return view(node(n)->key);
+}
+
+lab_string lab_node_extension(const lab_node* n)
+{
+	return view(node(n)->extension);
+}
+
+lab_string lab_node_content(const lab_node* n)
+{
+	return view(node(n)->content);
+}
+
+uint32_t lab_node_character(const lab_node* n)
+{
+	return node(n)->character;
+}
+
+} // extern "C"
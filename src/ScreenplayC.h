@@ -0,0 +1,129 @@
+/* License: BSD 3-clause
+ * Copyright: Nick Porcino, 2017
+ */
+
+#ifndef LAB_SCREENPLAY_C_H
+#define LAB_SCREENPLAY_C_H
+
+/* A C interface to the screenplay library, stable across releases: the
+ * types are opaque, and functions are only ever added. Check
+ * lab_screenplay_abi_version against LAB_SCREENPLAY_ABI_VERSION to find
+ * out whether the library is at least as new as this header.
+ *
+ * Strings are handed out in place, as a pointer and a length into the
+ * parsed script, without a copy. They are NUL terminated as well, and
+ * remain valid until the script is freed. Sequences and nodes likewise
+ * belong to their script.
+ *
+ * A script may be read from any number of threads at once. A function
+ * that fails returns NULL, or zero, and lab_screenplay_last_error
+ * describes the failure on that thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(LAB_SCREENPLAY_SHARED)
+#  if defined(LAB_SCREENPLAY_BUILD)
+#    define LAB_SCREENPLAY_API __declspec(dllexport)
+#  else
+#    define LAB_SCREENPLAY_API __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#  define LAB_SCREENPLAY_API __attribute__((visibility("default")))
+#else
+#  define LAB_SCREENPLAY_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LAB_SCREENPLAY_ABI_VERSION 1
+
+typedef struct lab_script lab_script;
+typedef struct lab_sequence lab_sequence;
+typedef struct lab_node lab_node;
+
+typedef struct lab_string
+{
+	const char* data;
+	size_t length;
+} lab_string;
+
+/* the values are fixed; a new kind gets a new value */
+typedef enum lab_node_kind
+{
+	LAB_NODE_KEY_VALUE = 0,
+	LAB_NODE_DIVIDER = 1,
+	LAB_NODE_CHARACTER = 2,
+	LAB_NODE_ACTION = 3,
+	LAB_NODE_LOCATION = 4,
+	LAB_NODE_DIALOG = 5,
+	LAB_NODE_DIRECTION = 6,
+	LAB_NODE_TRANSITION = 7,
+	LAB_NODE_PARENTHETICAL = 8,
+	LAB_NODE_DUAL_DIALOG = 9,
+	LAB_NODE_CENTERED = 10,
+	LAB_NODE_LYRIC = 11,
+	LAB_NODE_SECTION = 12,
+	LAB_NODE_SYNOPSIS = 13,
+	LAB_NODE_NOTE = 14,
+	LAB_NODE_BONEYARD = 15,
+	LAB_NODE_UNKNOWN = 16
+} lab_node_kind;
+
+#define LAB_NO_CHARACTER 0xFFFFFFFFu
+
+LAB_SCREENPLAY_API uint32_t lab_screenplay_abi_version(void);
+LAB_SCREENPLAY_API const char* lab_screenplay_last_error(void);
+
+/* Parses Fountain text; the text need not outlive the call. */
+LAB_SCREENPLAY_API lab_script* lab_script_parse(const char* text, size_t length);
+
+/* Reads and parses a file; a path ending in .gz is inflated as it is
+ * read, if the library was built with zlib. */
+LAB_SCREENPLAY_API lab_script* lab_script_open(const char* path);
+
+LAB_SCREENPLAY_API void lab_script_free(lab_script* script);
+
+/* the title page, as a sequence with no name */
+LAB_SCREENPLAY_API const lab_sequence* lab_script_title(const lab_script* script);
+LAB_SCREENPLAY_API size_t lab_script_sequence_count(const lab_script* script);
+LAB_SCREENPLAY_API const lab_sequence* lab_script_sequence(const lab_script* script, size_t index);
+/* by name or scene number; NULL if there is none */
+LAB_SCREENPLAY_API const lab_sequence* lab_script_find_sequence(const lab_script* script, const char* name, size_t length);
+
+/* Characters are numbered from zero in the order they first speak, and
+ * named as their first cue writes them. */
+LAB_SCREENPLAY_API size_t lab_script_character_count(const lab_script* script);
+LAB_SCREENPLAY_API lab_string lab_script_character(const lab_script* script, uint32_t id);
+/* the id of the character a name or cue refers to, so that "MARY (V.O.)"
+ * finds MARY; LAB_NO_CHARACTER if there is none */
+LAB_SCREENPLAY_API uint32_t lab_script_character_id(const lab_script* script, const char* cue, size_t length);
+
+/* the sets, as INT. DINER - NIGHT, in sorted order */
+LAB_SCREENPLAY_API size_t lab_script_set_count(const lab_script* script);
+LAB_SCREENPLAY_API lab_string lab_script_set(const lab_script* script, size_t index);
+
+LAB_SCREENPLAY_API lab_string lab_sequence_name(const lab_sequence* seq);
+LAB_SCREENPLAY_API lab_string lab_sequence_location(const lab_sequence* seq);
+LAB_SCREENPLAY_API lab_string lab_sequence_scene_number(const lab_sequence* seq);
+LAB_SCREENPLAY_API int lab_sequence_interior(const lab_sequence* seq);
+LAB_SCREENPLAY_API int lab_sequence_exterior(const lab_sequence* seq);
+LAB_SCREENPLAY_API size_t lab_sequence_node_count(const lab_sequence* seq);
+LAB_SCREENPLAY_API const lab_node* lab_sequence_node(const lab_sequence* seq, size_t index);
+
+LAB_SCREENPLAY_API lab_node_kind lab_node_get_kind(const lab_node* node);
+/* for dialog, the character's name; for a title page entry, its key */
+LAB_SCREENPLAY_API lab_string lab_node_key(const lab_node* node);
+/* a cue's extensions, as (V.O.) */
+LAB_SCREENPLAY_API lab_string lab_node_extension(const lab_node* node);
+LAB_SCREENPLAY_API lab_string lab_node_content(const lab_node* node);
+LAB_SCREENPLAY_API uint32_t lab_node_character(const lab_node* node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
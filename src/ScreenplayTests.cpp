@@ -0,0 +1,1013 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+// Checks of the library, run by ctest. Each test throws on failure.
+// `LabScreenplayTests` runs every test but the slow ones; given names, it
+// runs just those.
+
+#include "Screenplay.h"
+#include "ScreenplayC.h"
+#include "FileIO.h"
+#include "ScriptCast.h"
+#include "ScriptColumns.h"
+#include "ScriptDaemon.h"
+#include "ScriptDrafts.h"
+#include "ScriptEmit.h"
+#include "ScriptFdx.h"
+#include "ScriptIndex.h"
+#include "ScriptInline.h"
+#include "ScriptJson.h"
+#include "ScriptSchedule.h"
+#include "ScriptSnapshot.h"
+#include "ScriptStats.h"
+#include "Utf8.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+#define CHECK(cond) \
+	do { if (!(cond)) throw runtime_error(string(__FILE__ ":") + to_string(__LINE__) + ": " #cond); } while (0)
+
+namespace
+{
+	// what writeJsonString writes of s
+	string json_string(const string& s)
+	{
+		string r;
+		{
+			lab::OutputBuffer out(r);
+			lab::writeJsonString(out, s);
+		}
+		return r;
+	}
+
+	void test_json_utf8()
+	{
+		CHECK(json_string("a\"b\\c\n\x01") == "\"a\\\"b\\\\c\\n\\u0001\"");
+		CHECK(json_string(u8"Jos\u00e9 \u20ac") == u8"\"Jos\u00e9 \u20ac\"");
+		// a stray continuation byte, a truncated sequence, an overlong
+		// encoding, and a surrogate
+		CHECK(json_string("a\x80" "b") == u8"\"a\ufffdb\"");
+		CHECK(json_string("long text then \xe2\x82") == u8"\"long text then \ufffd\ufffd\"");
+		CHECK(json_string("\xc0\xafx\n") == u8"\"\ufffd\ufffdx\\n\"");
+		CHECK(json_string("\xed\xa0\x80") == u8"\"\ufffd\ufffd\ufffd\"");
+	}
+
+	const char* draft_text =
+		"Title: Drafts\n\n"
+		"INT. DINER - NIGHT\n\nMary sits.\n\nMARY\nCoffee.\n\n"
+		"EXT. STREET - NIGHT\n\nRain.\n\n"
+		"INT. CAR - NIGHT\n\nJOHN\nDrive.\n";
+
+	void test_columns()
+	{
+		string path = "screenplay_test_columns.lsc";
+		lab::Script one = lab::Script::parseFountain(string(draft_text));
+		lab::Script two = lab::Script::parseFountain(string("INT. BARN - DAY\n\nHay.\n\nEXT. FIELD - DAY\n\nWind.\n"));
+		{
+			lab::ColumnarWriter writer;
+			writer.add(one);
+			writer.add(two);
+			int fd = lab::open_output_fd(path);
+			writer.write(fd);
+			lab::close_output_fd(fd);
+		}
+		{
+			lab::MappedFile file(path);
+			lab::ColumnarView view(file.data(), file.size());
+			CHECK(view.script_count() == 2);
+			lab::SourceMap map = view.source_map(1);
+			CHECK(map == two.source_map);
+			CHECK(map.sequence_count() == 2);
+			CHECK(map.line_at(map.sequence_offset(1)) == 4);
+			CHECK(view.source_map(0) == one.source_map);
+
+			// every string is found by its bytes
+			for (uint32_t id = 0; id < view.string_count(); ++id)
+				CHECK(view.find_string(view.string(id)) == id);
+			CHECK(view.find_string("MARY") != lab::ColumnarNone);
+			CHECK(view.find_string("MAR") == lab::ColumnarNone);
+			CHECK(view.find_string("") == lab::ColumnarNone);
+			CHECK(view.find_string("ZZZ") == lab::ColumnarNone);
+		}
+		remove(path.c_str());
+	}
+
+	void test_schedule_threads()
+	{
+		const char* sets[] = { "INT. DINER - NIGHT", "EXT. STREET - NIGHT", "INT. CAR - DAY", "INT. DINER - DAY" };
+		const char* cast[] = { "MARY", "JOHN", "ANN", "BOB", "EVE" };
+		string text;
+		for (int i = 0; i < 60; ++i)
+		{
+			text += string(sets[(i * 7) % 4]) + "\n\nThey talk.\n\n";
+			for (int c = 0; c < 1 + i % 3; ++c)
+				text += string(cast[(i + c * 2) % 5]) + "\nA line.\n\n";
+		}
+		lab::Script script = lab::Script::parseFountain(text);
+		lab::ScriptMeta meta(script);
+		lab::ScheduleOptions options;
+		options.chains = 6;
+		options.iterations = 20000;
+		options.max_eighths_per_day = 24;
+		options.threads = 1;
+		lab::ShootingSchedule serial = lab::scheduleShoot(script, meta, options);
+
+		// each sequence is shot once, and no day runs over unless a single
+		// sequence does
+		vector<int> shot(script.sequences.size());
+		for (auto& day : serial.days)
+		{
+			CHECK(day.eighths <= options.max_eighths_per_day || day.sequences.size() == 1);
+			for (int i : day.sequences)
+				++shot[i];
+		}
+		CHECK(count(shot.begin(), shot.end(), 1) == static_cast<ptrdiff_t>(shot.size()));
+
+		// the chains are the same whichever threads run them
+		for (int threads : { 2, 5, 0 })
+		{
+			options.threads = threads;
+			lab::ShootingSchedule s = lab::scheduleShoot(script, meta, options);
+			CHECK(s.cost == serial.cost);
+			CHECK(s.location_moves == serial.location_moves && s.cast_days == serial.cast_days);
+			CHECK(s.days.size() == serial.days.size());
+			for (size_t d = 0; d < s.days.size(); ++d)
+				CHECK(s.days[d].sequences == serial.days[d].sequences && s.days[d].eighths == serial.days[d].eighths);
+		}
+	}
+
+	void test_node_copies()
+	{
+		static_assert(std::is_nothrow_move_constructible<lab::ScriptNode>::value, "");
+		static_assert(std::is_nothrow_move_constructible<lab::Sequence>::value, "");
+
+		lab::ScriptNode node(lab::NodeKind::Action, "a *bold* move");
+		size_t spans = node.spans().size();
+		CHECK(spans > 1);
+		lab::ScriptNode copy(node);
+		CHECK(copy.spans().size() == spans);
+		lab::ScriptNode assigned(lab::NodeKind::Action, "");
+		assigned = node;
+		CHECK(assigned.spans().size() == spans);
+	}
+
+	// Pathological shapes of input, each a unit repeated to fill the size
+	// asked for. The parser must take time linear in the input whatever its
+	// shape.
+	struct Shape
+	{
+		const char* name;
+		string (*make)(size_t bytes);
+	};
+
+	string repeat(const string& unit, size_t bytes, const string& head = string())
+	{
+		string r = head;
+		r.reserve(bytes + unit.length());
+		while (r.length() < bytes)
+			r += unit;
+		return r;
+	}
+
+	const Shape shapes[] =
+	{
+		{ "one long line", [](size_t n) { return repeat("word ", n); } },
+		{ "blank lines", [](size_t n) { return repeat("\n", n); } },
+		{ "bare carriage returns", [](size_t n) { return repeat("\r", n); } },
+		{ "title continuations", [](size_t n) { return repeat("    more of the title\n", n, "Title: A\n"); } },
+		{ "colons", [](size_t n) { return repeat("a:b:c:d: TO: x:\n", n); } },
+		{ "cues", [](size_t n) { return repeat("MARY\nHi.\n\n", n); } },
+		{ "cues without dialog", [](size_t n) { return repeat("MARY\n", n); } },
+		{ "headings", [](size_t n) { return repeat("INT. HOUSE - DAY\n\n", n); } },
+		{ "unclosed note", [](size_t n) { return repeat("still in the note\n", n, "[[\n"); } },
+		{ "unclosed boneyard", [](size_t n) { return repeat("/* ", n); } },
+		{ "emphasis", [](size_t n) { return repeat("*_**_*", n, "Action ") + "\n"; } },
+		{ "closed notes on a line", [](size_t n) { return repeat("[[]]", n, "INT. HOUSE - DAY\n\n") + "\n"; } },
+		{ "closed boneyards on a line", [](size_t n) { return repeat("/**/", n, "INT. HOUSE - DAY\n\n") + "\n"; } },
+	};
+
+	// the best of a few runs, in seconds, of the eager parser with each
+	// node's emphasis tokenized, of the lazy parser's skim, and of the
+	// streaming parser fed small pieces
+	double parse_seconds(const string& text)
+	{
+		double best = 1e30;
+		for (int run = 0; run < 3; ++run)
+		{
+			auto start = chrono::steady_clock::now();
+			lab::Script eager = lab::Script::parseFountain(text);
+			for (auto& seq : eager.sequences)
+				for (auto& node : seq.nodes)
+					node.spans();
+			lab::LazyScript lazy(text);
+			lab::Script streamed;
+			lab::FountainStream stream(streamed);
+			for (size_t i = 0; i < text.length(); i += 4096)
+				stream.feed(text.data() + i, min(size_t(4096), text.length() - i));
+			stream.finish();
+			best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+		return best;
+	}
+
+	// Four times the input should take about four times as long. Quadratic
+	// work would take sixteen; up to eight allows for timing noise, for
+	// caches that the larger input overflows, and for the n log n of the
+	// ordered sequence index.
+	void test_complexity()
+	{
+		const size_t small = 1024 * 1024;
+		string failures;
+		for (auto& shape : shapes)
+		{
+			double t1 = parse_seconds(shape.make(small));
+			double t4 = parse_seconds(shape.make(small * 4));
+			double ratio = t4 / max(t1, 1e-4);
+			printf("  %-28s 1MB %8.2f ms  4MB %8.2f ms  x%.1f\n", shape.name, t1 * 1000, t4 * 1000, ratio);
+			if (ratio > 8)
+				failures += string(failures.empty() ? "" : ", ") + shape.name;
+		}
+		if (failures.length())
+			throw runtime_error("superlinear: " + failures);
+	}
+
+	void test_utf8_validate()
+	{
+		string ascii(40, 'a');
+		CHECK(lab::utf8_is_valid(ascii.data(), ascii.length()));
+		string mixed = u8"Ждёт € \U0001F600 end";
+		CHECK(lab::utf8_is_valid(mixed.data(), mixed.length()));
+
+		// a stray continuation byte, an overlong encoding, a surrogate, a
+		// code point past U+10FFFF, a byte that is never UTF-8, and a
+		// truncated sequence, each found at every offset across the 16
+		// byte blocks, after ASCII and after two byte sequences
+		const char* bad[] = { "\x80", "\xc0\xaf", "\xe0\x80\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xf5", "\xe2\x82" };
+		for (const char* b : bad)
+			for (size_t at = 0; at < 40; ++at)
+			{
+				string t = string(at, 'a') + b + "bbbbbbbbbbbbbbbbbbbb";
+				CHECK(lab::utf8_find_invalid(t.data(), t.length()) == at);
+				string cyrillic;
+				while (cyrillic.length() + 2 <= at)
+					cyrillic += u8"Ж";
+				cyrillic.append(at - cyrillic.length(), 'a');
+				t = cyrillic + b + u8"Ж";
+				CHECK(lab::utf8_find_invalid(t.data(), t.length()) == at);
+			}
+		string cut = string(u8"ЖЖ€").substr(0, 6);
+		CHECK(lab::utf8_find_invalid(cut.data(), cut.length()) == 4);
+
+		// lowercase Cyrillic before a line is action, not a cue
+		lab::Script script = lab::Script::parseFountain(string(u8"INT. ROOM - DAY\n\nждёт\nона.\n"));
+		CHECK(script.characters.empty());
+	}
+
+	// the kinds of a sequence's nodes, and their content, a line each
+	string describe(const lab::Sequence& seq)
+	{
+		string r;
+		for (auto& n : seq.nodes)
+			r += to_string(static_cast<int>(n.kind)) + " " + string(n.content) + "\n";
+		return r;
+	}
+
+	// parses text, and checks that the script writes Fountain that parses
+	// back to the same script
+	lab::Script round_trip(const string& text)
+	{
+		lab::Script script = lab::Script::parseFountain(text);
+		string written = script.as_fountain();
+		lab::Script again = lab::Script::parseFountain(written);
+		CHECK(again.as_fountain() == written);
+		CHECK(again.sequences.size() == script.sequences.size());
+		for (size_t i = 0; i < script.sequences.size(); ++i)
+			CHECK(describe(again.sequences[i]) == describe(script.sequences[i]));
+		return script;
+	}
+
+	void test_text_after_block()
+	{
+		lab::Script note = round_trip("INT. HOUSE - DAY\n\n[[a note]] Then he runs away.\n");
+		CHECK(note.sequences.size() == 1);
+		auto& n = note.sequences[0].nodes;
+		CHECK(n.size() == 2);
+		CHECK(n[0].kind == lab::NodeKind::Note && n[0].content == "a note");
+		CHECK(n[1].kind == lab::NodeKind::Action && n[1].content == "Then he runs away.");
+
+		lab::Script boneyard = round_trip("INT. HOUSE - DAY\n\n/* old */ Kept text.\n");
+		auto& b = boneyard.sequences[0].nodes;
+		CHECK(b.size() == 2);
+		CHECK(b[0].kind == lab::NodeKind::Boneyard && b[0].content == " old ");
+		CHECK(b[1].kind == lab::NodeKind::Action && b[1].content == "Kept text.");
+
+		// a block closing on a later line, and a heading after a block,
+		// which is action
+		lab::Script later = round_trip("INT. HOUSE - DAY\n\n[[one\ntwo]] [[three]] INT. BARN - NIGHT\n");
+		CHECK(later.sequences.size() == 1);
+		auto& l = later.sequences[0].nodes;
+		CHECK(l.size() == 3);
+		CHECK(l[0].content == "one\ntwo" && l[1].content == "three");
+		CHECK(l[2].kind == lab::NodeKind::Action && l[2].content == "INT. BARN - NIGHT");
+
+		// the lazy parser agrees
+		string text = "INT. HOUSE - DAY\n\n[[a note]] INT. BARN - NIGHT\n\nEXT. YARD - DAY\n\nRain.\n";
+		lab::LazyScript lazy(text);
+		CHECK(lazy.script().as_fountain() == lab::Script::parseFountain(text).as_fountain());
+
+		// many blocks closed on one line, after a heading, are read in a
+		// loop rather than by recursion
+		for (string unit : { "[[]]", "/**/" })
+		{
+			lab::Script many = lab::Script::parseFountain("INT. HOUSE - DAY\n\n" + repeat(unit, unit.length() * 100000) + "\n");
+			CHECK(many.sequences.size() == 1);
+			CHECK(many.sequences[0].nodes.size() == 100000);
+		}
+	}
+
+	void test_lazy_blocks()
+	{
+		// headings after a closed block, inside an open one, and after
+		// several closed on one line are skimmed as the parser reads them
+		const char* texts[] =
+		{
+			"INT. A - DAY\n\n/* a */ /* b\nINT. B - DAY\n*/\n\nEXT. C - DAY\n\nx\n",
+			"INT. A - DAY\n\n[[a]] [[b\nINT. B - DAY\n]] INT. C - DAY\n\nEXT. D - NIGHT\n\ny\n",
+			"INT. A - DAY\n\n/* a */ INT. B - DAY\n\n[[n]][[m]] EXT. C - DAY\n\nz\n",
+			"/* INT. A - DAY\n\nINT. B - DAY */\n\nINT. C - DAY\n\n[[ */ ]]\n\nINT. D - DAY\n",
+			"INT. A - DAY\n\n[[a]]/* b */[[c\n\nINT. B - DAY\n\nc]]\n\nINT. E - DAY\n",
+		};
+		for (const char* text : texts)
+		{
+			lab::Script eager = lab::Script::parseFountain(string(text));
+			lab::LazyScript lazy(text);
+			CHECK(lazy.sequence_count() == eager.sequences.size());
+			CHECK(lazy.script().as_fountain() == eager.as_fountain());
+		}
+	}
+
+	string describe_spans(const string& text)
+	{
+		std::pmr::vector<lab::InlineSpan> spans;
+		lab::tokenizeInline(text, spans);
+		string r;
+		for (auto& s : spans)
+			r += "{" + to_string(s.offset) + "," + to_string(s.length) + "," + to_string(s.style) + "}";
+		return r;
+	}
+
+	void test_inline_spans()
+	{
+		// each delimiter is found at every offset across the 16 byte blocks
+		for (char d : { '*', '_', '\\', '\n' })
+			for (size_t at = 0; at < 48; ++at)
+			{
+				string t(48, 'x');
+				t[at] = d;
+				CHECK(lab::find_inline_delimiter(t.data(), t.data() + t.length()) == at);
+				CHECK(lab::find_inline_delimiter(t.data() + at + 1, t.data() + t.length()) == 47 - at);
+			}
+
+		// runs by offset, length, and style
+		CHECK(describe_spans("a **b** _c_ ***d*** \\*e") == "{0,2,0}{4,1,2}{7,1,0}{9,1,4}{11,1,0}{15,1,3}{19,1,0}{21,2,0}");
+		CHECK(describe_spans("_*a*_ b") == "{2,1,5}{5,2,0}");
+		// unpartnered delimiters, and emphasis that would cross a line
+		CHECK(describe_spans("a*b") == "{0,3,0}");
+		CHECK(describe_spans("**") == "{0,2,0}");
+		CHECK(describe_spans("*a\nb*") == "{0,5,0}");
+
+		// wherever the emphasis falls
+		for (size_t k = 0; k < 40; ++k)
+		{
+			string expected = k ? "{0," + to_string(k) + ",0}" : string();
+			expected += "{" + to_string(k + 1) + ",2,1}{" + to_string(k + 4) + ",2,0}";
+			CHECK(describe_spans(string(k, 'x') + "*ab* y") == expected);
+		}
+	}
+
+	// a gzip member of "INT. HOUSE - DAY\n\nRain.\n"
+	const char gzip_member[] =
+		"\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\xf3\xf4\x0b\xd1\x53\xf0\xf0\x0f\x0d\x76\x55"
+		"\xd0\x55\x70\x71\x8c\xe4\xe2\x0a\x4a\xcc\xcc\xd3\xe3\x02\x00\x26\x3d\x6e\x26\x18\x00"
+		"\x00\x00";
+
+	// what a GzipReader inflates from a file of data
+	string gunzip(const string& data, size_t buffer_size)
+	{
+		string path = "screenplay_test.fountain.gz";
+		int fd = lab::open_output_fd(path);
+		lab::write_fully(fd, data.data(), data.length());
+		lab::close_output_fd(fd);
+		string r;
+		try
+		{
+			lab::GzipReader reader(path, buffer_size);
+			size_t length;
+			while (const char* chunk = reader.next(length))
+				r.append(chunk, length);
+		}
+		catch (...)
+		{
+			remove(path.c_str());
+			throw;
+		}
+		remove(path.c_str());
+		return r;
+	}
+
+	void test_gzip_padding()
+	{
+		string member(gzip_member, sizeof(gzip_member) - 1);
+		string text = "INT. HOUSE - DAY\n\nRain.\n";
+		try
+		{
+			CHECK(gunzip(member, 64) == text);
+		}
+		catch (runtime_error& e)
+		{
+			if (strstr(e.what(), "zlib"))
+			{
+				cout << "  skipped, without zlib" << endl;
+				return;
+			}
+			throw;
+		}
+		CHECK(gunzip(member + member, 64) == text + text);
+
+		// padding to a block, as tar and tape leave it, and padding
+		// that spans the reader's buffers
+		CHECK(gunzip(member + string(512 - member.length(), '\0'), 64) == text);
+		CHECK(gunzip(member + member + string(1000, '\0'), 16) == text + text);
+
+		// but not a member after the padding, nor a truncated member
+		bool threw = false;
+		try { gunzip(member + string(8, '\0') + member, 64); } catch (runtime_error&) { threw = true; }
+		CHECK(threw);
+		threw = false;
+		try { gunzip(member.substr(0, member.length() - 3), 64); } catch (runtime_error&) { threw = true; }
+		CHECK(threw);
+	}
+
+	// replaces what a file holds with text
+	void write_file(const string& path, const string& text)
+	{
+		int fd = lab::open_output_fd(path);
+		lab::write_fully(fd, text.data(), text.length());
+		lab::close_output_fd(fd);
+	}
+
+	void test_daemon_queries()
+	{
+		string path = "screenplay_test_daemon.fountain";
+		write_file(path, draft_text);
+		lab::ScriptDaemon daemon(2);
+		auto query = [&](const string& q)
+		{
+			string r;
+			CHECK(daemon.answer(lab::DaemonRequest::Query, path, q, r));
+			return r;
+		};
+		CHECK(query("characters") == "JOHN\t1\nMARY\t1\n");
+		CHECK(query("locations") == "EXT. STREET - NIGHT\nINT. CAR - NIGHT\nINT. DINER - NIGHT\n");
+		CHECK(query("sequences") == "00001\t\tDINER - NIGHT\n00002\t\tSTREET - NIGHT\n00003\t\tCAR - NIGHT\n");
+		CHECK(query("dialog MARY") == "Coffee.\n");
+		CHECK(query("scene 00002") == "EXT. STREET - NIGHT\n\nRain.\n");
+
+		// a changed file is parsed again
+		write_file(path, string(draft_text) + "\nMARY\nHome.\n");
+		CHECK(query("dialog MARY") == "Coffee.\nHome.\n");
+
+		string r;
+		CHECK(!daemon.answer(lab::DaemonRequest::Query, path, "nothing", r));
+		CHECK(!daemon.answer(lab::DaemonRequest::Summary, "screenplay_test_missing.fountain", string(), r));
+		remove(path.c_str());
+	}
+
+	void test_character_case()
+	{
+		string canonical;
+		lab::canonicalCharacter(u8"  jos\u00e9\tgarc\u00eda ", canonical);
+		CHECK(canonical == u8"JOS\u00c9 GARC\u00cdA");
+
+		lab::Script script = lab::Script::parseFountain(string(
+			u8"INT. ROOM - DAY\n\nJOS\u00c9\nHola.\n\n"
+			u8"\u0415\u041b\u0415\u041d\u0410\nPrivet.\n\n"
+			u8"\u039f\u0394\u03a5\u03a3\u03a3\u0395\u0391\u03a3\nGeia.\n"));
+		CHECK(script.character_id(u8"Jos\u00e9") != lab::ScriptNode::no_character);
+		CHECK(script.character_id(u8"jos\u00e9 (V.O.)") == script.character_id(u8"JOS\u00c9"));
+		CHECK(script.character_id(u8"\u0435\u043b\u0435\u043d\u0430") != lab::ScriptNode::no_character);
+		// final sigma is a sigma
+		CHECK(script.character_id(u8"\u03bf\u03b4\u03c5\u03c3\u03c3\u03b5\u03b1\u03c2") != lab::ScriptNode::no_character);
+		CHECK(script.character_id("Jose") == lab::ScriptNode::no_character);
+
+		// bytes that are not UTF-8 are kept
+		lab::canonicalCharacter("a\xff b", canonical);
+		CHECK(canonical == "A\xff B");
+	}
+
+	void test_lazy_character_ids()
+	{
+		string text =
+			"INT. A - DAY\n\nMARY\nHi.\n\n"
+			"INT. B - DAY\n\nJOHN\nNo.\n\nANN\nSo.\n\n"
+			"INT. C - DAY\n\nBOB\nOk.\n\nMARY\nYes.\n";
+		lab::Script eager = lab::Script::parseFountain(text);
+		lab::LazyScript lazy(text);
+
+		// numbered as accessed, until the last sequence is parsed
+		lazy.sequence(2);
+		lazy.sequence(0);
+		CHECK(lazy.skimmed().character_names[0] == "BOB");
+		lazy.sequence(1);
+
+		const lab::Script& script = lazy.skimmed();
+		CHECK(script.character_names == eager.character_names);
+		CHECK(script.character_id("ann") == eager.character_id("ann"));
+		for (size_t i = 0; i < eager.sequences.size(); ++i)
+		{
+			auto& a = script.sequences[i].nodes;
+			auto& b = eager.sequences[i].nodes;
+			CHECK(a.size() == b.size());
+			for (size_t j = 0; j < a.size(); ++j)
+				CHECK(a[j].character == b[j].character);
+		}
+	}
+
+	void test_dialog_counts()
+	{
+		lab::TextCounts c = lab::countText("Wait... what? Fine");
+		CHECK(c.words == 3 && c.sentences == 3 && c.characters == 18);
+		c = lab::countText(u8"Да. Нет");
+		CHECK(c.words == 2 && c.sentences == 2 && c.characters == 7);
+		c = lab::countText("   ");
+		CHECK(c.words == 0 && c.sentences == 0 && c.characters == 3);
+
+		// words and ends across the 16 byte blocks
+		for (size_t k = 0; k < 20; ++k)
+		{
+			c = lab::countText(string(k, ' ') + repeat("ab. ", 160));
+			CHECK(c.words == 40 && c.sentences == 40 && c.characters == k + 160);
+		}
+
+		lab::Script script = lab::Script::parseFountain(string(
+			"INT. A - DAY\n\nMARY\nHi there. Bye.\n\nJOHN\nNo.\n\n"
+			"INT. B - DAY\n\nMARY (V.O.)\nYes!\n"));
+		lab::DialogStats stats(150);
+		stats.add(script);
+		auto& mary = stats.characters()[script.character_id("MARY")];
+		CHECK(mary.lines == 2 && mary.text.words == 4 && mary.text.sentences == 3);
+		CHECK(stats.characters()[script.character_id("JOHN")].lines == 1);
+		CHECK(stats.sequences()[0].lines == 2 && stats.sequences()[1].text.words == 1);
+		CHECK(stats.total().lines == 3 && stats.total().text.words == 5);
+		CHECK(stats.seconds(stats.total()) == 2.0);
+	}
+
+	void test_snapshot_edits()
+	{
+		auto first = lab::ScriptSnapshot::make(lab::Script::parseFountain(string(draft_text)));
+		auto second = first->with_sequence_edited(1, [](lab::Sequence& seq)
+		{
+			seq.nodes[0].content = "*Heavy* rain.";
+		});
+		CHECK(first->sequence(1).nodes[0].content == "Rain.");
+		CHECK(second->sequence(1).nodes[0].content == "*Heavy* rain.");
+		CHECK(second->shares_sequence(0, *first) && !second->shares_sequence(1, *first));
+
+		// readers of a published snapshot share its nodes' spans
+		lab::SharedScript shared(first);
+		shared.publish(second);
+		vector<thread> readers;
+		vector<size_t> spans(4);
+		for (size_t r = 0; r < spans.size(); ++r)
+			readers.emplace_back([&, r]()
+			{
+				auto snapshot = shared.load();
+				for (size_t i = 0; i < snapshot->sequence_count(); ++i)
+					for (auto& n : snapshot->sequence(i).nodes)
+						spans[r] += n.spans().size();
+			});
+		for (auto& t : readers)
+			t.join();
+		for (size_t count : spans)
+			CHECK(count == spans[0]);
+		CHECK(second->sequence(1).nodes[0].spans().size() > 1);
+	}
+
+	string c_string(lab_string s)
+	{
+		CHECK(s.data && s.data[s.length] == '\0');
+		return string(s.data, s.length);
+	}
+
+	void test_c_api()
+	{
+		CHECK(lab_screenplay_abi_version() >= LAB_SCREENPLAY_ABI_VERSION);
+
+		// the text need not outlive the parse
+		string text = draft_text;
+		lab_script* script = lab_script_parse(text.data(), text.length());
+		CHECK(script);
+		text.assign(text.length(), 'x');
+
+		CHECK(lab_script_sequence_count(script) == 3);
+		CHECK(lab_script_character_count(script) == 2);
+		CHECK(c_string(lab_script_character(script, 0)) == "MARY");
+		CHECK(lab_script_character_id(script, "mary (V.O.)", 11) == 0);
+		CHECK(lab_script_character_id(script, "ANN", 3) == LAB_NO_CHARACTER);
+		CHECK(lab_script_set_count(script) == 3);
+		CHECK(c_string(lab_script_set(script, 0)) == "EXT. STREET - NIGHT");
+
+		const lab_sequence* title = lab_script_title(script);
+		CHECK(lab_sequence_node_count(title) == 1);
+		CHECK(c_string(lab_node_key(lab_sequence_node(title, 0))) == "Title");
+
+		const lab_sequence* seq = lab_script_sequence(script, 0);
+		CHECK(c_string(lab_sequence_name(seq)) == "00001");
+		CHECK(c_string(lab_sequence_location(seq)) == "DINER - NIGHT");
+		CHECK(lab_sequence_interior(seq) && !lab_sequence_exterior(seq));
+		CHECK(lab_sequence_node_count(seq) == 2);
+		const lab_node* node = lab_sequence_node(seq, 1);
+		CHECK(lab_node_get_kind(node) == LAB_NODE_DIALOG);
+		CHECK(c_string(lab_node_key(node)) == "MARY");
+		CHECK(c_string(lab_node_content(node)) == "Coffee.");
+		CHECK(lab_node_character(node) == 0);
+		CHECK(lab_node_character(lab_sequence_node(seq, 0)) == LAB_NO_CHARACTER);
+
+		CHECK(lab_script_find_sequence(script, "00002", 5) == lab_script_sequence(script, 1));
+		CHECK(!lab_script_find_sequence(script, "00009", 5));
+		CHECK(!lab_script_sequence(script, 3));
+		lab_script_free(script);
+
+		CHECK(!lab_script_open("screenplay_test_missing.fountain"));
+		CHECK(strlen(lab_screenplay_last_error()) > 0);
+	}
+
+	const char* fdx_text =
+		"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>\n"
+		"<FinalDraft DocumentType=\"Script\" Template=\"No\" Version=\"4\">\n"
+		"<Content>\n"
+		"<Paragraph Number=\"1\" Type=\"Scene Heading\"><Text>INT. DINER - NIGHT</Text></Paragraph>\n"
+		"<Paragraph Type=\"Action\"><Text>Mary reads </Text><Text Style=\"Bold+Italic\">the note </Text>"
+		"<Text>&amp; sighs &lt;3 *twice* caf&#233;.</Text></Paragraph>\n"
+		"<Paragraph Type=\"Character\"><Text>MARY</Text></Paragraph>\n"
+		"<Paragraph Type=\"Dialogue\"><Text>Coffee &quot;black&quot;.</Text></Paragraph>\n"
+		"<Paragraph><DualDialogue>\n"
+		"<Paragraph Type=\"Character\"><Text>JOHN</Text></Paragraph>\n"
+		"<Paragraph Type=\"Dialogue\"><Text>Tea.</Text></Paragraph>\n"
+		"<Paragraph Type=\"Character\"><Text>ANN</Text></Paragraph>\n"
+		"<Paragraph Type=\"Dialogue\"><Text Style=\"Underline\">Water</Text><Text>.</Text></Paragraph>\n"
+		"</DualDialogue></Paragraph>\n"
+		"<Paragraph Type=\"Transition\"><Text>CUT TO:</Text></Paragraph>\n"
+		"</Content>\n"
+		"<TitlePage><Content>\n"
+		"<Paragraph><Text>Drafts</Text></Paragraph>\n"
+		"<Paragraph><Text>Written by</Text></Paragraph>\n"
+		"<Paragraph><Text>Jo Writer</Text></Paragraph>\n"
+		"<Paragraph><Text>jo@example.com</Text></Paragraph>\n"
+		"<Paragraph><Text>555 0100</Text></Paragraph>\n"
+		"</Content></TitlePage>\n"
+		"</FinalDraft>\n";
+
+	void test_fdx()
+	{
+		// fed in pieces that split tags, entities, and text
+		string fdx = fdx_text;
+		for (size_t piece : { size_t(1), size_t(7), fdx.length() })
+		{
+			lab::Script script;
+			lab::FdxStream stream(script);
+			for (size_t i = 0; i < fdx.length(); i += piece)
+				stream.feed(fdx.data() + i, min(piece, fdx.length() - i));
+			stream.finish();
+
+			auto& t = script.title.nodes;
+			CHECK(t.size() == 4);
+			CHECK(t[0].key == "Title" && t[0].content == "Drafts");
+			CHECK(t[1].key == "Credit" && t[1].content == "Written by");
+			CHECK(t[2].key == "Author" && t[2].content == "Jo Writer");
+			CHECK(t[3].key == "Contact" && t[3].content == "jo@example.com\n555 0100");
+
+			CHECK(script.sequences.size() == 1);
+			CHECK(script.sequences[0].location == "DINER - NIGHT" && script.sequences[0].scene_number == "1");
+			auto& n = script.sequences[0].nodes;
+			CHECK(n.size() == 5);
+			CHECK(n[0].kind == lab::NodeKind::Action);
+			CHECK(n[0].content == u8"Mary reads ***the note*** & sighs <3 \\*twice\\* café.");
+			CHECK(n[1].kind == lab::NodeKind::Dialog && n[1].key == "MARY" && n[1].content == "Coffee \"black\".");
+			// the second cue of a dual dialogue is the dual one
+			CHECK(n[2].kind == lab::NodeKind::Dialog && n[2].key == "JOHN");
+			CHECK(n[3].kind == lab::NodeKind::DualDialog && n[3].key == "ANN" && n[3].content == "_Water_.");
+			CHECK(n[4].kind == lab::NodeKind::Transition && n[4].content == "CUT TO:");
+			CHECK(lab::Script::parseFountain(script.as_fountain()).as_fountain() == script.as_fountain());
+		}
+
+		bool threw = false;
+		try
+		{
+			lab::Script script;
+			lab::FdxStream stream(script);
+			string cut = fdx.substr(0, fdx.find("</Content>"));
+			stream.feed(cut.data(), cut.length());
+			stream.finish();
+		}
+		catch (runtime_error&)
+		{
+			threw = true;
+		}
+		CHECK(threw);
+	}
+
+	void test_meta_threads()
+	{
+		string text;
+		for (int i = 0; i < 600; ++i)
+			text += "INT. ROOM " + to_string(i) + " - DAY\n\n" + (i % 3 ? "MARY\nHi.\n\n" : "JOHN\nNo.\n\nMARY\nYes.\n\n");
+		lab::Script script = lab::Script::parseFountain(text);
+		lab::ScriptMeta serial(script);
+		for (int threads : { 0, 1, 3 })
+		{
+			lab::ScriptMeta built = lab::ScriptMeta::build(script, threads);
+			CHECK(built.sequence_characters == serial.sequence_characters);
+			CHECK(built.character_dialog == serial.character_dialog);
+		}
+	}
+
+	void test_cast_graph()
+	{
+		// two episodes; MARY is one character across them, whatever her
+		// cue's extension
+		lab::Script one = lab::Script::parseFountain(string(
+			"INT. A - DAY\n\nMARY\nHi.\n\nJOHN\nHi.\n\n"
+			"INT. B - DAY\n\nMARY\nSo.\n\nJOHN\nSo.\n\nANN\nSo.\n\n"
+			"INT. C - DAY\n\nANN\nAlone.\n\n"
+			"INT. D - DAY\n\nMARY (V.O.)\nWell.\n\nBOB\nWell.\n"));
+		lab::Script two = lab::Script::parseFountain(string("INT. E - DAY\n\nMARY (CONT'D)\nHi.\n\nBOB\nYo.\n"));
+		lab::CastGraph graph;
+		graph.add(one);
+		graph.add(two);
+		CHECK(graph.sequence_count() == 5);
+		lab::CastNetwork net = graph.network();
+		CHECK((net.names == vector<string>{ "MARY", "JOHN", "ANN", "BOB" }));
+		CHECK((net.sequences == vector<uint32_t>{ 4, 2, 2, 2 }));
+		CHECK(net.edges.size() == 4);
+		auto edge = [&](size_t i, uint32_t a, uint32_t b, uint32_t shared)
+		{
+			return net.edges[i].a == a && net.edges[i].b == b && net.edges[i].sequences == shared;
+		};
+		CHECK(edge(0, 0, 1, 2) && edge(1, 0, 2, 1) && edge(2, 0, 3, 2) && edge(3, 1, 2, 1));
+		CHECK((net.degree == vector<uint32_t>{ 3, 2, 2, 1 }));
+		CHECK((net.weighted_degree == vector<uint64_t>{ 5, 3, 2, 2 }));
+		CHECK(net.centrality[0] == 1.0);
+		for (double c : net.centrality)
+			CHECK(c > 0 && c <= 1.0);
+
+		// sequences past the first 64 bit words of the sets
+		string text;
+		for (int i = 0; i < 200; ++i)
+			text += "INT. ROOM - DAY\n\n" + string(i % 3 ? "MARY\nHi.\n\nJOHN\nHi.\n\n" : "ANN\nNo.\n\n");
+		lab::CastGraph wide;
+		wide.add(lab::Script::parseFountain(text));
+		net = wide.network();
+		CHECK(net.edges.size() == 1 && net.edges[0].sequences == 133);
+		CHECK(net.names[0] == "ANN" && net.sequences[0] == 67);
+	}
+
+	void test_memory_usage()
+	{
+		string text = string(draft_text) + "\nMARY\n*Much* more coffee, and a very long line of dialog.\n";
+
+		// on a resource of its own, the script's categories are the bytes
+		// it holds; the source map is on the heap
+		lab::CountingResource counting;
+		{
+			lab::Script script = lab::Script::parseFountain(text, &counting);
+			for (auto& seq : script.sequences)
+				for (auto& n : seq.nodes)
+					n.spans();
+			lab::MemoryUsage usage = script.memory_usage();
+			CHECK(usage.allocations == counting.blocks());
+			CHECK(usage.node_strings + usage.node_vectors + usage.containers == counting.bytes());
+			CHECK(usage.node_strings && usage.node_vectors && usage.containers && usage.source_map);
+			CHECK(!usage.metadata && !usage.arena);
+
+			lab::MemoryUsage meta = lab::ScriptMeta(script).memory_usage();
+			CHECK(meta.metadata && meta.total() == meta.metadata + meta.overhead);
+		}
+		CHECK(!counting.bytes() && !counting.blocks());
+
+		// in an arena, the overhead is what the arena holds beyond that
+		lab::Script arena = lab::Script::parseFountainInArena(text);
+		lab::MemoryUsage usage = arena.memory_usage();
+		size_t live = usage.node_strings + usage.node_vectors + usage.containers;
+		CHECK(usage.arena > live && usage.total() >= usage.arena + usage.source_map);
+	}
+
+	// what a file holds
+	string read_file(const string& path)
+	{
+		lab::MappedFile file(path);
+		return string(file.data(), file.size());
+	}
+
+	void test_corpus_index()
+	{
+		string path = "screenplay_test_index.lsi";
+		remove(path.c_str());
+		lab::Script one = lab::Script::parseFountain(string(draft_text));
+		lab::Script two = lab::Script::parseFountain(string("INT. BARN - DAY\n\nANN\nHay.\n\nEXT. FIELD - DAY\n\nMARY\nWind.\n"));
+		lab::Script three = lab::Script::parseFountain(string("INT. DINER - DAY\n\nBOB\nToast.\n"));
+		{
+			lab::CorpusIndexWriter writer(path);
+			CHECK(writer.first_script() == 0);
+			CHECK(writer.add(one, "one") == 0);
+			CHECK(writer.add(two, "two") == 1);
+			CHECK(writer.add(one, "one") == 0);
+			lab::appendCorpusIndex(path, writer);
+		}
+
+		// a name already in the index keeps its id
+		{
+			lab::CorpusIndexWriter writer(path);
+			CHECK(writer.first_script() == 2);
+			CHECK(writer.add(two, "two") == 1);
+			CHECK(writer.script_count() == 0);
+			CHECK(writer.add(three, "three") == 2);
+			lab::appendCorpusIndex(path, writer);
+		}
+
+		auto check = [&](size_t segments, uint32_t scripts)
+		{
+			lab::MappedFile file(path);
+			lab::CorpusIndex index(file.data(), file.size());
+			CHECK(index.segment_count() == segments && index.script_count() == scripts);
+			CHECK(index.script_name(2) == "three");
+			CHECK((index.find(lab::CorpusTerm::Character, "mary") == vector<uint32_t>{ 0, 1 }));
+			CHECK((index.find(lab::CorpusTerm::Location, "Diner") == vector<uint32_t>{ 0, 2 }));
+			CHECK(index.find(lab::CorpusTerm::Set, "INT. DINER - DAY") == vector<uint32_t>{ 2 });
+			CHECK(index.find(lab::CorpusTerm::Character, "ZED").empty());
+			auto sets = index.find_prefix(lab::CorpusTerm::Set, "INT. ");
+			CHECK(sets.size() == 4 && sets[0].name == "INT. BARN - DAY" && sets[0].scripts == vector<uint32_t>{ 1 });
+		};
+		check(2, 3);
+
+		// past max_segments, the segments are merged into one
+		{
+			lab::CorpusIndexWriter writer(path);
+			writer.add(lab::Script::parseFountain(string("EXT. SEA - DAY\n\nEVE\nWaves.\n")), "four");
+			lab::appendCorpusIndex(path, writer, 2);
+		}
+		check(1, 4);
+
+		// names whose offsets run backwards are refused
+		string data = read_file(path);
+		lab::CorpusIndexHeader header;
+		memcpy(&header, data.data(), sizeof(header));
+		uint64_t offset = 100;
+		memcpy(&data[header.section_offset[static_cast<size_t>(lab::CorpusSection::ScriptOffsets)] + sizeof(uint64_t)], &offset, sizeof(offset));
+		bool threw = false;
+		try { lab::CorpusIndex index(data.data(), data.length()); } catch (runtime_error&) { threw = true; }
+		CHECK(threw);
+		remove(path.c_str());
+	}
+
+	void test_drafts_share_sequences()
+	{
+		string path = "screenplay_test_drafts.lsd";
+		remove(path.c_str());
+		string v2 = string(draft_text);
+		v2.insert(v2.find("INT. DINER"), "EXT. ROAD - DAY\n\nDust.\n\n");
+		{
+			lab::DraftStore store(path);
+			size_t added = 0;
+			store.add(lab::Script::parseFountain(string(draft_text)), "v1", &added);
+			CHECK(added == 3);
+
+			// a scene inserted at the top renames every scene after it by
+			// position, but changes no other scene's content
+			lab::Script script = lab::Script::parseFountain(v2);
+			uint64_t before = store.size();
+			store.add(script, "v2", &added);
+			CHECK(added == 1);
+			CHECK(store.size() - before < 256);
+
+			// names not given by position are kept
+			script.sequences[2].name = "the street";
+			store.add(script, "v3", &added);
+			CHECK(added == 0);
+		}
+
+		lab::DraftStore store(path);
+		CHECK(store.draft_count() == 3);
+		CHECK(store.sequence_count() == 4);
+		lab::Script read = store.draft(store.find("v2"));
+		CHECK(read.sequences.size() == 4);
+		CHECK(read.sequences[3].name == "00004");
+		CHECK(read.sequence_index.at(std::pmr::string("00004")) == 3);
+		CHECK(read.as_fountain() == lab::Script::parseFountain(v2).as_fountain());
+		lab::Script v3 = store.draft(2);
+		CHECK(v3.sequences[2].name == "the street");
+		CHECK(v3.sequence_index.at(std::pmr::string("the street")) == 2);
+		CHECK(v3.sequences[1].name == "00002");
+		remove(path.c_str());
+	}
+
+	void test_emit_runs()
+	{
+		// around each multiple of the run length, with and without a title
+		string path = "screenplay_test_emit.fountain";
+		for (bool title : { false, true })
+			for (size_t count : { 1, 31, 32, 33, 63, 64, 65, 130 })
+			{
+				string text = title ? "Title: Runs\nAuthor: Jo\n\n" : "";
+				for (size_t i = 0; i < count; ++i)
+					text += "INT. ROOM " + to_string(i) + " - DAY\n\n" + (i % 2 ? "MARY\nHi.\n\n" : "[[a note]] Then *rain*.\n\n");
+				lab::Script script = lab::Script::parseFountain(text);
+				CHECK(script.sequences.size() == count);
+				string expected = script.as_fountain();
+				for (int threads : { 1, 3, 0 })
+				{
+					int fd = lab::open_output_fd(path);
+					lab::writeFountain(fd, script, threads);
+					lab::close_output_fd(fd);
+					CHECK(read_file(path) == expected);
+				}
+			}
+		remove(path.c_str());
+	}
+
+	struct Test
+	{
+		const char* name;
+		void (*run)();
+		bool slow;	// run only when named
+	};
+
+	const Test tests[] =
+	{
+		{ "json_utf8", test_json_utf8, false },
+		{ "columns", test_columns, false },
+		{ "schedule_threads", test_schedule_threads, false },
+		{ "node_copies", test_node_copies, false },
+		{ "complexity", test_complexity, true },
+		{ "utf8_validate", test_utf8_validate, false },
+		{ "text_after_block", test_text_after_block, false },
+		{ "lazy_blocks", test_lazy_blocks, false },
+		{ "inline_spans", test_inline_spans, false },
+		{ "gzip_padding", test_gzip_padding, false },
+		{ "daemon_queries", test_daemon_queries, false },
+		{ "character_case", test_character_case, false },
+		{ "lazy_character_ids", test_lazy_character_ids, false },
+		{ "dialog_counts", test_dialog_counts, false },
+		{ "snapshot_edits", test_snapshot_edits, false },
+		{ "c_api", test_c_api, false },
+		{ "fdx", test_fdx, false },
+		{ "meta_threads", test_meta_threads, false },
+		{ "cast_graph", test_cast_graph, false },
+		{ "memory_usage", test_memory_usage, false },
+		{ "corpus_index", test_corpus_index, false },
+		{ "drafts_share_sequences", test_drafts_share_sequences, false },
+		{ "emit_runs", test_emit_runs, false },
+	};
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	int run = 0;
+	for (auto& t : tests)
+	{
+		bool named = false;
+		for (int i = 1; i < argc; ++i)
+			named = named || !strcmp(argv[i], t.name);
+		if (argc > 1 ? !named : t.slow)
+			continue;
+		++run;
+		try
+		{
+			t.run();
+			cout << "ok " << t.name << endl;
+		}
+		catch (std::exception& e)
+		{
+			cout << "FAILED " << t.name << ": " << e.what() << endl;
+			++failed;
+		}
+	}
+	if (!run)
+	{
+		cerr << "No such test" << endl;
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptCast.h"
+#include "ScriptUtil.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		// the words of a bitset between its first and last set bit
+		struct Span
+		{
+			size_t first = 0;
+			size_t end = 0;
+		};
+
+		Span span(const vector<uint64_t>& bits)
+		{
+			Span s;
+			s.end = bits.size();
+			while (s.end > 0 && !bits[s.end - 1])
+				--s.end;
+			while (s.first < s.end && !bits[s.first])
+				++s.first;
+			return s;
+		}
+	}
+
+	void CastGraph::add(const Script& script)
+	{
+		walkScript(script, { this });
+	}
+
+	void CastGraph::begin(const Script& script)
+	{
+		_script = &script;
+		_script_ids.assign(script.character_names.size(), uint32_t(ScriptNode::no_character));
+		_sequence = ~size_t(0);
+	}
+
+	void CastGraph::sequence(const Sequence& /*seq*/, size_t index)
+	{
+		if (index == title_page)
+			_sequence = ~size_t(0);
+		else
+			_sequence = _sequence_count++;
+	}
+
+	uint32_t CastGraph::character(const ScriptNode& node)
+	{
+		// a script's ids are mapped to ours as each is first met
+		bool by_id = node.character < _script_ids.size();
+		if (by_id && _script_ids[node.character] != ScriptNode::no_character)
+			return _script_ids[node.character];
+
+		const std::pmr::string& name = by_id ? _script->character_names[node.character] : node.key;
+		canonicalCharacter(name, _canonical);
+		if (_canonical.empty())
+			return ScriptNode::no_character;
+		auto i = _ids.find(_canonical);
+		if (i == _ids.end())
+		{
+			i = _ids.emplace(_canonical, static_cast<uint32_t>(_names.size())).first;
+			_names.emplace_back(name);
+			_bits.emplace_back();
+		}
+		if (by_id)
+			_script_ids[node.character] = i->second;
+		return i->second;
+	}
+
+	void CastGraph::node(const ScriptNode& node)
+	{
+		if (_sequence == ~size_t(0) || !isDialogKind(node.kind))
+			return;
+		uint32_t c = character(node);
+		if (c == ScriptNode::no_character)
+			return;
+		vector<uint64_t>& bits = _bits[c];
+		size_t word = _sequence / 64;
+		if (bits.size() <= word)
+			bits.resize(word + 1, 0);
+		bits[word] |= uint64_t(1) << (_sequence % 64);
+	}
+
+	CastNetwork CastGraph::network() const
+	{
+		CastNetwork r;
+		const size_t n = _names.size();
+		r.names = _names;
+		r.sequences.assign(n, 0);
+		r.degree.assign(n, 0);
+		r.weighted_degree.assign(n, 0);
+		r.centrality.assign(n, 0.0);
+
+		vector<Span> spans(n);
+		for (size_t c = 0; c < n; ++c)
+		{
+			spans[c] = span(_bits[c]);
+			for (size_t w = spans[c].first; w < spans[c].end; ++w)
+				r.sequences[c] += popcount64(_bits[c][w]);
+		}
+
+		for (uint32_t a = 0; a < n; ++a)
+		{
+			if (!r.sequences[a])
+				continue;
+			const uint64_t* bits_a = _bits[a].data();
+			for (uint32_t b = a + 1; b < n; ++b)
+			{
+				size_t first = max(spans[a].first, spans[b].first);
+				size_t end = min(spans[a].end, spans[b].end);
+				if (first >= end)
+					continue;
+				const uint64_t* bits_b = _bits[b].data();
+				uint32_t shared = 0;
+				for (size_t w = first; w < end; ++w)
+					shared += popcount64(bits_a[w] & bits_b[w]);
+				if (!shared)
+					continue;
+				r.edges.push_back({ a, b, shared });
+				++r.degree[a];
+				++r.degree[b];
+				r.weighted_degree[a] += shared;
+				r.weighted_degree[b] += shared;
+			}
+		}
+
+		// Power iteration on the weighted adjacency plus the identity; the
+		// shift keeps a graph of two alternating halves from oscillating,
+		// and leaves the eigenvectors as they are.
+		if (r.edges.empty())
+			return r;
+		vector<double> x(n, 1.0), next(n);
+		for (int iteration = 0; iteration < 1000; ++iteration)
+		{
+			next = x;
+			for (auto& e : r.edges)
+			{
+				next[e.a] += e.sequences * x[e.b];
+				next[e.b] += e.sequences * x[e.a];
+			}
+			double largest = *max_element(next.begin(), next.end());
+			double change = 0;
+			for (size_t c = 0; c < n; ++c)
+			{
+				next[c] /= largest;
+				change = max(change, fabs(next[c] - x[c]));
+			}
+			x.swap(next);
+			if (change < 1e-10)
+				break;
+		}
+		r.centrality = x;
+		return r;
+	}
+
+	void writeCastEdges(OutputBuffer& out, const CastNetwork& network)
+	{
+		out.append("source\ttarget\tsequences\n");
+		for (auto& e : network.edges)
+		{
+			append_field(out, network.names[e.a]);
+			out.append('\t');
+			append_field(out, network.names[e.b]);
+			out.append('\t');
+			out.append(to_string(e.sequences));
+			out.append('\n');
+		}
+	}
+
+	void writeCastCentrality(OutputBuffer& out, const CastNetwork& network)
+	{
+		out.append("name\tsequences\tdegree\tweighted_degree\tcentrality\n");
+		for (size_t c = 0; c < network.names.size(); ++c)
+		{
+			char centrality[32];
+			snprintf(centrality, sizeof(centrality), "%.6f", network.centrality[c]);
+			append_field(out, network.names[c]);
+			out.append('\t');
+			out.append(to_string(network.sequences[c]));
+			out.append('\t');
+			out.append(to_string(network.degree[c]));
+			out.append('\t');
+			out.append(to_string(network.weighted_degree[c]));
+			out.append('\t');
+			out.append(centrality);
+			out.append('\n');
+		}
+	}
+
+	void CastReport::end(const Script& /*script*/)
+	{
+		CastNetwork network = _graph.network();
+		if (_centrality)
+			writeCastCentrality(_out, network);
+		else
+			writeCastEdges(_out, network);
+	}
+
+} // lab
@@ -0,0 +1,106 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "ScriptReport.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace lab
+{
+	class OutputBuffer;
+
+	// two characters, a < b, and the number of sequences they share
+	struct CastEdge
+	{
+		uint32_t a;
+		uint32_t b;
+		uint32_t sequences;
+	};
+
+	// The co-occurrence graph of a cast, indexed as CastGraph::names
+	struct CastNetwork
+	{
+		std::vector<std::string> names;
+		std::vector<uint32_t> sequences;		// in which each speaks
+		std::vector<CastEdge> edges;			// by a, then b
+		std::vector<uint32_t> degree;			// others each shares a sequence with
+		std::vector<uint64_t> weighted_degree;	// the sequences of each one's edges, summed
+		// eigenvector centrality over the edges weighted by shared
+		// sequences, scaled so that the most central character has 1: high
+		// for those who share many sequences with others who are central
+		std::vector<double> centrality;
+	};
+
+	// Which characters speak in the same sequences, over one script or
+	// many, as the episodes of a season. A character is known by their
+	// canonical name, so MARY in one episode is Mary in the next, and is
+	// named as first written. Each character's sequences are a bitset, so
+	// the sequences a pair shares are counted 64 at a time, by popcount of
+	// the intersection, over only the words where both have any. Filled by
+	// walks over scripts, or by add.
+	class CastGraph : public ScriptReport
+	{
+	public:
+		void add(const Script& script);
+
+		void begin(const Script& script) override;
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override;
+
+		// the names of the characters, in the order they first speak
+		const std::vector<std::string>& names() const { return _names; }
+		size_t sequence_count() const { return _sequence_count; }
+
+		// the pairwise counts of the scripts so far, and the centrality
+		// derived from them
+		CastNetwork network() const;
+
+	private:
+		uint32_t character(const ScriptNode& node);
+
+		std::vector<std::string> _names;
+		std::map<std::string, uint32_t> _ids;			// by canonical name
+		std::vector<std::vector<uint64_t>> _bits;		// a bit per sequence, by character
+		size_t _sequence_count = 0;
+
+		const Script* _script = nullptr;
+		std::vector<uint32_t> _script_ids;				// the script's character ids to ours
+		size_t _sequence = ~size_t(0);					// the sequence being walked
+		std::string _canonical;
+	};
+
+	// The graph as an edge list of tab separated values, a row for each
+	// pair of characters who share a sequence: source, target, and the
+	// number of sequences they share.
+	void writeCastEdges(OutputBuffer& out, const CastNetwork& network);
+
+	// A row for each character, in the order they first speak: the
+	// sequences they speak in, their degree and weighted degree, and their
+	// centrality.
+	void writeCastCentrality(OutputBuffer& out, const CastNetwork& network);
+
+	// A single script's graph, written as writeCastEdges or
+	// writeCastCentrality once the walk ends.
+	class CastReport : public ScriptReport
+	{
+	public:
+		CastReport(OutputBuffer& out, bool centrality) : _out(out), _centrality(centrality) {}
+
+		void begin(const Script& script) override { _graph = CastGraph(); _graph.begin(script); }
+		void sequence(const Sequence& seq, size_t index) override { _graph.sequence(seq, index); }
+		void node(const ScriptNode& node) override { _graph.node(node); }
+		void end(const Script& script) override;
+
+	private:
+		OutputBuffer& _out;
+		bool _centrality;
+		CastGraph _graph;
+	};
+
+} // lab
@@ -0,0 +1,284 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptColumns.h"
+#include "FileIO.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace lab
+{
+	using namespace std;
+
+	static_assert(host_little_endian, "columnar files are little endian, and read in place");
+
+	namespace
+	{
+		const char columnar_magic[8] = { 'L', 'a', 'b', 'S', 'c', 'o', 'l', '\0' };
+
+		inline uint64_t align8(uint64_t v)
+		{
+			return (v + 7) & ~uint64_t(7);
+		}
+
+		struct Section
+		{
+			const void* data;
+			uint64_t size;
+		};
+
+		template <typename T>
+		Section section(const vector<T>& v)
+		{
+			return { v.data(), v.size() * sizeof(T) };
+		}
+
+		Section section(const string& s)
+		{
+			return { s.data(), s.length() };
+		}
+	}
+
+	uint32_t ColumnarWriter::intern(std::string_view s)
+	{
+		auto i = _dictionary.lower_bound(s);
+		if (i != _dictionary.end() && i->first == s)
+			return i->second;
+
+		uint32_t id = static_cast<uint32_t>(_dictionary.size());
+		_dictionary.emplace_hint(i, std::string(s), id);
+		_string_bytes += s;
+		_string_offsets.push_back(_string_bytes.length());
+		return id;
+	}
+
+	void ColumnarWriter::add(const Script& script)
+	{
+		uint32_t script_id = _script_count++;
+
+		size_t line_count = _line_kind.size();
+		for (auto& seq : script.sequences)
+			line_count += seq.nodes.size();
+		_line_sequence.reserve(line_count);
+		_line_kind.reserve(line_count);
+		_line_character.reserve(line_count);
+		_line_text_offset.reserve(line_count);
+		_line_text_length.reserve(line_count);
+
+		for (auto& seq : script.sequences)
+		{
+			uint32_t row = static_cast<uint32_t>(_scene_name.size());
+			uint32_t dialog_count = 0;
+
+			for (auto& n : seq.nodes)
+			{
+				_line_sequence.push_back(row);
+				_line_kind.push_back(static_cast<uint8_t>(n.kind));
+				if (isDialogKind(n.kind))
+				{
+					_line_character.push_back(intern(script.character_name(n)));
+					++dialog_count;
+				}
+				else
+					_line_character.push_back(ColumnarNone);
+				_line_text_offset.push_back(_text.length());
+				_line_text_length.push_back(static_cast<uint32_t>(n.content.length()));
+				_text += n.content;
+			}
+
+			_scene_script.push_back(script_id);
+			_scene_name.push_back(intern(seq.name));
+			_scene_location.push_back(intern(seq.location));
+			_scene_flags.push_back((seq.interior ? ColumnarSceneInterior : 0) | (seq.exterior ? ColumnarSceneExterior : 0));
+			_scene_node_count.push_back(static_cast<uint32_t>(seq.nodes.size()));
+			_scene_dialog_count.push_back(dialog_count);
+		}
+
+		OutputBuffer out(_source_maps);
+		script.source_map.write(out);
+		out.flush();
+		_source_map_offsets.push_back(_source_maps.length());
+	}
+
+	void ColumnarWriter::write(int fd) const
+	{
+		vector<uint32_t> order(_dictionary.size());
+		for (uint32_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		auto bytes = [this](uint32_t id)
+		{
+			return string_view(_string_bytes).substr(_string_offsets[id], _string_offsets[id + 1] - _string_offsets[id]);
+		};
+		sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return bytes(a) < bytes(b); });
+
+		// order must match ColumnarSection
+		const Section sections[] =
+		{
+			section(_string_offsets),
+			section(_string_bytes),
+			section(order),
+			section(_scene_script),
+			section(_scene_name),
+			section(_scene_location),
+			section(_scene_flags),
+			section(_scene_node_count),
+			section(_scene_dialog_count),
+			section(_line_sequence),
+			section(_line_kind),
+			section(_line_character),
+			section(_line_text_offset),
+			section(_line_text_length),
+			section(_text),
+			section(_source_map_offsets),
+			section(_source_maps),
+		};
+		static_assert(sizeof(sections) / sizeof(Section) == static_cast<size_t>(ColumnarSection::Count),
+			"a section is missing from the writer");
+
+		ColumnarHeader header = {};
+		memcpy(header.magic, columnar_magic, sizeof(columnar_magic));
+		header.version = ColumnarVersion;
+		header.script_count = _script_count;
+		header.string_count = static_cast<uint32_t>(_dictionary.size());
+		header.scene_count = static_cast<uint32_t>(_scene_name.size());
+		header.line_count = _line_kind.size();
+
+		uint64_t offset = align8(sizeof(ColumnarHeader));
+		for (size_t i = 0; i < static_cast<size_t>(ColumnarSection::Count); ++i)
+		{
+			header.section_offset[i] = offset;
+			header.section_size[i] = sections[i].size;
+			offset = align8(offset + sections[i].size);
+		}
+
+		// each column is already contiguous, so it goes out in one write
+		static const char padding[8] = {};
+		OutputBuffer out(fd);
+		out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.append(padding, align8(sizeof(header)) - sizeof(header));
+		for (auto& s : sections)
+		{
+			out.append(static_cast<const char*>(s.data), s.size);
+			out.append(padding, align8(s.size) - s.size);
+		}
+		out.flush();
+	}
+
+	ColumnarView::ColumnarView(const char* data, size_t size)
+		: _data(data)
+		, _header(reinterpret_cast<const ColumnarHeader*>(data))
+	{
+		if (size < sizeof(ColumnarHeader) || memcmp(_header->magic, columnar_magic, sizeof(columnar_magic)))
+			throw std::runtime_error("Not a columnar script file");
+		if (_header->version != ColumnarVersion)
+			throw std::runtime_error("Unsupported columnar script version");
+
+		for (size_t i = 0; i < static_cast<size_t>(ColumnarSection::Count); ++i)
+		{
+			uint64_t o = _header->section_offset[i];
+			if (o & 7 || o > size || _header->section_size[i] > size - o)
+				throw std::runtime_error("Corrupt columnar script file");
+		}
+
+		auto expect = [this](ColumnarSection s, uint64_t bytes)
+		{
+			if (_header->section_size[static_cast<size_t>(s)] != bytes)
+				throw std::runtime_error("Corrupt columnar script file");
+		};
+		uint64_t scenes = _header->scene_count;
+		uint64_t lines = _header->line_count;
+		expect(ColumnarSection::StringOffsets, (uint64_t(_header->string_count) + 1) * sizeof(uint64_t));
+		expect(ColumnarSection::StringOrder, uint64_t(_header->string_count) * sizeof(uint32_t));
+		expect(ColumnarSection::SceneScript, scenes * sizeof(uint32_t));
+		expect(ColumnarSection::SceneName, scenes * sizeof(uint32_t));
+		expect(ColumnarSection::SceneLocation, scenes * sizeof(uint32_t));
+		expect(ColumnarSection::SceneFlags, scenes);
+		expect(ColumnarSection::SceneNodeCount, scenes * sizeof(uint32_t));
+		expect(ColumnarSection::SceneDialogCount, scenes * sizeof(uint32_t));
+		expect(ColumnarSection::LineSequence, lines * sizeof(uint32_t));
+		expect(ColumnarSection::LineKind, lines);
+		expect(ColumnarSection::LineCharacter, lines * sizeof(uint32_t));
+		expect(ColumnarSection::LineTextOffset, lines * sizeof(uint64_t));
+		expect(ColumnarSection::LineTextLength, lines * sizeof(uint32_t));
+		expect(ColumnarSection::SourceMapOffsets, (uint64_t(_header->script_count) + 1) * sizeof(uint64_t));
+
+		auto section_size = [this](ColumnarSection s) { return _header->section_size[static_cast<size_t>(s)]; };
+		auto check = [](bool ok)
+		{
+			if (!ok)
+				throw std::runtime_error("Corrupt columnar script file");
+		};
+		// offsets ascending from zero within the section they address
+		auto check_offsets = [&](ColumnarSection s, uint64_t count, ColumnarSection addressed)
+		{
+			const uint64_t* offsets = column<uint64_t>(s);
+			check(offsets[0] == 0);
+			for (uint64_t i = 0; i < count; ++i)
+				check(offsets[i] <= offsets[i + 1]);
+			check(offsets[count] <= section_size(addressed));
+		};
+		auto check_ids = [&](ColumnarSection s, uint64_t count, uint64_t limit, bool none_allowed)
+		{
+			const uint32_t* ids = column<uint32_t>(s);
+			for (uint64_t i = 0; i < count; ++i)
+				check(ids[i] < limit || (none_allowed && ids[i] == ColumnarNone));
+		};
+		uint32_t strings = _header->string_count;
+		check_offsets(ColumnarSection::StringOffsets, strings, ColumnarSection::StringBytes);
+		check_offsets(ColumnarSection::SourceMapOffsets, _header->script_count, ColumnarSection::SourceMaps);
+		check_ids(ColumnarSection::StringOrder, strings, strings, false);
+		check_ids(ColumnarSection::SceneScript, scenes, _header->script_count, false);
+		check_ids(ColumnarSection::SceneName, scenes, strings, false);
+		check_ids(ColumnarSection::SceneLocation, scenes, strings, false);
+		check_ids(ColumnarSection::LineSequence, lines, scenes, false);
+		check_ids(ColumnarSection::LineCharacter, lines, strings, true);
+
+		const uint64_t* text_offset = column<uint64_t>(ColumnarSection::LineTextOffset);
+		const uint32_t* text_length = column<uint32_t>(ColumnarSection::LineTextLength);
+		uint64_t text_size = section_size(ColumnarSection::Text);
+		for (uint64_t i = 0; i < lines; ++i)
+			check(text_offset[i] <= text_size && text_length[i] <= text_size - text_offset[i]);
+	}
+
+	const char* ColumnarView::string_data(uint32_t id, size_t& length) const
+	{
+		if (id >= _header->string_count)
+			throw std::out_of_range("No such string in columnar file");
+		const uint64_t* offsets = column<uint64_t>(ColumnarSection::StringOffsets);
+		length = static_cast<size_t>(offsets[id + 1] - offsets[id]);
+		return column<char>(ColumnarSection::StringBytes) + offsets[id];
+	}
+
+	std::string ColumnarView::string(uint32_t id) const
+	{
+		size_t length;
+		const char* s = string_data(id, length);
+		return std::string(s, length);
+	}
+
+	uint32_t ColumnarView::find_string(const std::string& s) const
+	{
+		const uint32_t* order = column<uint32_t>(ColumnarSection::StringOrder);
+		const uint32_t* end = order + _header->string_count;
+		auto bytes = [this](uint32_t id)
+		{
+			size_t length;
+			const char* data = string_data(id, length);
+			return string_view(data, length);
+		};
+		const uint32_t* i = lower_bound(order, end, string_view(s), [&](uint32_t id, string_view key) { return bytes(id) < key; });
+		return i != end && bytes(*i) == s ? *i : ColumnarNone;
+	}
+
+	SourceMap ColumnarView::source_map(uint32_t script) const
+	{
+		if (script >= _header->script_count)
+			throw std::out_of_range("No such script in columnar file");
+		const uint64_t* offsets = column<uint64_t>(ColumnarSection::SourceMapOffsets);
+		SourceMap map;
+		map.read(column<char>(ColumnarSection::SourceMaps) + offsets[script], static_cast<size_t>(offsets[script + 1] - offsets[script]));
+		return map;
+	}
+
+} // lab
@@ -0,0 +1,147 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+	// Columnar layout of one or more scripts, for analytics.
+	//
+	// The file is a ColumnarHeader followed by one section per column. Every
+	// section begins on an 8 byte boundary so a mapped file can be read in
+	// place. Values are little endian, and only a little endian host
+	// builds this. All strings other than node content are dictionary
+	// encoded; a string column holds ids into the string table, whose
+	// bytes are addressed by string_count + 1 offsets. The string order
+	// section lists the ids sorted by their bytes, for binary search.
+	//
+	// The scenes table has one row per Sequence, across all scripts.
+	// The lines table has one row per ScriptNode in a Sequence, and its
+	// sequence column holds the row of the scene it belongs to. Node content
+	// is addressed by text_offset and text_length into the text section.
+	//
+	// Each script's SourceMap, as SourceMap::write writes it, follows in
+	// the source map section, addressed by script_count + 1 offsets. Its
+	// sequences are those of the script's scene rows, in order.
+
+	enum class ColumnarSection : uint32_t
+	{
+		StringOffsets,     // uint64 [string_count + 1]
+		StringBytes,       // char
+		StringOrder,       // uint32 [string_count], ids sorted by bytes
+		SceneScript,       // uint32, index of the script in write order
+		SceneName,         // uint32 string id
+		SceneLocation,     // uint32 string id
+		SceneFlags,        // uint8, ColumnarSceneInterior | ColumnarSceneExterior
+		SceneNodeCount,    // uint32
+		SceneDialogCount,  // uint32
+		LineSequence,      // uint32 scene row
+		LineKind,          // uint8 NodeKind
+		LineCharacter,     // uint32 string id, ColumnarNone if not dialog
+		LineTextOffset,    // uint64
+		LineTextLength,    // uint32
+		Text,              // char
+		SourceMapOffsets,  // uint64 [script_count + 1]
+		SourceMaps,        // char
+		Count
+	};
+
+	const uint8_t ColumnarSceneInterior = 1;
+	const uint8_t ColumnarSceneExterior = 2;
+	const uint32_t ColumnarNone = 0xffffffff;
+	const uint32_t ColumnarVersion = 2;
+
+	struct ColumnarHeader
+	{
+		char magic[8];      // "LabScol\0"
+		uint32_t version;
+		uint32_t script_count;
+		uint32_t string_count;
+		uint32_t scene_count;
+		uint64_t line_count;
+		uint64_t section_offset[static_cast<size_t>(ColumnarSection::Count)];
+		uint64_t section_size[static_cast<size_t>(ColumnarSection::Count)];
+	};
+
+	// Accumulates the columns of any number of scripts, then writes them.
+	// The source scripts need not outlive add().
+	class ColumnarWriter
+	{
+	public:
+		void add(const Script& script);
+		void write(int fd) const;
+
+	private:
+		uint32_t intern(std::string_view s);
+
+		uint32_t _script_count = 0;
+		std::map<std::string, uint32_t, std::less<>> _dictionary;	// found by string_view, so a hit allocates nothing
+		std::vector<uint64_t> _string_offsets = { 0 };
+		std::string _string_bytes;
+
+		std::vector<uint32_t> _scene_script;
+		std::vector<uint32_t> _scene_name;
+		std::vector<uint32_t> _scene_location;
+		std::vector<uint8_t> _scene_flags;
+		std::vector<uint32_t> _scene_node_count;
+		std::vector<uint32_t> _scene_dialog_count;
+
+		std::vector<uint32_t> _line_sequence;
+		std::vector<uint8_t> _line_kind;
+		std::vector<uint32_t> _line_character;
+		std::vector<uint64_t> _line_text_offset;
+		std::vector<uint32_t> _line_text_length;
+		std::string _text;
+
+		std::vector<uint64_t> _source_map_offsets = { 0 };
+		std::string _source_maps;
+	};
+
+	// A validated view over a columnar file already in memory, typically a
+	// MappedFile. Nothing is copied; the accessors point into data. The
+	// constructor checks every offset and id the file holds against the
+	// sections they address, so a corrupt file throws there rather than
+	// reading out of bounds later.
+	class ColumnarView
+	{
+	public:
+		ColumnarView(const char* data, size_t size);
+
+		uint32_t script_count() const { return _header->script_count; }
+		uint32_t string_count() const { return _header->string_count; }
+		uint32_t scene_count() const { return _header->scene_count; }
+		uint64_t line_count() const { return _header->line_count; }
+
+		// throw std::out_of_range for an id not below string_count
+		std::string string(uint32_t id) const;
+		const char* string_data(uint32_t id, size_t& length) const;
+
+		// a binary search of the string order; ColumnarNone if s is not
+		// in the string table
+		uint32_t find_string(const std::string& s) const;
+
+		template <typename T>
+		const T* column(ColumnarSection section) const
+		{
+			return reinterpret_cast<const T*>(_data + _header->section_offset[static_cast<size_t>(section)]);
+		}
+
+		const char* text(uint64_t offset) const { return column<char>(ColumnarSection::Text) + offset; }
+
+		// the source map of a script, by its index in write order
+		SourceMap source_map(uint32_t script) const;
+
+	private:
+		const char* _data;
+		const ColumnarHeader* _header;
+	};
+
+} // lab
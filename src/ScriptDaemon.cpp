@@ -0,0 +1,608 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptDaemon.h"
+#include "FileIO.h"
+#include "Screenplay.h"
+#include "ScriptFdx.h"
+#include "ScriptJson.h"
+#include "ScriptReport.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+#ifndef _MSC_VER
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		const uint32_t request_magic = 0x4450534c;		// "LSPD"
+		const uint32_t response_magic = 0x5250534c;		// "LSPR"
+		const uint32_t max_field_length = 64 * 1024;
+
+		const uint32_t status_ok = 0;
+		const uint32_t status_failed = 1;
+
+		struct RequestHeader
+		{
+			uint32_t magic;
+			uint8_t kind;			// a DaemonRequest
+			uint8_t reserved[3];
+			uint32_t path_length;
+			uint32_t arg_length;
+		};
+
+		struct ResponseHeader
+		{
+			uint32_t magic;
+			uint32_t status;
+			uint64_t length;
+		};
+
+		static_assert(sizeof(RequestHeader) == 16 && sizeof(ResponseHeader) == 16, "headers are 16 bytes");
+
+		struct FileStamp
+		{
+			int64_t mtime;		// nanoseconds
+			uint64_t size;
+
+			bool operator==(const FileStamp& rh) const { return mtime == rh.mtime && size == rh.size; }
+		};
+
+		bool file_stamp(const string& path, FileStamp& stamp)
+		{
+#ifdef _MSC_VER
+			struct _stat64 st;
+			if (_stat64(path.c_str(), &st) != 0)
+				return false;
+			stamp.mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+			struct stat st;
+			if (::stat(path.c_str(), &st) != 0)
+				return false;
+#ifdef __APPLE__
+			stamp.mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+			stamp.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+			stamp.size = static_cast<uint64_t>(st.st_size);
+			return true;
+		}
+
+		// a parsed script and everything rendered from it; never changed
+		// once made, so connections share it without locking
+		struct Entry
+		{
+			Entry(const FileStamp& stamp, Script&& parsed)
+				: stamp(stamp)
+				, script(std::move(parsed))
+				, meta(ScriptMeta::build(script))
+			{
+				{
+					OutputBuffer out(summary);
+					writeSummary(out, script, meta);
+				}
+				{
+					OutputBuffer out(json);
+					writeJson(out, script, &meta);
+				}
+			}
+
+			FileStamp stamp;
+			Script script;
+			ScriptMeta meta;
+			string summary;
+			string json;
+		};
+
+		void append_line(OutputBuffer& out, string_view s)
+		{
+			// one line per item, whatever the item holds
+			for (char c : s)
+				out.append(c == '\n' ? ' ' : c);
+			out.append('\n');
+		}
+
+		bool query(const Entry& entry, string_view q, string& response)
+		{
+			const Script& script = entry.script;
+			const ScriptMeta& meta = entry.meta;
+			size_t space = q.find(' ');
+			string_view verb = q.substr(0, space);
+			string_view arg = space == string_view::npos ? string_view() : q.substr(space + 1);
+
+			OutputBuffer out(response);
+			if (verb == "locations")
+			{
+				for (auto& l : script.sets)
+					append_line(out, l);
+			}
+			else if (verb == "characters")
+			{
+				for (auto& cd : meta.character_dialog)
+				{
+					out.append(cd.first);
+					out.append('\t');
+					out.append(to_string(cd.second.size()));
+					out.append('\n');
+				}
+			}
+			else if (verb == "sequences")
+			{
+				for (auto& seq : script.sequences)
+				{
+					out.append(seq.name);
+					out.append('\t');
+					out.append(seq.scene_number);
+					out.append('\t');
+					append_line(out, seq.location);
+				}
+			}
+			else if (verb == "dialog")
+			{
+				// any cue for the character will do, as MARY (V.O.) for MARY
+				uint32_t id = script.character_id(arg);
+				auto i = id == ScriptNode::no_character ? meta.character_dialog.end()
+					: meta.character_dialog.find(script.character_names[id]);
+				if (i == meta.character_dialog.end())
+				{
+					out.append("No character ");
+					out.append(arg);
+					return false;
+				}
+				for (auto& line : i->second)
+					append_line(out, line);
+			}
+			else if (verb == "scene")
+			{
+				const Sequence* found = nullptr;
+				auto i = script.sequence_index.find(std::pmr::string(arg));
+				if (i != script.sequence_index.end())
+					found = &script.sequences[i->second];
+				for (size_t s = 0; !found && s < script.sequences.size(); ++s)
+					if (arg.length() && script.sequences[s].scene_number == arg)
+						found = &script.sequences[s];
+				if (!found)
+				{
+					out.append("No scene ");
+					out.append(arg);
+					return false;
+				}
+				out.append(found->as_fountain());
+			}
+			else
+			{
+				out.append("Unknown query ");
+				out.append(q);
+				return false;
+			}
+			return true;
+		}
+
+#ifndef _MSC_VER
+#ifdef MSG_NOSIGNAL
+		const int send_flags = MSG_NOSIGNAL;
+#else
+		const int send_flags = 0;
+#endif
+
+		// a peer that goes away must not take the process with it
+		void no_sigpipe(int fd)
+		{
+#ifdef SO_NOSIGPIPE
+			int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+			(void) fd;
+#endif
+		}
+
+		sockaddr_un unix_address(const string& path)
+		{
+			sockaddr_un addr = {};
+			addr.sun_family = AF_UNIX;
+			if (path.length() >= sizeof(addr.sun_path))
+				throw runtime_error("Socket path too long: " + path);
+			memcpy(addr.sun_path, path.c_str(), path.length() + 1);
+			return addr;
+		}
+
+		int connect_to(const sockaddr_un& addr)
+		{
+			int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0)
+				return -1;
+			if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+			{
+				::close(fd);
+				return -1;
+			}
+			no_sigpipe(fd);
+			return fd;
+		}
+
+		// fewer than len bytes only if the peer closed the connection
+		size_t recv_fully(int fd, void* data, size_t len)
+		{
+			char* p = static_cast<char*>(data);
+			size_t got = 0;
+			while (got < len)
+			{
+				ssize_t n = ::recv(fd, p + got, len - got, 0);
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					throw runtime_error("Receive failed");
+				}
+				if (n == 0)
+					break;
+				got += static_cast<size_t>(n);
+			}
+			return got;
+		}
+
+		// a header and its payload in as few system calls as the socket allows
+		void send_fully(int fd, iovec* parts, int count)
+		{
+			while (count)
+			{
+				msghdr m = {};
+				m.msg_iov = parts;
+				m.msg_iovlen = count;
+				ssize_t n = ::sendmsg(fd, &m, send_flags);
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					throw runtime_error("Send failed");
+				}
+				size_t sent = static_cast<size_t>(n);
+				while (count && sent >= parts->iov_len)
+				{
+					sent -= parts->iov_len;
+					++parts;
+					--count;
+				}
+				if (count)
+				{
+					parts->iov_base = static_cast<char*>(parts->iov_base) + sent;
+					parts->iov_len -= sent;
+				}
+			}
+		}
+
+		void send_response(int fd, bool ok, const string& payload)
+		{
+			ResponseHeader h = { response_magic, ok ? status_ok : status_failed, payload.length() };
+			iovec parts[2] = {
+				{ &h, sizeof(h) },
+				{ const_cast<char*>(payload.data()), payload.length() },
+			};
+			send_fully(fd, parts, 2);
+		}
+#endif
+	}
+
+	struct ScriptDaemon::Cache
+	{
+		struct Slot
+		{
+			shared_ptr<const Entry> entry;
+			uint64_t used;
+		};
+
+		size_t capacity;
+		mutex lock;
+		unordered_map<string, Slot> scripts;
+		uint64_t clock = 0;
+
+		// the entry for path, parsed again if the file has changed, or
+		// nullptr with the reason in error
+		shared_ptr<const Entry> find(const string& path, string& error)
+		{
+			FileStamp stamp;
+			if (!file_stamp(path, stamp))
+			{
+				error = path + " not found";
+				return nullptr;
+			}
+			{
+				lock_guard<mutex> guard(lock);
+				auto i = scripts.find(path);
+				if (i != scripts.end() && i->second.entry->stamp == stamp)
+				{
+					i->second.used = ++clock;
+					return i->second.entry;
+				}
+			}
+
+			// parsed outside the lock, so that a cold script doesn't hold up
+			// warm ones; the stamp predates the parse, so a file changed
+			// meanwhile is parsed again next time
+			unique_ptr<ChunkReader> reader = open_chunk_reader(path);
+			auto entry = make_shared<const Entry>(stamp, parseScriptInArena(*reader, path));
+
+			lock_guard<mutex> guard(lock);
+			if (scripts.size() >= capacity && !scripts.count(path))
+			{
+				auto oldest = scripts.begin();
+				for (auto i = scripts.begin(); i != scripts.end(); ++i)
+					if (i->second.used < oldest->second.used)
+						oldest = i;
+				scripts.erase(oldest);
+			}
+			scripts[path] = { entry, ++clock };
+			return entry;
+		}
+
+		// Points payload at the response: a rendering held by the entry,
+		// which holder keeps alive, or scratch.
+		bool respond(DaemonRequest kind, const string& path, const string& arg,
+			shared_ptr<const Entry>& holder, string& scratch, const string*& payload)
+		{
+			scratch.clear();
+			payload = &scratch;
+			try
+			{
+				if (kind != DaemonRequest::Summary && kind != DaemonRequest::Json && kind != DaemonRequest::Query)
+				{
+					scratch = "Unknown request";
+					return false;
+				}
+				holder = find(path, scratch);
+				if (!holder)
+					return false;
+				if (kind == DaemonRequest::Summary)
+					payload = &holder->summary;
+				else if (kind == DaemonRequest::Json)
+					payload = &holder->json;
+				else
+					return query(*holder, arg, scratch);
+				return true;
+			}
+			catch (exception& e)
+			{
+				scratch = e.what();
+				payload = &scratch;
+				return false;
+			}
+		}
+	};
+
+	ScriptDaemon::ScriptDaemon(size_t capacity)
+		: _cache(new Cache)
+	{
+		_cache->capacity = capacity > 0 ? capacity : 1;
+	}
+
+	ScriptDaemon::~ScriptDaemon()
+	{
+	}
+
+	bool ScriptDaemon::answer(DaemonRequest kind, const string& path, const string& arg, string& response)
+	{
+		shared_ptr<const Entry> holder;
+		const string* payload;
+		bool ok = _cache->respond(kind, path, arg, holder, response, payload);
+		if (payload != &response)
+			response = *payload;
+		return ok;
+	}
+
+#ifdef _MSC_VER
+	void ScriptDaemon::serve(const string&)
+	{
+		throw runtime_error("The daemon needs Unix domain sockets");
+	}
+
+	DaemonClient::DaemonClient(const string&)
+	{
+		throw runtime_error("The daemon needs Unix domain sockets");
+	}
+
+	DaemonClient::~DaemonClient()
+	{
+	}
+
+	bool DaemonClient::request(DaemonRequest, const string&, const string&, string&)
+	{
+		return false;
+	}
+#else
+	void ScriptDaemon::serve(const string& socket_path)
+	{
+		sockaddr_un addr = unix_address(socket_path);
+
+		// a socket file left by a daemon that died is taken over; a live
+		// daemon's is not
+		int probe = connect_to(addr);
+		if (probe >= 0)
+		{
+			::close(probe);
+			throw runtime_error("A daemon is already listening on " + socket_path);
+		}
+		::unlink(socket_path.c_str());
+
+		int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+			throw runtime_error("Couldn't create a socket");
+		if (::bind(listener, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listener, 64) != 0)
+		{
+			::close(listener);
+			throw runtime_error("Couldn't listen on " + socket_path);
+		}
+
+		struct Worker
+		{
+			thread t;
+			shared_ptr<atomic<bool>> done;
+		};
+		vector<Worker> workers;
+		mutex lock;
+		vector<int> open;			// connections, so that stopping can wake them
+		atomic<bool> stopping{ false };
+
+		auto connection = [&](int fd)
+		{
+			string path, arg, scratch;
+			shared_ptr<const Entry> holder;
+			for (;;)
+			{
+				RequestHeader h;
+				size_t got = recv_fully(fd, &h, sizeof(h));
+				// a peer that doesn't speak the protocol is dropped
+				if (got < sizeof(h) || h.magic != request_magic
+					|| h.path_length > max_field_length || h.arg_length > max_field_length)
+					return;
+				path.resize(h.path_length);
+				arg.resize(h.arg_length);
+				if (recv_fully(fd, &path[0], path.length()) < path.length()
+					|| recv_fully(fd, &arg[0], arg.length()) < arg.length())
+					return;
+
+				DaemonRequest kind = static_cast<DaemonRequest>(h.kind);
+				if (kind == DaemonRequest::Stop)
+				{
+					stopping = true;
+					send_response(fd, true, string());
+					// wake the accept
+					int wake = connect_to(addr);
+					if (wake >= 0)
+						::close(wake);
+					return;
+				}
+
+				const string* payload;
+				bool ok = _cache->respond(kind, path, arg, holder, scratch, payload);
+				send_response(fd, ok, *payload);
+				holder.reset();
+			}
+		};
+
+		while (!stopping)
+		{
+			int fd = ::accept(listener, nullptr, nullptr);
+			if (fd < 0)
+			{
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				break;
+			}
+			if (stopping)
+			{
+				::close(fd);
+				break;
+			}
+			no_sigpipe(fd);
+
+			// join the workers whose connections have closed
+			for (size_t i = 0; i < workers.size();)
+			{
+				if (*workers[i].done)
+				{
+					workers[i].t.join();
+					workers[i] = std::move(workers.back());
+					workers.pop_back();
+				}
+				else
+					++i;
+			}
+
+			{
+				lock_guard<mutex> guard(lock);
+				open.push_back(fd);
+			}
+			auto done = make_shared<atomic<bool>>(false);
+			workers.push_back({ thread([&, fd, done]
+			{
+				try
+				{
+					connection(fd);
+				}
+				catch (...)
+				{
+				}
+				{
+					lock_guard<mutex> guard(lock);
+					for (size_t i = 0; i < open.size(); ++i)
+						if (open[i] == fd)
+						{
+							open[i] = open.back();
+							open.pop_back();
+							break;
+						}
+				}
+				::close(fd);
+				*done = true;
+			}), done });
+		}
+
+		// connections waiting for their next request see the end of the stream
+		{
+			lock_guard<mutex> guard(lock);
+			for (int fd : open)
+				::shutdown(fd, SHUT_RDWR);
+		}
+		for (auto& w : workers)
+			w.t.join();
+		::close(listener);
+		::unlink(socket_path.c_str());
+	}
+
+	DaemonClient::DaemonClient(const string& socket_path)
+	{
+		_fd = connect_to(unix_address(socket_path));
+		if (_fd < 0)
+			throw runtime_error("No daemon is listening on " + socket_path);
+	}
+
+	DaemonClient::~DaemonClient()
+	{
+		if (_fd >= 0)
+			::close(_fd);
+	}
+
+	bool DaemonClient::request(DaemonRequest kind, const string& path, const string& arg, string& response)
+	{
+		string full = path.empty() ? path : filesystem::absolute(path).string();
+		if (full.length() > max_field_length || arg.length() > max_field_length)
+			throw runtime_error("Request too long");
+
+		RequestHeader h = { request_magic, static_cast<uint8_t>(kind), {},
+			static_cast<uint32_t>(full.length()), static_cast<uint32_t>(arg.length()) };
+		iovec parts[3] = {
+			{ &h, sizeof(h) },
+			{ const_cast<char*>(full.data()), full.length() },
+			{ const_cast<char*>(arg.data()), arg.length() },
+		};
+		send_fully(_fd, parts, 3);
+
+		ResponseHeader r;
+		if (recv_fully(_fd, &r, sizeof(r)) < sizeof(r) || r.magic != response_magic)
+			throw runtime_error("The daemon closed the connection");
+		response.resize(static_cast<size_t>(r.length));
+		if (recv_fully(_fd, &response[0], response.length()) < response.length())
+			throw runtime_error("The daemon closed the connection");
+		return r.status == status_ok;
+	}
+#endif
+
+} // lab
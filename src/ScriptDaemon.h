@@ -0,0 +1,82 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace lab
+{
+	enum class DaemonRequest : uint8_t
+	{
+		Summary = 1,	// writeSummary's text
+		Json = 2,		// writeJson's line, with meta
+		Query = 3,		// the argument is a query; see ScriptDaemon
+		Stop = 4,		// ends serve; the path is ignored
+	};
+
+	// Keeps parsed scripts resident, so that asking about a script again
+	// costs neither a process start nor a parse. Scripts are cached by path
+	// and parsed again when the file's modification time or size changes;
+	// the summary and JSON of each are rendered once, when it is parsed.
+	// The least recently used script is dropped when the cache is full.
+	//
+	// Queries answer a line per item:
+	//   locations       the sets
+	//   characters      each character and its line count, tab separated
+	//   sequences       each sequence's name, scene number, and location
+	//   dialog NAME     each line NAME speaks
+	//   scene NAME      a sequence, by name or scene number, as Fountain
+	//
+	// On the socket, a request is a 16 byte header, the path, and the
+	// argument, and a response is a 16 byte header and the payload. Both
+	// ends share a machine, so the headers are in host byte order. A
+	// connection may carry any number of requests.
+	class ScriptDaemon
+	{
+	public:
+		explicit ScriptDaemon(size_t capacity = 256);
+		~ScriptDaemon();
+
+		ScriptDaemon(const ScriptDaemon&) = delete;
+		ScriptDaemon& operator=(const ScriptDaemon&) = delete;
+
+		// Listens on a Unix domain socket at socket_path, answering each
+		// connection on a thread of its own, until a Stop request. Throws
+		// if another daemon is listening there.
+		void serve(const std::string& socket_path);
+
+		// Answers a request directly. Returns false on failure, with the
+		// reason as the response.
+		bool answer(DaemonRequest kind, const std::string& path, const std::string& arg, std::string& response);
+
+	private:
+		struct Cache;
+		std::unique_ptr<Cache> _cache;
+	};
+
+	// A connection to a ScriptDaemon.
+	class DaemonClient
+	{
+	public:
+		// throws if no daemon is listening on socket_path
+		explicit DaemonClient(const std::string& socket_path);
+		~DaemonClient();
+
+		DaemonClient(const DaemonClient&) = delete;
+		DaemonClient& operator=(const DaemonClient&) = delete;
+
+		// Relative paths are made absolute, since the daemon has a working
+		// directory of its own. Returns false if the daemon reports a
+		// failure, with the reason as the response; throws if the
+		// connection fails.
+		bool request(DaemonRequest kind, const std::string& path, const std::string& arg, std::string& response);
+
+	private:
+		int _fd = -1;
+	};
+
+} // lab
@@ -0,0 +1,474 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptDrafts.h"
+#include "FileIO.h"
+
+#include <LabText/TextScanner.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace lab
+{
+	using namespace std;
+
+	static_assert(host_little_endian, "draft stores are little endian, and read in place");
+
+	namespace
+	{
+		const char drafts_magic[8] = { 'L', 'a', 'b', 'S', 'd', 'f', 't', '\0' };
+		const uint8_t flag_interior = 1;
+		const uint8_t flag_exterior = 2;
+
+		inline uint64_t align8(uint64_t v)
+		{
+			return (v + 7) & ~uint64_t(7);
+		}
+
+		void corrupt()
+		{
+			throw std::runtime_error("Corrupt draft store");
+		}
+
+		void write_varint(string& out, uint64_t v)
+		{
+			while (v >= 0x80)
+			{
+				out += static_cast<char>(0x80 | (v & 0x7f));
+				v >>= 7;
+			}
+			out += static_cast<char>(v);
+		}
+
+		uint64_t read_varint(const char*& p, const char* end)
+		{
+			uint64_t v = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				if (p >= end)
+					corrupt();
+				uint8_t b = static_cast<uint8_t>(*p++);
+				v |= uint64_t(b & 0x7f) << shift;
+				if (!(b & 0x80))
+					return v;
+			}
+			corrupt();
+			return 0;
+		}
+
+		void write_bytes(string& out, string_view s)
+		{
+			write_varint(out, s.length());
+			out.append(s.data(), s.length());
+		}
+
+		string_view read_bytes(const char*& p, const char* end)
+		{
+			uint64_t length = read_varint(p, end);
+			if (length > uint64_t(end - p))
+				corrupt();
+			string_view s(p, static_cast<size_t>(length));
+			p += length;
+			return s;
+		}
+
+		// the name the parser gives sequence i, by its position, padded to
+		// five digits as Sequence pads it
+		string positional_name(size_t i)
+		{
+			string name = to_string(i + 1);
+			if (name.length() < 5)
+				name.insert(size_t(0), 5 - name.length(), '0');
+			return name;
+		}
+
+		// everything but the name, which follows from the sequence's place
+		// in its draft, so that inserting a scene changes no other's hash
+		void encode_sequence(const Sequence& seq, string& out)
+		{
+			write_bytes(out, seq.location);
+			write_bytes(out, seq.scene_number);
+			out += static_cast<char>((seq.interior ? flag_interior : 0) | (seq.exterior ? flag_exterior : 0));
+			write_varint(out, seq.nodes.size());
+			for (auto& n : seq.nodes)
+			{
+				out += static_cast<char>(n.kind);
+				write_bytes(out, n.key);
+				write_bytes(out, n.extension);
+				write_bytes(out, n.content);
+			}
+		}
+
+		// nodes that speak are given ids by script, as the parser gives them
+		void decode_sequence(string_view payload, Sequence& seq, Script& script)
+		{
+			const char* p = payload.data();
+			const char* end = p + payload.length();
+			string_view s = read_bytes(p, end);
+			seq.location.assign(s.data(), s.length());
+			s = read_bytes(p, end);
+			seq.scene_number.assign(s.data(), s.length());
+			if (p == end)
+				corrupt();
+			uint8_t flags = static_cast<uint8_t>(*p++);
+			seq.interior = (flags & flag_interior) != 0;
+			seq.exterior = (flags & flag_exterior) != 0;
+
+			uint64_t count = read_varint(p, end);
+			if (count > uint64_t(end - p) / 4)	// a node takes at least 4 bytes
+				corrupt();
+			seq.nodes.reserve(static_cast<size_t>(count));
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				if (p == end || static_cast<uint8_t>(*p) > static_cast<uint8_t>(NodeKind::Unknown))
+					corrupt();
+				NodeKind kind = static_cast<NodeKind>(*p++);
+				string_view key = read_bytes(p, end);
+				string_view extension = read_bytes(p, end);
+				string_view content = read_bytes(p, end);
+				seq.nodes.emplace_back(kind, key, content);
+				ScriptNode& n = seq.nodes.back();
+				n.extension.assign(extension.data(), extension.length());
+				if (isDialogKind(kind) || kind == NodeKind::Parenthetical)
+					n.character = script.add_character(n.key);
+			}
+			if (p != end)
+				corrupt();
+		}
+
+		inline uint64_t rotl64(uint64_t x, int r)
+		{
+			return (x << r) | (x >> (64 - r));
+		}
+
+		inline uint64_t fmix64(uint64_t k)
+		{
+			k ^= k >> 33;
+			k *= 0xff51afd7ed558ccdULL;
+			k ^= k >> 33;
+			k *= 0xc4ceb9fe1a85ec53ULL;
+			k ^= k >> 33;
+			return k;
+		}
+
+		// MurmurHash3 x64 128, seed 0, reading the input as little endian
+		SequenceHash hash_bytes(string_view data)
+		{
+			const uint64_t c1 = 0x87c37b91114253d5ULL;
+			const uint64_t c2 = 0x4cf5ad432745937fULL;
+			const size_t len = data.length();
+			const char* p = data.data();
+			uint64_t h1 = 0, h2 = 0;
+			for (size_t b = 0; b < len / 16; ++b, p += 16)
+			{
+				uint64_t k1, k2;
+				memcpy(&k1, p, 8);
+				memcpy(&k2, p + 8, 8);
+				k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+				h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+				k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+				h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+			}
+			const uint8_t* tail = reinterpret_cast<const uint8_t*>(p);
+			size_t rest = len & 15;
+			uint64_t k1 = 0, k2 = 0;
+			for (size_t i = rest; i > 8; --i)
+				k2 ^= uint64_t(tail[i - 1]) << ((i - 9) * 8);
+			if (rest > 8)
+			{
+				k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+			}
+			for (size_t i = min(rest, size_t(8)); i > 0; --i)
+				k1 ^= uint64_t(tail[i - 1]) << ((i - 1) * 8);
+			if (rest)
+			{
+				k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+			}
+			h1 ^= len;
+			h2 ^= len;
+			h1 += h2;
+			h2 += h1;
+			h1 = fmix64(h1);
+			h2 = fmix64(h2);
+			h1 += h2;
+			h2 += h1;
+			return { h1, h2 };
+		}
+
+		const size_t hash_bytes_size = 16;
+
+		SequenceHash read_hash(const char* p)
+		{
+			SequenceHash h;
+			memcpy(&h.lo, p, 8);
+			memcpy(&h.hi, p + 8, 8);
+			return h;
+		}
+
+		struct DraftPayload
+		{
+			string_view name;
+			string_view title_name;
+			string_view title;
+			const char* hashes;
+			size_t count;
+			const char* names;		// the sequences not named by position
+			const char* end;
+		};
+
+		DraftPayload read_draft(string_view payload)
+		{
+			const char* p = payload.data();
+			const char* end = p + payload.length();
+			DraftPayload d;
+			d.name = read_bytes(p, end);
+			d.title_name = read_bytes(p, end);
+			d.title = read_bytes(p, end);
+			uint64_t count = read_varint(p, end);
+			if (count > uint64_t(end - p) / hash_bytes_size)
+				corrupt();
+			d.hashes = p;
+			d.count = static_cast<size_t>(count);
+			d.names = p + count * hash_bytes_size;
+			d.end = end;
+			return d;
+		}
+
+		void append_record(string& out, DraftRecord kind, const SequenceHash& hash, string_view payload)
+		{
+			DraftRecordHeader h = {};
+			h.kind = static_cast<uint32_t>(kind);
+			h.size = payload.length();
+			h.hash = hash;
+			out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+			out.append(payload.data(), payload.length());
+			out.resize(static_cast<size_t>(align8(out.size())), '\0');
+		}
+	}
+
+	string SequenceHash::as_string() const
+	{
+		static const char digits[] = "0123456789abcdef";
+		string r(32, '0');
+		for (int i = 0; i < 16; ++i)
+		{
+			r[15 - i] = digits[(hi >> (i * 4)) & 15];
+			r[31 - i] = digits[(lo >> (i * 4)) & 15];
+		}
+		return r;
+	}
+
+	DraftStore::DraftStore(const string& path) : _path(path)
+	{
+		if (filesystem::exists(path) && filesystem::file_size(path) > 0)
+		{
+			_file.reset(new MappedFile(path));
+			read_records();
+		}
+	}
+
+	DraftStore::~DraftStore() = default;
+
+	void DraftStore::read_records()
+	{
+		_drafts.clear();
+		_sequences.clear();
+		_valid_size = 0;
+
+		const char* data = _file->data();
+		uint64_t size = _file->size();
+		// a header cut short was the first append, which the next redoes
+		if (size < sizeof(DraftStoreHeader))
+			return;
+		const DraftStoreHeader* header = reinterpret_cast<const DraftStoreHeader*>(data);
+		if (memcmp(header->magic, drafts_magic, sizeof(drafts_magic)))
+			throw std::runtime_error(_path + " is not a draft store");
+		if (header->version != DraftStoreVersion)
+			throw std::runtime_error("Unsupported draft store version");
+
+		uint64_t offset = sizeof(DraftStoreHeader);
+		while (size - offset >= sizeof(DraftRecordHeader))
+		{
+			const DraftRecordHeader* h = reinterpret_cast<const DraftRecordHeader*>(data + offset);
+			uint64_t available = size - offset - sizeof(DraftRecordHeader);
+			// a record still being appended, or cut off
+			if (h->size > available || align8(h->size) > available)
+				break;
+			uint64_t payload = offset + sizeof(DraftRecordHeader);
+			if (h->kind == static_cast<uint32_t>(DraftRecord::Sequence))
+				_sequences.emplace(h->hash, make_pair(payload, h->size));
+			else if (h->kind == static_cast<uint32_t>(DraftRecord::Draft))
+			{
+				DraftPayload d = read_draft(string_view(data + payload, static_cast<size_t>(h->size)));
+				_drafts.push_back({ string(d.name), payload, h->size });
+			}
+			else
+				corrupt();
+			offset = payload + align8(h->size);
+		}
+		_valid_size = offset;
+	}
+
+	string_view DraftStore::payload(uint64_t offset, uint64_t size) const
+	{
+		return string_view(_file->data() + offset, static_cast<size_t>(size));
+	}
+
+	size_t DraftStore::find(string_view name) const
+	{
+		for (size_t i = _drafts.size(); i > 0; --i)
+			if (_drafts[i - 1].name == name)
+				return i - 1;
+		return npos;
+	}
+
+	SequenceHash DraftStore::hash(const Sequence& seq)
+	{
+		string payload;
+		encode_sequence(seq, payload);
+		return hash_bytes(payload);
+	}
+
+	vector<SequenceHash> DraftStore::sequences(size_t draft) const
+	{
+		const Draft& d = _drafts.at(draft);
+		DraftPayload p = read_draft(payload(d.offset, d.size));
+		vector<SequenceHash> r(p.count);
+		for (size_t i = 0; i < p.count; ++i)
+			r[i] = read_hash(p.hashes + i * hash_bytes_size);
+		return r;
+	}
+
+	size_t DraftStore::add(const Script& script, string_view name, size_t* new_sequences)
+	{
+		// everything appended, as one write after the last whole record
+		string appended;
+		if (!_valid_size)
+		{
+			DraftStoreHeader header = {};
+			memcpy(header.magic, drafts_magic, sizeof(drafts_magic));
+			header.version = DraftStoreVersion;
+			appended.append(reinterpret_cast<const char*>(&header), sizeof(header));
+		}
+		uint64_t base = _valid_size;
+
+		unordered_map<SequenceHash, pair<uint64_t, uint64_t>, Hasher> added;
+		string hashes;
+		string sequence;
+		for (auto& seq : script.sequences)
+		{
+			sequence.clear();
+			encode_sequence(seq, sequence);
+			SequenceHash h = hash_bytes(sequence);
+			hashes.append(reinterpret_cast<const char*>(&h.lo), 8);
+			hashes.append(reinterpret_cast<const char*>(&h.hi), 8);
+
+			string_view stored;
+			auto i = _sequences.find(h);
+			if (i != _sequences.end())
+				stored = payload(i->second.first, i->second.second);
+			else
+			{
+				auto j = added.find(h);
+				if (j == added.end())
+				{
+					uint64_t offset = base + appended.size() + sizeof(DraftRecordHeader);
+					added.emplace(h, make_pair(offset, uint64_t(sequence.length())));
+					append_record(appended, DraftRecord::Sequence, h, sequence);
+					continue;
+				}
+				stored = string_view(appended).substr(static_cast<size_t>(j->second.first - base), static_cast<size_t>(j->second.second));
+			}
+			if (stored != sequence)
+				throw std::runtime_error("Two different sequences have the hash " + h.as_string());
+		}
+
+		string draft;
+		write_bytes(draft, name);
+		write_bytes(draft, script.title.name);
+		string title;
+		encode_sequence(script.title, title);
+		write_bytes(draft, title);
+		write_varint(draft, script.sequences.size());
+		draft += hashes;
+		// names as the parser gives them cost nothing; any other, as of a
+		// script built by hand, is kept with its position
+		string named;
+		size_t named_count = 0;
+		for (size_t i = 0; i < script.sequences.size(); ++i)
+		{
+			const std::pmr::string& n = script.sequences[i].name;
+			if (string_view(n) == positional_name(i))
+				continue;
+			write_varint(named, i);
+			write_bytes(named, n);
+			++named_count;
+		}
+		write_varint(draft, named_count);
+		draft += named;
+		uint64_t draft_offset = base + appended.size() + sizeof(DraftRecordHeader);
+		append_record(appended, DraftRecord::Draft, SequenceHash(), draft);
+
+		int fd = open_append_fd(_path, _valid_size);
+		write_fully(fd, appended.data(), appended.size());
+		close_output_fd(fd);
+
+		// the new records are known already; only the mapping is renewed
+		_file.reset();
+		_file.reset(new MappedFile(_path));
+		_valid_size = base + appended.size();
+		_sequences.insert(added.begin(), added.end());
+		_drafts.push_back({ string(name), draft_offset, draft.length() });
+		if (new_sequences)
+			*new_sequences = added.size();
+		return _drafts.size() - 1;
+	}
+
+	Script DraftStore::draft(size_t draft) const
+	{
+		const Draft& d = _drafts.at(draft);
+		DraftPayload p = read_draft(payload(d.offset, d.size));
+
+		vector<string_view> payloads(p.count);
+		size_t bytes = p.title.length();
+		for (size_t i = 0; i < p.count; ++i)
+		{
+			auto s = _sequences.find(read_hash(p.hashes + i * hash_bytes_size));
+			if (s == _sequences.end())
+				corrupt();
+			payloads[i] = payload(s->second.first, s->second.second);
+			bytes += payloads[i].length();
+		}
+
+		Script script = Script::inArena(bytes);
+		script.title.name.assign(p.title_name.data(), p.title_name.length());
+		decode_sequence(p.title, script.title, script);
+		script.sequences.reserve(p.count);
+		for (size_t i = 0; i < p.count; ++i)
+		{
+			script.sequences.emplace_back();
+			Sequence& seq = script.sequences.back();
+			seq.name = positional_name(i);
+			decode_sequence(payloads[i], seq, script);
+			script.sets.emplace(TextScanner::ToUpper(seq.as_string()));
+		}
+
+		const char* n = p.names;
+		uint64_t named_count = read_varint(n, p.end);
+		for (uint64_t k = 0; k < named_count; ++k)
+		{
+			uint64_t i = read_varint(n, p.end);
+			string_view name = read_bytes(n, p.end);
+			if (i >= p.count)
+				corrupt();
+			script.sequences[static_cast<size_t>(i)].name.assign(name.data(), name.length());
+		}
+		if (n != p.end)
+			corrupt();
+		for (size_t i = 0; i < p.count; ++i)
+			script.sequence_index[script.sequences[i].name] = static_cast<int>(i);
+		return script;
+	}
+
+} // lab
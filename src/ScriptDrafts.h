@@ -0,0 +1,149 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace lab
+{
+	class MappedFile;
+
+	// Every draft of a script, each sequence stored once however many
+	// drafts have it.
+	//
+	// The file is a DraftStoreHeader followed by records, each a
+	// DraftRecordHeader and its payload, padded to an 8 byte boundary.
+	// Values are little endian, and only a little endian host builds
+	// this. Records are only ever appended, so a draft costs the
+	// sequences no earlier draft had, and its own record. A record cut
+	// short, as by a crash while it was appended, is ignored, and the next
+	// append replaces it.
+	//
+	// A sequence's payload is its heading and nodes, as varint lengths and
+	// bytes
+	//
+	//   location, scene number, flags, node count,
+	//   then for each node: kind, key, extension, content
+	//
+	// and its hash is the hash of the payload, so the same sequence in any
+	// draft has the same hash. The sequence's name is left out: the parser
+	// names sequences by position, so inserting a scene would rename every
+	// one after it. Character ids are not stored either; they are assigned
+	// again as a draft is read back, in the order the parser assigns them.
+	// A draft's payload is
+	//
+	//   name, title page name, title page as a sequence's payload,
+	//   sequence count, the sequences' hashes in order,
+	//   then the count of sequences not named by position,
+	//   and for each: its index and name
+	//
+	// with the hashes 16 bytes each and the rest varints and bytes.
+
+	// a 128 bit hash of a sequence's content
+	struct SequenceHash
+	{
+		uint64_t lo = 0;
+		uint64_t hi = 0;
+
+		bool operator==(const SequenceHash& rh) const { return lo == rh.lo && hi == rh.hi; }
+		bool operator!=(const SequenceHash& rh) const { return !(*this == rh); }
+
+		// 32 hex digits
+		std::string as_string() const;
+	};
+
+	enum class DraftRecord : uint32_t
+	{
+		Sequence = 1,
+		Draft = 2,
+	};
+
+	const uint32_t DraftStoreVersion = 1;
+
+	struct DraftStoreHeader
+	{
+		char magic[8];		// "LabSdft\0"
+		uint32_t version;
+		uint32_t reserved;
+	};
+
+	struct DraftRecordHeader
+	{
+		uint32_t kind;		// DraftRecord
+		uint32_t reserved;
+		uint64_t size;		// of the payload, without padding
+		SequenceHash hash;	// of a sequence's payload; zero for a draft
+	};
+
+	class DraftStore
+	{
+	public:
+		// Opens the store at path, or an empty one that the first add
+		// creates.
+		explicit DraftStore(const std::string& path);
+		~DraftStore();
+
+		DraftStore(const DraftStore&) = delete;
+		DraftStore& operator=(const DraftStore&) = delete;
+
+		static const size_t npos = ~size_t(0);
+
+		size_t draft_count() const { return _drafts.size(); }
+		const std::string& draft_name(size_t draft) const { return _drafts.at(draft).name; }
+		// the latest draft of that name, or npos
+		size_t find(std::string_view name) const;
+
+		// the distinct sequences of every draft
+		size_t sequence_count() const { return _sequences.size(); }
+		// the bytes of whole records; anything after is a cut off append
+		uint64_t size() const { return _valid_size; }
+
+		// the hashes of a draft's sequences, in script order
+		std::vector<SequenceHash> sequences(size_t draft) const;
+
+		// Appends script as a draft, writing only the sequences not already
+		// stored, and returns the draft's index. The number of sequences
+		// written goes to new_sequences, if it is given.
+		size_t add(const Script& script, std::string_view name, size_t* new_sequences = nullptr);
+
+		// Reads a draft back into a script of its own arena. It equals the
+		// script that was added, character ids included, but for its
+		// source map, which is empty.
+		Script draft(size_t draft) const;
+
+		// of everything in the sequence but its name
+		static SequenceHash hash(const Sequence& seq);
+
+	private:
+		struct Draft
+		{
+			std::string name;
+			uint64_t offset;	// of the payload
+			uint64_t size;
+		};
+
+		struct Hasher
+		{
+			size_t operator()(const SequenceHash& h) const { return static_cast<size_t>(h.lo); }
+		};
+
+		void read_records();
+		std::string_view payload(uint64_t offset, uint64_t size) const;
+
+		std::string _path;
+		std::unique_ptr<MappedFile> _file;
+		uint64_t _valid_size = 0;
+		std::vector<Draft> _drafts;
+		std::unordered_map<SequenceHash, std::pair<uint64_t, uint64_t>, Hasher> _sequences;	// offset and size of each payload
+	};
+
+} // lab
@@ -0,0 +1,113 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptEmit.h"
+#include "FileIO.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace lab
+{
+	using namespace std;
+
+	void writeFountain(int fd, const Script& script, int threads)
+	{
+		const size_t count = script.sequences.size() + 1;	// the title page first
+		const size_t runs = (count + emit_run_sequences - 1) / emit_run_sequences;
+		if (threads <= 0)
+			threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+		if (threads == 1 || runs < 2)
+		{
+			string text = script.as_fountain();
+			write_fully(fd, text.data(), text.length());
+			return;
+		}
+
+		// A run is formatted by a writer of its own, as the script's writer
+		// would format it but for the blank lines that belong before the
+		// run's first sequences: before each one reached while nothing of
+		// the run is written yet, if anything came before the run.
+		struct Run
+		{
+			string text;
+			size_t leading = 0;
+		};
+		vector<Run> text(runs);
+		vector<char> formatted(runs, 0);
+		mutex m;
+		condition_variable ready;
+		atomic<size_t> next(0);
+		auto worker = [&]()
+		{
+			for (size_t r = next++; r < runs; r = next++)
+			{
+				Run& run = text[r];
+				FountainWriter writer;
+				size_t end = min(count, (r + 1) * emit_run_sequences);
+				for (size_t i = r * emit_run_sequences; i < end; ++i)
+				{
+					const Sequence& seq = i ? script.sequences[i - 1] : script.title;
+					if (run.text.empty())
+						++run.leading;
+					writer.sequence(seq, run.text);
+					for (auto& node : seq.nodes)
+						writer.node(node, run.text);
+				}
+				{
+					lock_guard<mutex> lock(m);
+					formatted[r] = 1;
+				}
+				ready.notify_one();
+			}
+		};
+		vector<thread> pool;
+		for (int i = 0; i < threads && static_cast<size_t>(i) < runs; ++i)
+			pool.emplace_back(worker);
+
+		try
+		{
+			const string blank_lines(emit_run_sequences, '\n');
+			bool written = false;
+			vector<string_view> pieces;
+			for (size_t r = 0; r < runs;)
+			{
+				size_t end = r;
+				{
+					unique_lock<mutex> lock(m);
+					ready.wait(lock, [&]() { return formatted[r] != 0; });
+					while (end < runs && formatted[end])
+						++end;
+				}
+				pieces.clear();
+				for (size_t i = r; i < end; ++i)
+				{
+					if (written)
+						pieces.push_back(string_view(blank_lines).substr(0, text[i].leading));
+					pieces.push_back(text[i].text);
+					written = written || text[i].text.length() > 0;
+				}
+				write_fully(fd, pieces.data(), pieces.size());
+				for (size_t i = r; i < end; ++i)
+					string().swap(text[i].text);
+				r = end;
+			}
+		}
+		catch (...)
+		{
+			next = runs;
+			for (auto& t : pool)
+				t.join();
+			throw;
+		}
+		for (auto& t : pool)
+			t.join();
+	}
+
+} // lab
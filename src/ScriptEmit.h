@@ -0,0 +1,26 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <cstddef>
+
+namespace lab
+{
+	// sequences a thread formats at a time; a script of fewer than two
+	// runs is written on the calling thread
+	const size_t emit_run_sequences = 32;
+
+	// Writes a script to fd as Fountain text, byte for byte as
+	// Script::as_fountain writes it. Runs of emit_run_sequences sequences,
+	// the title page first, are formatted into buffers of their own by up
+	// to threads threads, 0 for every hardware thread. The calling thread
+	// writes them in script order, every run formatted so far in one
+	// vectored write, and frees each buffer once it is written. A
+	// sequence's text depends on what came before it only for the blank
+	// line between them, which the caller supplies as it writes.
+	void writeFountain(int fd, const Script& script, int threads = 0);
+
+} // lab
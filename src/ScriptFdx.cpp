@@ -0,0 +1,537 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptFdx.h"
+#include "FileIO.h"
+#include "Utf8.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		bool is_space(char c)
+		{
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+		}
+
+		bool ends_with(string_view s, string_view suffix)
+		{
+			return s.length() >= suffix.length() && s.substr(s.length() - suffix.length()) == suffix;
+		}
+
+		bool equal_nocase(string_view a, string_view b)
+		{
+			if (a.length() != b.length())
+				return false;
+			for (size_t i = 0; i < a.length(); ++i)
+				if (toupper(static_cast<unsigned char>(a[i])) != toupper(static_cast<unsigned char>(b[i])))
+					return false;
+			return true;
+		}
+
+		// Appends text with its entities decoded. Where the text will be
+		// read as Fountain, * and _ are escaped so that they stay literal.
+		void decode(string_view text, bool escape, string& out)
+		{
+			for (size_t i = 0; i < text.length(); ++i)
+			{
+				char c = text[i];
+				if (c == '&')
+				{
+					size_t semi = text.find(';', i);
+					if (semi != string_view::npos)
+					{
+						string_view name = text.substr(i + 1, semi - i - 1);
+						char utf8[4];
+						size_t n = 0;
+						if (name == "amp") { utf8[0] = '&'; n = 1; }
+						else if (name == "lt") { utf8[0] = '<'; n = 1; }
+						else if (name == "gt") { utf8[0] = '>'; n = 1; }
+						else if (name == "quot") { utf8[0] = '"'; n = 1; }
+						else if (name == "apos") { utf8[0] = '\''; n = 1; }
+						else if (name.length() > 1 && name[0] == '#')
+						{
+							bool hex = name[1] == 'x' || name[1] == 'X';
+							string digits(name.substr(hex ? 2 : 1));
+							char* stop = nullptr;
+							unsigned long cp = digits.empty() ? 0 : strtoul(digits.c_str(), &stop, hex ? 16 : 10);
+							if (stop && !*stop && cp > 0)
+								n = utf8_encode(static_cast<uint32_t>(cp), utf8);
+						}
+						if (n)
+						{
+							if (escape && n == 1 && (utf8[0] == '*' || utf8[0] == '_'))
+								out += '\\';
+							out.append(utf8, n);
+							i = semi;
+							continue;
+						}
+					}
+				}
+				if (escape && (c == '*' || c == '_'))
+					out += '\\';
+				out += c;
+			}
+		}
+
+		// the value of attribute name in the text of a start tag, decoded
+		bool attribute(string_view tag, string_view name, string& value)
+		{
+			size_t i = 0;
+			while (i < tag.length() && !is_space(tag[i]) && tag[i] != '/')
+				++i;
+			while (i < tag.length())
+			{
+				while (i < tag.length() && (is_space(tag[i]) || tag[i] == '/'))
+					++i;
+				size_t start = i;
+				while (i < tag.length() && tag[i] != '=' && !is_space(tag[i]))
+					++i;
+				string_view key = tag.substr(start, i - start);
+				while (i < tag.length() && (is_space(tag[i]) || tag[i] == '='))
+					++i;
+				if (i >= tag.length() || (tag[i] != '"' && tag[i] != '\''))
+					return false;
+				size_t close = tag.find(tag[i], i + 1);
+				if (close == string_view::npos)
+					return false;
+				if (key == name)
+				{
+					value.clear();
+					decode(tag.substr(i + 1, close - i - 1), false, value);
+					return true;
+				}
+				i = close + 1;
+			}
+			return false;
+		}
+
+		bool is_credit(string_view text)
+		{
+			static const char* credits[] = { "by", "written by", "screenplay by", "teleplay by", "story by" };
+			for (const char* credit : credits)
+				if (equal_nocase(text, credit))
+					return true;
+			return false;
+		}
+	}
+
+	struct FdxStream::State
+	{
+		explicit State(Script& script)
+			: builder(script)
+		{
+		}
+
+		// a paragraph of the script or its title page, being read
+		struct Paragraph
+		{
+			string type;
+			string number;
+			uint64_t offset;
+			size_t depth;		// its element's index in elements
+			string text;
+		};
+
+		ScriptBuilder builder;
+		uint64_t offset = 0;		// of the start of the piece being fed
+
+		bool in_markup = false;
+		string markup;				// between < and >, once the tag is whole
+		char quote = 0;
+		uint64_t markup_offset = 0;
+
+		vector<string> elements;	// open elements, outermost first
+		vector<Paragraph> paragraphs;
+		bool seen_root = false;
+		bool dual = false;
+		int dual_cues = 0;
+
+		// the open Text element of a paragraph, if any
+		bool in_text = false;
+		bool plain = false;			// a heading or cue, read without emphasis
+		string raw;					// its text, entities not yet decoded
+		string run;
+		string style;
+
+		vector<string> title_page;
+
+		bool is_tag() const
+		{
+			return !markup.empty() && markup[0] != '!' && markup[0] != '?';
+		}
+
+		// true if a > ends the markup read so far
+		bool markup_ends() const
+		{
+			string_view m(markup);
+			if (m.substr(0, 3) == "!--")
+				return m.length() >= 5 && ends_with(m, "--");
+			if (m.substr(0, 8) == "![CDATA[")
+				return m.length() >= 10 && ends_with(m, "]]");
+			if (m.substr(0, 1) == "?")
+				return m.length() >= 2 && ends_with(m, "?");
+			if (m.substr(0, 1) == "!")
+			{
+				// a DOCTYPE may hold declarations of its own, in brackets
+				int depth = 0;
+				for (char c : m)
+					depth += c == '[' ? 1 : c == ']' ? -1 : 0;
+				return depth <= 0;
+			}
+			return quote == 0;
+		}
+
+		void flush_raw()
+		{
+			if (in_text && raw.length())
+				decode(raw, !plain, run);
+			raw.clear();
+		}
+
+		void end_markup()
+		{
+			in_markup = false;
+			string_view m(markup);
+			if (m.substr(0, 8) == "![CDATA[")
+			{
+				if (in_text)
+				{
+					string_view data = m.substr(8, m.length() - 10);
+					for (char c : data)
+					{
+						if (!plain && (c == '*' || c == '_'))
+							run += '\\';
+						run += c;
+					}
+				}
+				return;
+			}
+			if (!is_tag())
+				return;
+
+			if (m[0] == '/')
+			{
+				size_t e = 1;
+				while (e < m.length() && !is_space(m[e]))
+					++e;
+				end_element(m.substr(1, e - 1));
+				return;
+			}
+			bool empty = m.back() == '/';
+			size_t e = 0;
+			while (e < m.length() && !is_space(m[e]) && m[e] != '/')
+				++e;
+			string_view name = m.substr(0, e);
+			start_element(name, m);
+			if (empty)
+				end_element(name);
+		}
+
+		// the paragraph whose element is elements[depth], if it is one being read
+		Paragraph* paragraph_at(size_t depth)
+		{
+			if (paragraphs.empty() || paragraphs.back().depth != depth)
+				return nullptr;
+			return &paragraphs.back();
+		}
+
+		void start_element(string_view name, string_view tag)
+		{
+			size_t n = elements.size();
+			if (!n)
+			{
+				if (name != "FinalDraft" || seen_root)
+					throw runtime_error("Not a Final Draft file");
+				seen_root = true;
+			}
+
+			if (name == "Paragraph")
+			{
+				// the script's and the title page's own paragraphs, and those
+				// of a dual dialogue within one, but not those of headers,
+				// notes, or scene properties
+				bool content = n >= 1 && elements[n - 1] == "Content"
+					&& ((n == 2 && elements[0] == "FinalDraft") || (n == 3 && elements[1] == "TitlePage"));
+				bool in_dual = n >= 2 && elements[n - 1] == "DualDialogue" && paragraph_at(n - 2);
+				if (content || in_dual)
+				{
+					Paragraph p;
+					attribute(tag, "Type", p.type);
+					attribute(tag, "Number", p.number);
+					p.offset = markup_offset;
+					p.depth = n;
+					paragraphs.push_back(std::move(p));
+				}
+			}
+			else if (name == "DualDialogue")
+			{
+				if (n >= 1 && paragraph_at(n - 1))
+				{
+					dual = true;
+					dual_cues = 0;
+				}
+			}
+			else if (name == "Text")
+			{
+				if (Paragraph* p = paragraph_at(n - 1))
+				{
+					in_text = true;
+					plain = p->type == "Scene Heading" || p->type == "Character" || in_title_page();
+					run.clear();
+					raw.clear();
+					if (!attribute(tag, "Style", style))
+						style.clear();
+				}
+			}
+			elements.emplace_back(name);
+		}
+
+		void end_element(string_view name)
+		{
+			if (elements.empty() || elements.back() != name)
+				throw runtime_error("Malformed Final Draft file: unexpected </" + string(name) + ">");
+			elements.pop_back();
+			size_t n = elements.size();
+
+			if (name == "Text")
+			{
+				if (in_text)
+					end_text();
+			}
+			else if (name == "Paragraph")
+			{
+				if (paragraph_at(n))
+				{
+					end_paragraph(paragraphs.back());
+					paragraphs.pop_back();
+				}
+			}
+			else if (name == "DualDialogue")
+				dual = false;
+			else if (name == "TitlePage" && n == 1)
+				end_title_page();
+		}
+
+		bool in_title_page() const
+		{
+			return elements.size() > 1 && elements[1] == "TitlePage";
+		}
+
+		// Styles are written as emphasis around the run, and any space at
+		// either end of the run is left outside, as Fountain requires.
+		void end_text()
+		{
+			in_text = false;
+			string& text = paragraphs.back().text;
+			if (plain || style.empty())
+			{
+				text += run;
+				return;
+			}
+
+			bool bold = false, italic = false, underline = false;
+			size_t start = 0;
+			while (start <= style.length())
+			{
+				size_t plus = style.find('+', start);
+				if (plus == string::npos)
+					plus = style.length();
+				string_view s = string_view(style).substr(start, plus - start);
+				bold |= s == "Bold";
+				italic |= s == "Italic";
+				underline |= s == "Underline";
+				start = plus + 1;
+			}
+			string open = underline ? "_" : "";
+			open += bold && italic ? "***" : bold ? "**" : italic ? "*" : "";
+			string close(open.rbegin(), open.rend());
+
+			size_t b = 0, e = run.length();
+			while (b < e && is_space(run[b]))
+				++b;
+			while (e > b && is_space(run[e - 1]))
+				--e;
+			if (b == e || open.empty())
+			{
+				text += run;
+				return;
+			}
+			text.append(run, 0, b);
+			text += open;
+			text.append(run, b, e - b);
+			text += close;
+			text.append(run, e, string::npos);
+		}
+
+		void end_paragraph(const Paragraph& p)
+		{
+			string_view text(p.text);
+			while (text.length() && is_space(text.front()))
+				text.remove_prefix(1);
+			while (text.length() && is_space(text.back()))
+				text.remove_suffix(1);
+			if (text.empty())
+				return;
+
+			if (in_title_page())
+			{
+				title_page.emplace_back(text);
+				return;
+			}
+
+			const string& type = p.type;
+			if (type == "Scene Heading")
+				builder.heading(text, p.number, p.offset);
+			else if (type == "Character")
+				builder.cue(text, dual && ++dual_cues == 2);
+			else if (type == "Parenthetical")
+				builder.parenthetical(text);
+			else if (type == "Dialogue")
+				builder.dialog(text);
+			else if (type == "Transition")
+				builder.add(NodeKind::Transition, text);
+			else if (type == "Lyrics")
+				builder.add(NodeKind::Lyric, text);
+			else if (type == "New Act")
+				builder.add(NodeKind::Section, text);
+			else
+				builder.add(NodeKind::Action, text);
+		}
+
+		void end_title_page()
+		{
+			string contact;
+			for (size_t i = 0; i < title_page.size(); ++i)
+			{
+				const string& text = title_page[i];
+				if (i == 0)
+					builder.title_entry("Title", text);
+				else if (is_credit(text))
+				{
+					builder.title_entry("Credit", text);
+					if (i + 1 < title_page.size())
+						builder.title_entry("Author", title_page[++i]);
+				}
+				else
+				{
+					if (contact.length())
+						contact += '\n';
+					contact += text;
+				}
+			}
+			if (contact.length())
+				builder.title_entry("Contact", contact);
+			title_page.clear();
+		}
+
+		void feed(const char* data, size_t length)
+		{
+			const char* p = data;
+			const char* end = data + length;
+			while (p < end)
+			{
+				if (!in_markup)
+				{
+					const char* lt = static_cast<const char*>(memchr(p, '<', end - p));
+					const char* stop = lt ? lt : end;
+					if (in_text)
+						raw.append(p, stop);
+					if (!lt)
+						break;
+					flush_raw();
+					in_markup = true;
+					markup.clear();
+					quote = 0;
+					markup_offset = offset + (lt - data);
+					p = lt + 1;
+					continue;
+				}
+
+				// within markup, a > may be quoted, or part of a comment
+				for (; p < end; ++p)
+				{
+					char c = *p;
+					if (c == '>' && markup_ends())
+					{
+						++p;
+						end_markup();
+						break;
+					}
+					if (quote)
+					{
+						if (c == quote)
+							quote = 0;
+					}
+					else if ((c == '"' || c == '\'') && is_tag())
+						quote = c;
+					markup += c;
+				}
+			}
+			offset += length;
+		}
+	};
+
+	FdxStream::FdxStream(Script& script)
+		: _state(new State(script))
+	{
+	}
+
+	FdxStream::~FdxStream()
+	{
+	}
+
+	void FdxStream::feed(const char* data, size_t length)
+	{
+		_state->feed(data, length);
+	}
+
+	void FdxStream::finish()
+	{
+		if (!_state->seen_root)
+			throw runtime_error("Not a Final Draft file");
+		if (_state->in_markup || _state->elements.size())
+			throw runtime_error("Truncated Final Draft file");
+		_state->builder.finish();
+	}
+
+	bool is_fdx_path(const string& path)
+	{
+		string_view p(path);
+		if (p.length() > 3 && equal_nocase(p.substr(p.length() - 3), ".gz"))
+			p.remove_suffix(3);
+		return p.length() > 4 && equal_nocase(p.substr(p.length() - 4), ".fdx");
+	}
+
+	Script parseFinalDraftInArena(ChunkReader& reader)
+	{
+		// the markup is most of an .fdx file, so the text is a fraction of
+		// its size
+		Script script = Script::inArena(static_cast<size_t>(reader.size() / 2));
+		FdxStream stream(script);
+		size_t length;
+		while (const char* chunk = reader.next(length))
+			stream.feed(chunk, length);
+		stream.finish();
+		return script;
+	}
+
+	Script parseScriptInArena(ChunkReader& reader, const string& path, uint64_t* invalid_utf8)
+	{
+		if (!is_fdx_path(path))
+			return Script::parseFountainInArena(reader, invalid_utf8);
+		if (invalid_utf8)
+			*invalid_utf8 = FountainStream::npos;
+		return parseFinalDraftInArena(reader);
+	}
+
+} // lab
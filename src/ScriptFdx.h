@@ -0,0 +1,62 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace lab
+{
+	class ChunkReader;
+
+	// Parses a Final Draft .fdx file arriving in pieces, as FountainStream
+	// parses Fountain. The XML is tokenized as it streams past, without a
+	// document tree; only a partial tag and the paragraph being read are
+	// ever held. Paragraphs become nodes through a ScriptBuilder:
+	//
+	//   Scene Heading       a sequence, numbered by its Number attribute
+	//   Action, General,    Action
+	//   Shot
+	//   Character           a cue; the second in a DualDialogue is dual
+	//   Parenthetical       Parenthetical
+	//   Dialogue            Dialog
+	//   Transition          Transition
+	//   Lyrics              Lyric
+	//   New Act             Section
+	//
+	// and other types become Action. Bold, Italic, and Underline styles
+	// are written as Fountain emphasis, and literal * and _ are escaped.
+	// The title page's paragraphs become its Title, then Credit and Author
+	// if a paragraph reads as a credit such as "Written by", and Contact.
+	class FdxStream
+	{
+	public:
+		explicit FdxStream(Script& script);
+		~FdxStream();
+
+		void feed(const char* data, size_t length);
+
+		// throws if the text was not a whole Final Draft document
+		void finish();
+
+	private:
+		struct State;
+		std::unique_ptr<State> _state;
+	};
+
+	// true for .fdx and .fdx.gz
+	bool is_fdx_path(const std::string& path);
+
+	// all that reader delivers, parsed as Final Draft into an arena
+	Script parseFinalDraftInArena(ChunkReader& reader);
+
+	// Final Draft if path names an .fdx file, otherwise Fountain, which
+	// reports invalid UTF-8 as Script::parseFountainInArena does
+	Script parseScriptInArena(ChunkReader& reader, const std::string& path, uint64_t* invalid_utf8 = nullptr);
+
+} // lab
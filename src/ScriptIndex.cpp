@@ -0,0 +1,481 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptIndex.h"
+#include "FileIO.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace lab
+{
+	using namespace std;
+
+	static_assert(host_little_endian, "corpus indexes are little endian, and read in place");
+
+	namespace
+	{
+		const char corpus_magic[8] = { 'L', 'a', 'b', 'S', 'i', 'd', 'x', '\0' };
+
+		inline uint64_t align8(uint64_t v)
+		{
+			return (v + 7) & ~uint64_t(7);
+		}
+
+		void corrupt()
+		{
+			throw std::runtime_error("Corrupt corpus index");
+		}
+
+		void write_varint(string& out, uint64_t v)
+		{
+			while (v >= 0x80)
+			{
+				out += static_cast<char>(0x80 | (v & 0x7f));
+				v >>= 7;
+			}
+			out += static_cast<char>(v);
+		}
+
+		uint64_t read_varint(const char*& p, const char* end)
+		{
+			uint64_t v = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				if (p >= end)
+					corrupt();
+				uint8_t b = static_cast<uint8_t>(*p++);
+				v |= uint64_t(b & 0x7f) << shift;
+				if (!(b & 0x80))
+					return v;
+			}
+			corrupt();
+			return 0;
+		}
+
+		string term_key(CorpusTerm kind, string_view name)
+		{
+			string key(1, static_cast<char>(kind));
+			string canonical;
+			canonicalCharacter(name, canonical);
+			return key + canonical;
+		}
+
+		// INT. DINER - NIGHT is at DINER
+		string_view location_of(string_view set)
+		{
+			for (string_view prefix : { "INT/EXT ", "INT. ", "EXT. " })
+				if (set.substr(0, prefix.length()) == prefix)
+				{
+					set.remove_prefix(prefix.length());
+					break;
+				}
+			size_t dash = set.rfind(" - ");
+			if (dash != string_view::npos)
+				set = set.substr(0, dash);
+			return set;
+		}
+
+		// the terms of a segment in order, from the start of a block
+		struct TermCursor
+		{
+			const char* p;
+			const char* end;
+			uint32_t index;
+			uint32_t term_count;
+			string term;
+			uint64_t posting_offset = 0;
+			uint64_t posting_count = 0;
+
+			bool next()
+			{
+				if (index >= term_count)
+					return false;
+				uint64_t shared = read_varint(p, end);
+				uint64_t suffix = read_varint(p, end);
+				if (shared > term.length() || (index % corpus_block_terms == 0 && shared) || suffix > uint64_t(end - p))
+					corrupt();
+				term.resize(static_cast<size_t>(shared));
+				term.append(p, static_cast<size_t>(suffix));
+				p += suffix;
+				posting_offset = read_varint(p, end);
+				posting_count = read_varint(p, end);
+				++index;
+				return true;
+			}
+		};
+	}
+
+	CorpusIndex::CorpusIndex(const char* data, size_t size)
+	{
+		uint64_t offset = 0;
+		while (size - offset >= sizeof(CorpusIndexHeader))
+		{
+			const CorpusIndexHeader* h = reinterpret_cast<const CorpusIndexHeader*>(data + offset);
+			if (memcmp(h->magic, corpus_magic, sizeof(corpus_magic)))
+				throw std::runtime_error(offset ? "Corrupt corpus index" : "Not a corpus index");
+			if (h->version != CorpusIndexVersion)
+				throw std::runtime_error("Unsupported corpus index version");
+			// a segment still being appended, or cut off
+			if (h->segment_size > size - offset)
+				break;
+			if (h->segment_size < sizeof(CorpusIndexHeader) || h->segment_size & 7 || h->first_script != _script_count)
+				corrupt();
+			for (size_t i = 0; i < static_cast<size_t>(CorpusSection::Count); ++i)
+			{
+				uint64_t o = h->section_offset[i];
+				if (o & 7 || o > h->segment_size || h->section_size[i] > h->segment_size - o)
+					corrupt();
+			}
+			auto expect = [h](CorpusSection s, uint64_t bytes)
+			{
+				if (h->section_size[static_cast<size_t>(s)] != bytes)
+					corrupt();
+			};
+			expect(CorpusSection::ScriptOffsets, (uint64_t(h->script_count) + 1) * sizeof(uint64_t));
+			expect(CorpusSection::BlockOffsets, uint64_t(h->block_count) * sizeof(uint64_t));
+			if (h->block_count != (h->term_count + corpus_block_terms - 1) / corpus_block_terms)
+				corrupt();
+
+			Segment segment{ h, data + offset };
+			const uint64_t* names = segment.section<uint64_t>(CorpusSection::ScriptOffsets);
+			if (names[0] || names[h->script_count] > h->section_size[static_cast<size_t>(CorpusSection::ScriptNames)])
+				corrupt();
+			for (uint32_t i = 0; i < h->script_count; ++i)
+				if (names[i] > names[i + 1])
+					corrupt();
+			const uint64_t* blocks = segment.section<uint64_t>(CorpusSection::BlockOffsets);
+			for (uint32_t b = 0; b < h->block_count; ++b)
+				if (blocks[b] >= h->section_size[static_cast<size_t>(CorpusSection::Terms)])
+					corrupt();
+
+			_segments.push_back(segment);
+			_script_count += h->script_count;
+			offset += h->segment_size;
+		}
+		_valid_size = offset;
+	}
+
+	string_view CorpusIndex::script_name(uint32_t id) const
+	{
+		for (auto& s : _segments)
+		{
+			uint32_t first = s.header->first_script;
+			if (id >= first && id - first < s.header->script_count)
+			{
+				const uint64_t* offsets = s.section<uint64_t>(CorpusSection::ScriptOffsets);
+				uint32_t i = id - first;
+				return string_view(s.section<char>(CorpusSection::ScriptNames) + offsets[i],
+					static_cast<size_t>(offsets[i + 1] - offsets[i]));
+			}
+		}
+		throw std::out_of_range("No such script in the corpus index");
+	}
+
+	namespace
+	{
+		template <typename Segment>
+		TermCursor cursor_at(const Segment& s, uint32_t block)
+		{
+			const char* terms = s.template section<char>(CorpusSection::Terms);
+			TermCursor c;
+			c.p = terms + s.template section<uint64_t>(CorpusSection::BlockOffsets)[block];
+			c.end = terms + s.header->section_size[static_cast<size_t>(CorpusSection::Terms)];
+			c.index = block * corpus_block_terms;
+			c.term_count = s.header->term_count;
+			return c;
+		}
+
+		// the last block whose first term is no greater than key, or 0
+		template <typename Segment>
+		uint32_t block_for(const Segment& s, string_view key)
+		{
+			const char* terms = s.template section<char>(CorpusSection::Terms);
+			const char* end = terms + s.header->section_size[static_cast<size_t>(CorpusSection::Terms)];
+			const uint64_t* blocks = s.template section<uint64_t>(CorpusSection::BlockOffsets);
+			uint32_t lo = 0, hi = s.header->block_count;
+			while (hi - lo > 1)
+			{
+				uint32_t mid = lo + (hi - lo) / 2;
+				const char* p = terms + blocks[mid];
+				read_varint(p, end);	// shared, 0 at a block's start
+				uint64_t length = read_varint(p, end);
+				if (length > uint64_t(end - p))
+					corrupt();
+				if (string_view(p, static_cast<size_t>(length)) <= key)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			return lo;
+		}
+
+		template <typename Segment>
+		void read_postings(const Segment& s, const TermCursor& c, vector<uint32_t>& ids)
+		{
+			const char* postings = s.template section<char>(CorpusSection::Postings);
+			uint64_t size = s.header->section_size[static_cast<size_t>(CorpusSection::Postings)];
+			if (c.posting_offset > size)
+				corrupt();
+			const char* p = postings + c.posting_offset;
+			uint64_t id = 0;
+			for (uint64_t i = 0; i < c.posting_count; ++i)
+			{
+				id += read_varint(p, postings + size);
+				ids.push_back(static_cast<uint32_t>(id));
+			}
+		}
+	}
+
+	vector<uint32_t> CorpusIndex::find(CorpusTerm kind, string_view name) const
+	{
+		string key = term_key(kind, name);
+		vector<uint32_t> ids;
+		for (auto& s : _segments)
+		{
+			if (!s.header->term_count)
+				continue;
+			TermCursor c = cursor_at(s, block_for(s, key));
+			for (uint32_t n = 0; n < corpus_block_terms && c.next(); ++n)
+			{
+				if (c.term < key)
+					continue;
+				if (c.term == key)
+					read_postings(s, c, ids);
+				break;
+			}
+		}
+		return ids;
+	}
+
+	void CorpusIndex::scan(const Segment& s, const string& from, const string& prefix,
+		map<string, vector<uint32_t>>& matches) const
+	{
+		if (!s.header->term_count)
+			return;
+		TermCursor c = cursor_at(s, block_for(s, from));
+		while (c.next())
+		{
+			if (c.term < from)
+				continue;
+			if (c.term.compare(0, prefix.length(), prefix))
+				break;
+			read_postings(s, c, matches[c.term]);
+		}
+	}
+
+	vector<CorpusMatch> CorpusIndex::find_prefix(CorpusTerm kind, string_view prefix) const
+	{
+		string key = term_key(kind, prefix);
+		map<string, vector<uint32_t>> matches;
+		for (auto& s : _segments)
+			scan(s, key, key, matches);
+
+		vector<CorpusMatch> r;
+		r.reserve(matches.size());
+		for (auto& m : matches)
+			r.push_back({ kind, m.first.substr(1), std::move(m.second) });
+		return r;
+	}
+
+	CorpusIndexWriter::CorpusIndexWriter(const string& index_path)
+		: _first_script(0)
+	{
+		if (!filesystem::exists(index_path))
+			return;
+		MappedFile file(index_path);
+		CorpusIndex index(file.data(), file.size());
+		_first_script = index.script_count();
+		for (uint32_t id = 0; id < _first_script; ++id)
+			_ids.emplace(string(index.script_name(id)), id);
+	}
+
+	uint32_t CorpusIndexWriter::add(const Script& script, string_view name)
+	{
+		auto known = _ids.lower_bound(name);
+		if (known != _ids.end() && known->first == name)
+			return known->second;
+		uint32_t id = _first_script + script_count();
+		_names.emplace_back(name);
+		_ids.emplace_hint(known, string(name), id);
+		for (auto& c : script.characters)
+			add_term(CorpusTerm::Character, c, id);
+		for (auto& set : script.sets)
+		{
+			add_term(CorpusTerm::Set, set, id);
+			add_term(CorpusTerm::Location, location_of(set), id);
+		}
+		return id;
+	}
+
+	void CorpusIndexWriter::add_term(CorpusTerm kind, string_view name, uint32_t id)
+	{
+		canonicalCharacter(name, _canonical);
+		if (_canonical.empty())
+			return;
+		string key(1, static_cast<char>(kind));
+		key += _canonical;
+		vector<uint32_t>& ids = _terms[key];
+		if (ids.empty() || ids.back() != id)
+			ids.push_back(id);
+	}
+
+	void CorpusIndexWriter::add(const CorpusIndex& index)
+	{
+		uint32_t base = _first_script + script_count();
+		for (uint32_t id = 0; id < index.script_count(); ++id)
+		{
+			_names.emplace_back(index.script_name(id));
+			_ids.emplace(_names.back(), base + id);
+		}
+
+		// terms are already canonical; segments are in id order, so each
+		// posting list stays ascending
+		map<string, vector<uint32_t>> all;
+		for (auto& s : index._segments)
+			index.scan(s, string(), string(), all);
+		for (auto& term : all)
+		{
+			vector<uint32_t>& ids = _terms[term.first];
+			for (uint32_t id : term.second)
+				ids.push_back(base + id);
+		}
+	}
+
+	void CorpusIndexWriter::write(OutputBuffer& out) const
+	{
+		vector<uint64_t> name_offsets = { 0 };
+		string names;
+		for (auto& n : _names)
+		{
+			names += n;
+			name_offsets.push_back(names.length());
+		}
+
+		vector<uint64_t> blocks;
+		string terms, postings;
+		const string* prev = nullptr;
+		uint32_t index = 0;
+		for (auto& t : _terms)
+		{
+			size_t shared = 0;
+			if (index % corpus_block_terms == 0)
+				blocks.push_back(terms.length());
+			else
+			{
+				size_t limit = min(prev->length(), t.first.length());
+				while (shared < limit && (*prev)[shared] == t.first[shared])
+					++shared;
+			}
+			write_varint(terms, shared);
+			write_varint(terms, t.first.length() - shared);
+			terms.append(t.first, shared, string::npos);
+			write_varint(terms, postings.length());
+			write_varint(terms, t.second.size());
+
+			uint32_t last = 0;
+			for (uint32_t id : t.second)
+			{
+				write_varint(postings, id - last);
+				last = id;
+			}
+			prev = &t.first;
+			++index;
+		}
+
+		struct Section
+		{
+			const void* data;
+			uint64_t size;
+		};
+		// order must match CorpusSection
+		const Section sections[] =
+		{
+			{ name_offsets.data(), name_offsets.size() * sizeof(uint64_t) },
+			{ names.data(), names.length() },
+			{ blocks.data(), blocks.size() * sizeof(uint64_t) },
+			{ terms.data(), terms.length() },
+			{ postings.data(), postings.length() },
+		};
+		static_assert(sizeof(sections) / sizeof(Section) == static_cast<size_t>(CorpusSection::Count),
+			"a section is missing from the writer");
+
+		CorpusIndexHeader header = {};
+		memcpy(header.magic, corpus_magic, sizeof(corpus_magic));
+		header.version = CorpusIndexVersion;
+		header.first_script = _first_script;
+		header.script_count = script_count();
+		header.term_count = static_cast<uint32_t>(_terms.size());
+		header.block_count = static_cast<uint32_t>(blocks.size());
+
+		uint64_t offset = align8(sizeof(CorpusIndexHeader));
+		for (size_t i = 0; i < static_cast<size_t>(CorpusSection::Count); ++i)
+		{
+			header.section_offset[i] = offset;
+			header.section_size[i] = sections[i].size;
+			offset = align8(offset + sections[i].size);
+		}
+		header.segment_size = offset;
+
+		static const char padding[8] = {};
+		out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.append(padding, align8(sizeof(header)) - sizeof(header));
+		for (auto& s : sections)
+		{
+			out.append(static_cast<const char*>(s.data), s.size);
+			out.append(padding, align8(s.size) - s.size);
+		}
+	}
+
+	uint32_t corpusIndexScriptCount(const string& path)
+	{
+		if (!filesystem::exists(path))
+			return 0;
+		MappedFile file(path);
+		return CorpusIndex(file.data(), file.size()).script_count();
+	}
+
+	void appendCorpusIndex(const string& path, const CorpusIndexWriter& writer, size_t max_segments)
+	{
+		uint64_t valid_size = 0;
+		size_t segments = 0;
+		if (filesystem::exists(path))
+		{
+			MappedFile file(path);
+			CorpusIndex index(file.data(), file.size());
+			if (index.script_count() != writer.first_script())
+				throw std::runtime_error(path + " holds " + to_string(index.script_count())
+					+ " scripts, but the new ones are numbered from " + to_string(writer.first_script()));
+			valid_size = index.valid_size();
+			segments = index.segment_count();
+		}
+		else if (writer.first_script())
+			throw std::runtime_error(path + " does not exist, but the new scripts are numbered from " + to_string(writer.first_script()));
+
+		int fd = open_append_fd(path, valid_size);
+		{
+			OutputBuffer out(fd);
+			writer.write(out);
+			out.flush();
+		}
+		close_output_fd(fd);
+
+		if (segments + 1 <= max_segments)
+			return;
+
+		string merged_path = path + ".merge";
+		{
+			MappedFile file(path);
+			CorpusIndex index(file.data(), file.size());
+			CorpusIndexWriter merged;
+			merged.add(index);
+			int out_fd = open_output_fd(merged_path);
+			OutputBuffer out(out_fd);
+			merged.write(out);
+			out.flush();
+			close_output_fd(out_fd);
+		}
+		filesystem::rename(merged_path, path);
+	}
+
+} // lab
@@ -0,0 +1,179 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+	class OutputBuffer;
+
+	// An index of which scripts in a corpus have which characters, sets,
+	// and locations, to be memory mapped and searched in place.
+	//
+	// The file is a run of segments, each a CorpusIndexHeader followed by
+	// its sections, each section on an 8 byte boundary. Values are little
+	// endian, and only a little endian host builds this. Scripts are
+	// numbered across the whole file, a segment's from its first_script
+	// on, so an index grows by appending a segment for new scripts;
+	// nothing already written changes, and a reader with the file mapped
+	// is unaffected. A segment cut short, as by a crash while
+	// it was appended, is ignored, and the next append replaces it.
+	//
+	// A segment's terms are sorted by their bytes: a CorpusTerm, then the
+	// name in canonical form, as canonicalCharacter gives it. They are
+	// front coded in blocks of corpus_block_terms: the first term of a
+	// block is written whole, and each after it as the length of the
+	// prefix it shares with the one before, then the rest. Each term is
+	// written as varints
+	//
+	//   shared, suffix length, suffix bytes, posting offset, posting count
+	//
+	// and its posting list is the ids of its scripts, ascending, as varint
+	// deltas from the one before, the first from zero. A lookup binary
+	// searches the blocks by their first terms, then decodes one block.
+
+	enum class CorpusTerm : uint8_t
+	{
+		Character = 'c',	// as Script::characters names them
+		Location = 'l',		// a set without INT. or EXT. and the time of day, as DINER
+		Set = 's',			// as Script::sets names them, as INT. DINER - NIGHT
+	};
+
+	enum class CorpusSection : uint32_t
+	{
+		ScriptOffsets,		// uint64 [script_count + 1], into ScriptNames
+		ScriptNames,		// char
+		BlockOffsets,		// uint64 [block_count], into Terms
+		Terms,				// front coded blocks
+		Postings,			// varint deltas
+		Count
+	};
+
+	const uint32_t CorpusIndexVersion = 1;
+	const uint32_t corpus_block_terms = 16;
+
+	struct CorpusIndexHeader
+	{
+		char magic[8];		// "LabSidx\0"
+		uint32_t version;
+		uint32_t first_script;
+		uint32_t script_count;
+		uint32_t term_count;
+		uint32_t block_count;
+		uint32_t reserved;
+		uint64_t segment_size;	// to the next segment, padding included
+		uint64_t section_offset[static_cast<size_t>(CorpusSection::Count)];	// from the segment's start
+		uint64_t section_size[static_cast<size_t>(CorpusSection::Count)];
+	};
+
+	// The ids of the scripts with a term, ascending, and the term as
+	// written in the index.
+	struct CorpusMatch
+	{
+		CorpusTerm kind;
+		std::string name;
+		std::vector<uint32_t> scripts;
+	};
+
+	// A validated view over an index already in memory, typically a
+	// MappedFile. Opening checks each segment's header and nothing more, so
+	// the first lookup is as quick as any other.
+	class CorpusIndex
+	{
+	public:
+		CorpusIndex(const char* data, size_t size);
+
+		uint32_t script_count() const { return _script_count; }
+		size_t segment_count() const { return _segments.size(); }
+		// the bytes of whole segments; anything after is a cut off append
+		uint64_t valid_size() const { return _valid_size; }
+
+		// the name the script was added with
+		std::string_view script_name(uint32_t id) const;
+
+		// the scripts with a term; name is put in canonical form first
+		std::vector<uint32_t> find(CorpusTerm kind, std::string_view name) const;
+
+		// every term of a kind beginning with prefix, in order
+		std::vector<CorpusMatch> find_prefix(CorpusTerm kind, std::string_view prefix) const;
+
+	private:
+		friend class CorpusIndexWriter;
+
+		struct Segment
+		{
+			const CorpusIndexHeader* header;
+			const char* base;
+
+			template <typename T>
+			const T* section(CorpusSection s) const
+			{
+				return reinterpret_cast<const T*>(base + header->section_offset[static_cast<size_t>(s)]);
+			}
+		};
+
+		void scan(const Segment& segment, const std::string& from, const std::string& prefix,
+			std::map<std::string, std::vector<uint32_t>>& matches) const;
+
+		std::vector<Segment> _segments;
+		uint32_t _script_count = 0;
+		uint64_t _valid_size = 0;
+	};
+
+	// Accumulates the terms of scripts, then writes them as one segment.
+	// The scripts need not outlive add.
+	class CorpusIndexWriter
+	{
+	public:
+		// the id of the first script, which is the number of scripts
+		// already in the index the segment will be appended to
+		explicit CorpusIndexWriter(uint32_t first_script = 0) : _first_script(first_script) {}
+
+		// for the index at index_path, if it exists: numbered on from the
+		// scripts it has, and knowing their names
+		explicit CorpusIndexWriter(const std::string& index_path);
+
+		// Returns the script's id. A name already indexed, by this writer
+		// or in the index it appends to, keeps the id it has and its terms;
+		// the script is not added again.
+		uint32_t add(const Script& script, std::string_view name);
+
+		// every script of an index numbered from this writer's first
+		// script, so that a writer starting at 0 rewrites the whole index
+		// as one segment
+		void add(const CorpusIndex& index);
+
+		uint32_t first_script() const { return _first_script; }
+		uint32_t script_count() const { return static_cast<uint32_t>(_names.size()); }
+
+		void write(OutputBuffer& out) const;
+
+	private:
+		void add_term(CorpusTerm kind, std::string_view name, uint32_t id);
+
+		uint32_t _first_script;
+		std::vector<std::string> _names;
+		std::map<std::string, uint32_t, std::less<>> _ids;		// by name, those already indexed included
+		std::map<std::string, std::vector<uint32_t>> _terms;	// by kind and canonical name
+		std::string _canonical;
+	};
+
+	// the number of scripts in the index at path, 0 if it doesn't exist
+	uint32_t corpusIndexScriptCount(const std::string& path);
+
+	// Appends writer's scripts to the index at path as a segment, making
+	// the file if need be; the writer must start where the index ends. A
+	// file of more than max_segments segments is then merged into one,
+	// written beside it and renamed over it.
+	void appendCorpusIndex(const std::string& path, const CorpusIndexWriter& writer, size_t max_segments = 8);
+
+} // lab
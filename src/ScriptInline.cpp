@@ -0,0 +1,209 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptInline.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LAB_INLINE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define LAB_INLINE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		inline bool is_delimiter(char c)
+		{
+			return c == '*' || c == '_' || c == '\\' || c == '\n';
+		}
+
+		inline unsigned lowest_bit(unsigned mask)
+		{
+#if defined(_MSC_VER)
+			unsigned long i;
+			_BitScanForward(&i, mask);
+			return static_cast<unsigned>(i);
+#else
+			return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+		}
+
+		enum TokenKind : uint8_t { Star1, Star2, Star3, Underline, Escape };
+		const size_t matched_kinds = 4;
+		const uint8_t kind_style[matched_kinds] =
+		{
+			InlineItalic, InlineBold, InlineItalic | InlineBold, InlineUnderline
+		};
+
+		struct Token
+		{
+			size_t pos;
+			uint8_t length;
+			uint8_t kind;
+			bool markup;
+		};
+
+		void add_span(pmr::vector<InlineSpan>& spans, size_t begin, size_t end, uint8_t style)
+		{
+			if (end == begin)
+				return;
+			if (spans.size())
+			{
+				InlineSpan& last = spans.back();
+				if (last.style == style && last.offset + last.length == begin)
+				{
+					last.length += static_cast<uint32_t>(end - begin);
+					return;
+				}
+			}
+			spans.push_back({ static_cast<uint32_t>(begin), static_cast<uint32_t>(end - begin), style });
+		}
+	}
+
+	size_t find_inline_delimiter(const char* begin, const char* end)
+	{
+		const char* p = begin;
+#if defined(LAB_INLINE_SSE2)
+		const __m128i star = _mm_set1_epi8('*');
+		const __m128i under = _mm_set1_epi8('_');
+		const __m128i slash = _mm_set1_epi8('\\');
+		const __m128i newline = _mm_set1_epi8('\n');
+		while (end - p >= 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(v, under)),
+			                         _mm_or_si128(_mm_cmpeq_epi8(v, slash), _mm_cmpeq_epi8(v, newline)));
+			unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+			if (mask)
+				return static_cast<size_t>(p - begin) + lowest_bit(mask);
+			p += 16;
+		}
+#elif defined(LAB_INLINE_NEON)
+		const uint8x16_t star = vdupq_n_u8('*');
+		const uint8x16_t under = vdupq_n_u8('_');
+		const uint8x16_t slash = vdupq_n_u8('\\');
+		const uint8x16_t newline = vdupq_n_u8('\n');
+		while (end - p >= 16)
+		{
+			uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+			uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, star), vceqq_u8(v, under)),
+			                        vorrq_u8(vceqq_u8(v, slash), vceqq_u8(v, newline)));
+			if (vmaxvq_u8(m))
+				break;	// the scalar loop finds it within these 16 bytes
+			p += 16;
+		}
+#endif
+		while (p < end && !is_delimiter(*p))
+			++p;
+		return static_cast<size_t>(p - begin);
+	}
+
+	void tokenizeInline(string_view text, pmr::vector<InlineSpan>& spans)
+	{
+		spans.clear();
+		const char* base = text.data();
+		size_t n = text.length();
+
+		// most content has no markup at all
+		if (find_inline_delimiter(base, base + n) == n)
+		{
+			add_span(spans, 0, n, 0);
+			return;
+		}
+
+		vector<Token> tokens;
+		size_t line_begin = 0;
+		for (;;)
+		{
+			// collect the delimiters of one line
+			tokens.clear();
+			size_t remaining[matched_kinds] = {};
+			size_t line_end = n;
+			size_t pos = line_begin;
+			while (pos < n)
+			{
+				size_t d = pos + find_inline_delimiter(base + pos, base + n);
+				if (d == n || base[d] == '\n')
+				{
+					line_end = d;
+					break;
+				}
+
+				char c = base[d];
+				if (c == '\\')
+				{
+					// only markup characters are escaped; C:\path keeps its backslash
+					bool escapes = d + 1 < n && (base[d + 1] == '*' || base[d + 1] == '_' || base[d + 1] == '\\');
+					tokens.push_back({ d, 1, Escape, escapes });
+					pos = escapes ? d + 2 : d + 1;
+				}
+				else if (c == '_')
+				{
+					tokens.push_back({ d, 1, Underline, false });
+					++remaining[Underline];
+					pos = d + 1;
+				}
+				else
+				{
+					size_t e = d;
+					while (e < n && base[e] == '*')
+						++e;
+					// a longer run of stars is never emphasis
+					if (e - d <= 3)
+					{
+						uint8_t kind = static_cast<uint8_t>(Star1 + (e - d - 1));
+						tokens.push_back({ d, static_cast<uint8_t>(e - d), kind, false });
+						++remaining[kind];
+					}
+					pos = e;
+				}
+			}
+
+			// a delimiter opens only if a partner follows it on the line, so
+			// everything opened is closed by the end of the line
+			bool open[matched_kinds] = {};
+			for (auto& t : tokens)
+			{
+				if (t.kind == Escape)
+					continue;
+				--remaining[t.kind];
+				if (open[t.kind] || remaining[t.kind])
+				{
+					open[t.kind] = !open[t.kind];
+					t.markup = true;
+				}
+			}
+
+			uint8_t style = 0;
+			size_t run = line_begin;
+			for (auto& t : tokens)
+			{
+				if (!t.markup)
+					continue;
+				add_span(spans, run, t.pos, style);
+				run = t.pos + t.length;
+				if (t.kind != Escape)
+					style ^= kind_style[t.kind];
+			}
+
+			// the line break belongs to the last run of the line
+			if (line_end == n)
+			{
+				add_span(spans, run, n, style);
+				break;
+			}
+			add_span(spans, run, line_end + 1, style);
+			line_begin = line_end + 1;
+		}
+	}
+
+} // lab
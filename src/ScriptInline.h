@@ -0,0 +1,42 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+	// Fountain's inline emphasis: *italic*, **bold**, ***bold italic***, and
+	// _underline_. Emphasis does not cross a line break, a delimiter with no
+	// partner later on its line is literal, and a backslash makes the
+	// character after it literal.
+
+	enum InlineStyle : uint8_t
+	{
+		InlineItalic = 1,
+		InlineBold = 2,
+		InlineUnderline = 4,
+	};
+
+	// a run of text with one style, as a byte range of the node's content;
+	// the runs of a node cover its content minus markup and escapes, in order
+	struct InlineSpan
+	{
+		uint32_t offset;
+		uint32_t length;
+		uint8_t style;		// InlineStyle bits
+	};
+
+	// Offset of the first '*', '_', '\\', or '\n' in [begin, end), or
+	// end - begin if there is none. Scans 16 bytes at a time.
+	size_t find_inline_delimiter(const char* begin, const char* end);
+
+	// replaces spans with the styled runs of text
+	void tokenizeInline(std::string_view text, std::pmr::vector<InlineSpan>& spans);
+
+} // lab
@@ -0,0 +1,320 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptJson.h"
+#include "FileIO.h"
+#include "Utf8.h"
+
+#include <cstdint>
+
+namespace lab
+{
+	using namespace std;
+
+	const char* NodeKindName(NodeKind kind)
+	{
+		switch (kind)
+		{
+		case NodeKind::KeyValue: return "KeyValue";
+		case NodeKind::Divider: return "Divider";
+		case NodeKind::Character: return "Character";
+		case NodeKind::Action: return "Action";
+		case NodeKind::Location: return "Location";
+		case NodeKind::Dialog: return "Dialog";
+		case NodeKind::Direction: return "Direction";
+		case NodeKind::Transition: return "Transition";
+		case NodeKind::Parenthetical: return "Parenthetical";
+		case NodeKind::DualDialog: return "DualDialog";
+		case NodeKind::Centered: return "Centered";
+		case NodeKind::Lyric: return "Lyric";
+		case NodeKind::Section: return "Section";
+		case NodeKind::Synopsis: return "Synopsis";
+		case NodeKind::Note: return "Note";
+		case NodeKind::Boneyard: return "Boneyard";
+		case NodeKind::Unknown: break;
+		}
+		return "Unknown";
+	}
+
+	namespace
+	{
+		// 0 means the byte is copied verbatim, otherwise the character that
+		// follows the backslash. 'u' selects the \u00XX form.
+		struct EscapeTable
+		{
+			uint8_t esc[256];
+			EscapeTable()
+			{
+				for (int i = 0; i < 256; ++i)
+					esc[i] = i < 0x20 ? 'u' : 0;
+				esc['\b'] = 'b';
+				esc['\t'] = 't';
+				esc['\n'] = 'n';
+				esc['\f'] = 'f';
+				esc['\r'] = 'r';
+				esc['"'] = '"';
+				esc['\\'] = '\\';
+			}
+		};
+		const EscapeTable escape_table;
+
+		const uint64_t ones = 0x0101010101010101ull;
+		const uint64_t highs = 0x8080808080808080ull;
+
+		// true if any of the eight bytes in w needs escaping. Each test is
+		// exact for the question "is there at least one such byte".
+		inline bool word_needs_escape(uint64_t w)
+		{
+			uint64_t control = (w - ones * 0x20) & ~w;
+			uint64_t q = w ^ (ones * '"');
+			uint64_t quote = (q - ones) & ~q;
+			uint64_t b = w ^ (ones * '\\');
+			uint64_t backslash = (b - ones) & ~b;
+			return ((control | quote | backslash) & highs) != 0;
+		}
+
+		// appends s, valid UTF-8, with the bytes JSON can't hold escaped
+		void write_escaped(OutputBuffer& out, const char* s, size_t len)
+		{
+			static const char hex[] = "0123456789abcdef";
+			const char* end = s + len;
+			const char* run = s;
+			const char* p = s;
+			while (p < end)
+			{
+				// skip clean words eight bytes at a time; most script text
+				// contains nothing that needs escaping
+				while (end - p >= 8)
+				{
+					uint64_t w;
+					memcpy(&w, p, 8);
+					if (word_needs_escape(w))
+						break;
+					p += 8;
+				}
+
+				while (p < end && !escape_table.esc[static_cast<uint8_t>(*p)])
+					++p;
+
+				if (p == end)
+					break;
+
+				out.append(run, p - run);
+				uint8_t c = static_cast<uint8_t>(*p);
+				uint8_t e = escape_table.esc[c];
+				if (e == 'u')
+				{
+					char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+					out.append(u, 6);
+				}
+				else
+				{
+					char pair[2] = { '\\', static_cast<char>(e) };
+					out.append(pair, 2);
+				}
+				run = ++p;
+			}
+			out.append(run, end - run);
+		}
+
+		void write_key(OutputBuffer& out, const char* key)
+		{
+			out.append('"');
+			out.append(key);
+			out.append("\":", 2);
+		}
+
+		void write_bool(OutputBuffer& out, bool b)
+		{
+			if (b)
+				out.append("true", 4);
+			else
+				out.append("false", 5);
+		}
+
+		void write_node(OutputBuffer& out, const ScriptNode& node)
+		{
+			out.append("{\"kind\":\"", 9);
+			out.append(NodeKindName(node.kind));
+			out.append("\",\"key\":", 8);
+			writeJsonString(out, node.key);
+			if (node.extension.length())
+			{
+				out.append(",\"extension\":", 13);
+				writeJsonString(out, node.extension);
+			}
+			out.append(",\"content\":", 11);
+			writeJsonString(out, node.content);
+			out.append('}');
+		}
+
+		// everything up to the sequence's nodes
+		void write_sequence_head(OutputBuffer& out, const Sequence& seq, const SourceMap& source_map, size_t index)
+		{
+			out.append('{');
+			write_key(out, "name");
+			writeJsonString(out, seq.name);
+			out.append(',');
+			if (index < source_map.sequence_count())
+			{
+				write_key(out, "offset");
+				out.append(to_string(source_map.sequence_offset(index)));
+				out.append(',');
+			}
+			write_key(out, "location");
+			writeJsonString(out, seq.location);
+			out.append(',');
+			write_key(out, "scene_number");
+			writeJsonString(out, seq.scene_number);
+			out.append(',');
+			write_key(out, "interior");
+			write_bool(out, seq.interior);
+			out.append(',');
+			write_key(out, "exterior");
+			write_bool(out, seq.exterior);
+			out.append(',');
+			write_key(out, "nodes");
+			out.append('[');
+		}
+
+		template <typename Container>
+		void write_string_array(OutputBuffer& out, const Container& strings)
+		{
+			out.append('[');
+			bool first = true;
+			for (auto& s : strings)
+			{
+				if (!first)
+					out.append(',');
+				first = false;
+				writeJsonString(out, s);
+			}
+			out.append(']');
+		}
+
+		template <typename Map>
+		void write_string_array_map(OutputBuffer& out, const Map& map)
+		{
+			out.append('{');
+			bool first = true;
+			for (auto& i : map)
+			{
+				if (!first)
+					out.append(',');
+				first = false;
+				writeJsonString(out, i.first);
+				out.append(':');
+				write_string_array(out, i.second);
+			}
+			out.append('}');
+		}
+	}
+
+	void writeJsonString(OutputBuffer& out, const char* s, size_t len)
+	{
+		// JSON text must be UTF-8; each byte of an ill formed sequence
+		// becomes U+FFFD
+		out.append('"');
+		for (;;)
+		{
+			size_t valid = utf8_find_invalid(s, len);
+			write_escaped(out, s, valid);
+			if (valid == len)
+				break;
+			out.append("\xEF\xBF\xBD", 3);
+			s += valid + 1;
+			len -= valid + 1;
+		}
+		out.append('"');
+	}
+
+	void JsonWriter::begin(const Script& script)
+	{
+		_script = &script;
+		_in_title = true;
+		_in_sequence = false;
+		_first_node = true;
+		_out.append('{');
+		write_key(_out, "title");
+		_out.append('[');
+	}
+
+	void JsonWriter::end_title()
+	{
+		_out.append("],", 2);
+		write_key(_out, "characters");
+		write_string_array(_out, _script->characters);
+		_out.append(',');
+		write_key(_out, "sets");
+		write_string_array(_out, _script->sets);
+		_out.append(',');
+		write_key(_out, "sequences");
+		_out.append('[');
+		_in_title = false;
+	}
+
+	void JsonWriter::sequence(const Sequence& seq, size_t index)
+	{
+		if (_in_title)
+			end_title();
+		else if (_in_sequence)
+			_out.append("]},", 3);
+		write_sequence_head(_out, seq, _script->source_map, index);
+		_in_sequence = true;
+		_first_node = true;
+	}
+
+	void JsonWriter::node(const ScriptNode& node)
+	{
+		if (!_first_node)
+			_out.append(',');
+		_first_node = false;
+		write_node(_out, node);
+	}
+
+	void JsonWriter::end(const ScriptMeta* meta)
+	{
+		if (_in_title)
+			end_title();
+		else if (_in_sequence)
+			_out.append("]}", 2);
+		_out.append(']');
+
+		if (meta)
+		{
+			_out.append(',');
+			write_key(_out, "meta");
+			_out.append('{');
+			write_key(_out, "sequence_characters");
+			write_string_array_map(_out, meta->sequence_characters);
+			_out.append(',');
+			write_key(_out, "character_dialog");
+			write_string_array_map(_out, meta->character_dialog);
+			_out.append('}');
+		}
+		_out.append("}\n", 2);
+	}
+
+	void writeJson(OutputBuffer& out, const Script& script, const ScriptMeta* meta)
+	{
+		JsonWriter writer(out);
+		writer.begin(script);
+		for (auto& n : script.title.nodes)
+			writer.node(n);
+		for (size_t i = 0; i < script.sequences.size(); ++i)
+		{
+			writer.sequence(script.sequences[i], i);
+			for (auto& n : script.sequences[i].nodes)
+				writer.node(n);
+		}
+		writer.end(meta);
+	}
+
+	void writeJson(int fd, const Script& script, const ScriptMeta* meta)
+	{
+		OutputBuffer out(fd);
+		writeJson(out, script, meta);
+		out.flush();
+	}
+
+} // lab
@@ -0,0 +1,50 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+namespace lab
+{
+	class OutputBuffer;
+
+	const char* NodeKindName(NodeKind kind);
+
+	// Streams script, and meta if supplied, as a single line JSON object.
+	// No document is built in memory; strings are escaped directly into
+	// the output buffer. Because the object never contains a raw newline,
+	// successive calls on the same buffer produce JSON Lines, one script
+	// per line, which is how the batch mode writes a corpus.
+	void writeJson(OutputBuffer& out, const Script& script, const ScriptMeta* meta = nullptr);
+	void writeJson(int fd, const Script& script, const ScriptMeta* meta = nullptr);
+
+	// writeJson a piece at a time, for a walk that visits each node once:
+	// begin, the title page's nodes, then each sequence followed by its
+	// nodes, then end. meta need only be complete by the end.
+	class JsonWriter
+	{
+	public:
+		explicit JsonWriter(OutputBuffer& out) : _out(out) {}
+
+		void begin(const Script& script);
+		void sequence(const Sequence& seq, size_t index);	// index into Script::sequences
+		void node(const ScriptNode& node);
+		void end(const ScriptMeta* meta = nullptr);
+
+	private:
+		void end_title();
+
+		OutputBuffer& _out;
+		const Script* _script = nullptr;
+		bool _in_title = false;
+		bool _in_sequence = false;
+		bool _first_node = true;
+	};
+
+	// appends s as a quoted JSON string, with U+FFFD in place of each byte
+	// that is not part of well formed UTF-8
+	void writeJsonString(OutputBuffer& out, const char* s, size_t len);
+	inline void writeJsonString(OutputBuffer& out, std::string_view s) { writeJsonString(out, s.data(), s.length()); }
+
+} // lab
@@ -0,0 +1,240 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptReport.h"
+#include "FileIO.h"
+#include "ScriptSchedule.h"
+#include "ScriptStats.h"
+#include "ScriptUtil.h"
+
+#include <algorithm>
+#include <string>
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		const char* rule = "----------------------------------------------------\n";
+
+		void append_count(OutputBuffer& out, const char* label, size_t count)
+		{
+			out.append(label);
+			out.append(to_string(count));
+			out.append('\n');
+		}
+	}
+
+	void writeSummary(OutputBuffer& out, const Script& script, const ScriptMeta& meta)
+	{
+		out.append("\nSummary:\n");
+		out.append(rule);
+		append_count(out, "Location count: ", script.sets.size());
+		append_count(out, "Character count: ", script.characters.size());
+		append_count(out, "Sequence count:", script.sequences.size());
+
+		out.append("\nLocations:\n");
+		out.append(rule);
+		for (auto& l : script.sets)
+		{
+			out.append(l);
+			out.append('\n');
+		}
+
+		out.append("\nSequences:\n");
+		out.append(rule);
+		for (auto& sc : meta.sequence_characters)
+		{
+			int idx = script.sequence_index.at(sc.first);
+			out.append("Sequence: ");
+			out.append(sc.first);
+			out.append(" - ");
+			out.append(script.sequences[idx].location);
+			out.append('\n');
+			for (auto& c : sc.second)
+			{
+				out.append("   ");
+				out.append(c);
+				out.append('\n');
+			}
+		}
+		out.append('\n');
+
+		out.append("\nCharacters:\n");
+		out.append(rule);
+		for (auto& cd : meta.character_dialog)
+		{
+			out.append("Character: ");
+			out.append(cd.first);
+			out.append(", line count: ");
+			out.append(to_string(cd.second.size()));
+			out.append('\n');
+		}
+		out.append('\n');
+	}
+
+	void walkScript(const Script& script, const vector<ScriptReport*>& reports)
+	{
+		for (auto r : reports)
+			r->begin(script);
+		for (auto r : reports)
+			r->sequence(script.title, ScriptReport::title_page);
+		for (auto& n : script.title.nodes)
+			for (auto r : reports)
+				r->node(n);
+		for (size_t i = 0; i < script.sequences.size(); ++i)
+		{
+			const Sequence& seq = script.sequences[i];
+			for (auto r : reports)
+				r->sequence(seq, i);
+			for (auto& n : seq.nodes)
+				for (auto r : reports)
+					r->node(n);
+		}
+		for (auto r : reports)
+			r->end(script);
+	}
+
+	void MetaReport::sequence(const Sequence& seq, size_t index)
+	{
+		_title_page = index == title_page;
+		if (!_title_page)
+			meta.add_sequence(seq);
+	}
+
+	void MetaReport::node(const ScriptNode& node)
+	{
+		if (!_title_page)
+			meta.add_node(node);
+	}
+
+	void JsonReport::sequence(const Sequence& seq, size_t index)
+	{
+		// the title page's nodes follow begin directly
+		if (index != title_page)
+			_writer.sequence(seq, index);
+	}
+
+	void FountainReport::sequence(const Sequence& seq, size_t /*index*/)
+	{
+		_text.clear();
+		_writer.sequence(seq, _text);
+		_out.append(_text);
+	}
+
+	void FountainReport::node(const ScriptNode& node)
+	{
+		_text.clear();
+		_writer.node(node, _text);
+		_out.append(_text);
+	}
+
+	void StatsReport::sequence(const Sequence& /*seq*/, size_t index)
+	{
+		if (!_title_page && _lines)
+			_eighths += eighths_for_lines(_lines);
+		_title_page = index == title_page;
+		_lines = _title_page ? 0 : 2;
+	}
+
+	void StatsReport::node(const ScriptNode& node)
+	{
+		++_kinds[static_cast<size_t>(node.kind)];
+		if (_title_page || node.kind == NodeKind::Note || node.kind == NodeKind::Boneyard)
+			return;
+		_lines += node_page_lines(node);
+
+		size_t words = countText(node.content).words;
+		_words += words;
+		if (isDialogKind(node.kind))
+		{
+			_dialog_words += words;
+			if (node.content.length())
+				++_dialog_lines;
+		}
+		else if (node.kind == NodeKind::Action)
+			_action_words += words;
+	}
+
+	void StatsReport::end(const Script& script)
+	{
+		if (!_title_page && _lines)
+			_eighths += eighths_for_lines(_lines);
+
+		append_count(_out, "Sequences: ", script.sequences.size());
+		append_count(_out, "Characters: ", script.characters.size());
+		append_count(_out, "Locations: ", script.sets.size());
+		_out.append("Pages: ");
+		_out.append(pages_string(_eighths));
+		_out.append('\n');
+		append_count(_out, "Words: ", _words);
+		append_count(_out, "Dialog words: ", _dialog_words);
+		append_count(_out, "Action words: ", _action_words);
+		append_count(_out, "Dialog lines: ", _dialog_lines);
+
+		_out.append("\nNodes:\n");
+		for (size_t k = 0; k <= static_cast<size_t>(NodeKind::Unknown); ++k)
+		{
+			if (!_kinds[k])
+				continue;
+			_out.append(NodeKindName(static_cast<NodeKind>(k)));
+			_out.append(": ");
+			_out.append(to_string(_kinds[k]));
+			_out.append('\n');
+		}
+	}
+
+	void BreakdownReport::begin(const Script& script)
+	{
+		_script = &script;
+		_out.append("sequence\tscene\tint_ext\tlocation\teighths\tcast\n");
+	}
+
+	void BreakdownReport::sequence(const Sequence& seq, size_t index)
+	{
+		finish_row();
+		_sequence = index == title_page ? nullptr : &seq;
+		_lines = 2;
+		_cast.clear();
+	}
+
+	void BreakdownReport::node(const ScriptNode& node)
+	{
+		if (!_sequence)
+			return;
+		_lines += node_page_lines(node);
+		// in order of first appearance
+		if (!isDialogKind(node.kind))
+			return;
+		string_view name(_script->character_name(node));
+		if (find(_cast.begin(), _cast.end(), name) == _cast.end())
+			_cast.emplace_back(name);
+	}
+
+	void BreakdownReport::finish_row()
+	{
+		if (!_sequence)
+			return;
+		const Sequence& seq = *_sequence;
+		append_field(_out, seq.name);
+		_out.append('\t');
+		append_field(_out, seq.scene_number);
+		_out.append('\t');
+		_out.append(seq.interior && seq.exterior ? "INT/EXT" : seq.interior ? "INT" : seq.exterior ? "EXT" : "");
+		_out.append('\t');
+		append_field(_out, seq.location);
+		_out.append('\t');
+		_out.append(to_string(eighths_for_lines(_lines)));
+		_out.append('\t');
+		for (size_t i = 0; i < _cast.size(); ++i)
+		{
+			if (i)
+				_out.append(", ");
+			append_field(_out, _cast[i]);
+		}
+		_out.append('\n');
+		_sequence = nullptr;
+	}
+
+} // lab
@@ -0,0 +1,145 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+#include "ScriptJson.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace lab
+{
+	class OutputBuffer;
+
+	// The plain text summary the command line prints: counts, then the
+	// locations, the characters in each sequence, and each character's
+	// line count.
+	void writeSummary(OutputBuffer& out, const Script& script, const ScriptMeta& meta);
+
+	// One of the reports fed by a walk over a script. walkScript visits the
+	// title page and then each sequence, and each node once, handing every
+	// piece to each report in turn, so any number of reports cost a single
+	// pass.
+	class ScriptReport
+	{
+	public:
+		static const size_t title_page = ~size_t(0);
+
+		virtual ~ScriptReport() {}
+
+		virtual void begin(const Script& /*script*/) {}
+		// index into Script::sequences, or title_page
+		virtual void sequence(const Sequence& /*seq*/, size_t /*index*/) {}
+		virtual void node(const ScriptNode& /*node*/) {}
+		virtual void end(const Script& /*script*/) {}
+	};
+
+	void walkScript(const Script& script, const std::vector<ScriptReport*>& reports);
+
+	// Builds the ScriptMeta that other reports read. Those reports must
+	// follow it in the walk, and use the meta only once the walk ends.
+	class MetaReport : public ScriptReport
+	{
+	public:
+		ScriptMeta meta;
+
+		void begin(const Script& script) override { meta.begin(script); }
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override;
+
+	private:
+		bool _title_page = false;
+	};
+
+	class SummaryReport : public ScriptReport
+	{
+	public:
+		SummaryReport(OutputBuffer& out, const ScriptMeta& meta) : _out(out), _meta(meta) {}
+		void end(const Script& script) override { writeSummary(_out, script, _meta); }
+
+	private:
+		OutputBuffer& _out;
+		const ScriptMeta& _meta;
+	};
+
+	// writeJson's line
+	class JsonReport : public ScriptReport
+	{
+	public:
+		JsonReport(OutputBuffer& out, const ScriptMeta* meta) : _writer(out), _meta(meta) {}
+
+		void begin(const Script& script) override { _writer.begin(script); }
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override { _writer.node(node); }
+		void end(const Script& /*script*/) override { _writer.end(_meta); }
+
+	private:
+		JsonWriter _writer;
+		const ScriptMeta* _meta;
+	};
+
+	// the script emitted as Fountain, as Script::as_fountain writes it
+	class FountainReport : public ScriptReport
+	{
+	public:
+		explicit FountainReport(OutputBuffer& out) : _out(out) {}
+
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override;
+
+	private:
+		OutputBuffer& _out;
+		FountainWriter _writer;
+		std::string _text;
+	};
+
+	// Counts: sequences, characters, and locations; pages; words in all,
+	// in dialog, and in action; lines of dialog; and nodes of each kind.
+	class StatsReport : public ScriptReport
+	{
+	public:
+		explicit StatsReport(OutputBuffer& out) : _out(out) {}
+
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override;
+		void end(const Script& script) override;
+
+	private:
+		OutputBuffer& _out;
+		bool _title_page = false;
+		int _lines = 0;			// of the current sequence
+		int _eighths = 0;
+		size_t _words = 0;
+		size_t _dialog_words = 0;
+		size_t _action_words = 0;
+		size_t _dialog_lines = 0;
+		size_t _kinds[static_cast<size_t>(NodeKind::Unknown) + 1] = {};
+	};
+
+	// A breakdown sheet as tab separated values, a row per sequence: its
+	// name, scene number, interior or exterior, location, length in
+	// eighths of a page, and the characters who speak in it.
+	class BreakdownReport : public ScriptReport
+	{
+	public:
+		explicit BreakdownReport(OutputBuffer& out) : _out(out) {}
+
+		void begin(const Script& script) override;
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override;
+		void end(const Script& /*script*/) override { finish_row(); }
+
+	private:
+		void finish_row();
+
+		OutputBuffer& _out;
+		const Script* _script = nullptr;
+		const Sequence* _sequence = nullptr;
+		int _lines = 0;
+		std::vector<std::string> _cast;
+	};
+
+} // lab
@@ -0,0 +1,459 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptSchedule.h"
+#include "ScriptUtil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <thread>
+
+namespace lab
+{
+	using namespace std;
+
+	int node_page_lines(const ScriptNode& node)
+	{
+		// notes and the boneyard are not printed
+		if (node.kind == NodeKind::Note || node.kind == NodeKind::Boneyard)
+			return 0;
+		int lines = 2;
+		for (char c : node.content)
+			if (c == '\n')
+				++lines;
+		return lines;
+	}
+
+	int eighths_for_lines(int lines)
+	{
+		// a page is about 56 lines
+		const int lines_per_page = 56;
+		return max(1, (lines * 8 + lines_per_page - 1) / lines_per_page);
+	}
+
+	std::string pages_string(int eighths)
+	{
+		string r = to_string(eighths / 8);
+		if (eighths % 8)
+			r += " " + to_string(eighths % 8) + "/8";
+		return r;
+	}
+
+	int sequence_eighths(const Sequence& seq)
+	{
+		// the heading and the space after it take two lines, and each node
+		// is followed by a blank line
+		int lines = 2;
+		for (auto& n : seq.nodes)
+			lines += node_page_lines(n);
+		return eighths_for_lines(lines);
+	}
+
+	namespace
+	{
+		// splitmix64 to seed, xorshift64* to draw; both are specified down
+		// to the bit, unlike the standard distributions, so a seed gives the
+		// same schedule on every platform
+		inline uint64_t splitmix64(uint64_t& x)
+		{
+			uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			return z ^ (z >> 31);
+		}
+
+		struct Random
+		{
+			uint64_t state;
+			explicit Random(uint64_t seed) : state(splitmix64(seed) | 1) {}
+			uint64_t next()
+			{
+				state ^= state >> 12;
+				state ^= state << 25;
+				state ^= state >> 27;
+				return state * 0x2545f4914f6cdd1dull;
+			}
+			uint32_t below(uint32_t n) { return static_cast<uint32_t>(((next() >> 32) * n) >> 32); }
+			double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+		};
+
+		struct Problem
+		{
+			int count = 0;
+			int words = 0;
+			vector<int> set_id;
+			vector<int> eighths;
+			vector<uint64_t> cast;   // count * words bits
+			ScheduleOptions options;
+
+			Problem(const Script& script, const ScriptMeta& meta, const ScheduleOptions& opt)
+				: options(opt)
+			{
+				count = static_cast<int>(script.sequences.size());
+
+				map<std::pmr::string, int> character_id;
+				for (auto& c : script.characters)
+					character_id.emplace(c, static_cast<int>(character_id.size()));
+				words = max(1, static_cast<int>((character_id.size() + 63) / 64));
+				cast.assign(static_cast<size_t>(count) * words, 0);
+
+				map<string, int> sets;
+				for (int i = 0; i < count; ++i)
+				{
+					auto& seq = script.sequences[i];
+					auto s = sets.emplace(seq.as_string(), static_cast<int>(sets.size()));
+					set_id.push_back(s.first->second);
+					eighths.push_back(sequence_eighths(seq));
+
+					auto chars = meta.sequence_characters.find(seq.name);
+					if (chars == meta.sequence_characters.end())
+						continue;
+					for (auto& c : chars->second)
+					{
+						auto id = character_id.find(c);
+						if (id != character_id.end())
+							cast[static_cast<size_t>(i) * words + id->second / 64] |= uint64_t(1) << (id->second % 64);
+					}
+				}
+			}
+
+			// Shooting state before a sequence in the order. Days are packed
+			// greedily, so the state at a position depends only on the
+			// sequences before it.
+			struct State
+			{
+				int used = 0;
+				int prev_set = -1;
+				int moves = 0;
+				int cast_days = 0;
+				int day_count = 0;
+			};
+
+			void advance(State& st, uint64_t* day_cast, int idx) const
+			{
+				int e = eighths[idx];
+				if (st.used > 0 && st.used + e > options.max_eighths_per_day)
+					close_day(st, day_cast);
+				if (st.used == 0)
+					++st.day_count;
+				if (st.prev_set >= 0 && set_id[idx] != st.prev_set)
+					++st.moves;
+				st.prev_set = set_id[idx];
+
+				const uint64_t* c = &cast[static_cast<size_t>(idx) * words];
+				for (int w = 0; w < words; ++w)
+					day_cast[w] |= c[w];
+				st.used += e;
+			}
+
+			void close_day(State& st, uint64_t* day_cast) const
+			{
+				for (int w = 0; w < words; ++w)
+				{
+					st.cast_days += popcount64(day_cast[w]);
+					day_cast[w] = 0;
+				}
+				st.used = 0;
+			}
+
+			double cost(const State& st) const
+			{
+				return st.moves * options.location_move_cost
+					+ st.cast_days * options.cast_day_cost
+					+ st.day_count * options.day_cost;
+			}
+
+			// cost of shooting in order, with the days it packs into
+			State evaluate(const vector<int>& order, vector<ShootingDay>* days = nullptr) const
+			{
+				State st;
+				vector<uint64_t> day_cast(words);
+				for (int idx : order)
+				{
+					int day_count = st.day_count;
+					advance(st, day_cast.data(), idx);
+					if (days)
+					{
+						if (st.day_count != day_count)
+							days->emplace_back();
+						days->back().sequences.push_back(idx);
+						days->back().eighths += eighths[idx];
+					}
+				}
+				if (st.used > 0)
+					close_day(st, day_cast.data());
+				return st;
+			}
+		};
+
+		// Caches the state before every position of an order. A move that
+		// touches positions lo..hi only needs evaluating from lo, and once
+		// the packing past hi falls back into step with the cache, the rest
+		// of the order is known to cost what it did before.
+		class IncrementalCost
+		{
+		public:
+			IncrementalCost(const Problem& problem, const vector<int>& order)
+				: _problem(problem)
+				, _words(problem.words)
+				, _states(order.size() + 1)
+				, _casts((order.size() + 1) * problem.words)
+				, _scratch(problem.words)
+			{
+				commit(order, 0, order.size());
+			}
+
+			double cost() const { return _problem.cost(_final); }
+
+			double trial(const vector<int>& order, size_t lo, size_t hi)
+			{
+				Problem::State st = _states[lo];
+				uint64_t* day_cast = _scratch.data();
+				memcpy(day_cast, cast_at(lo), _words * sizeof(uint64_t));
+
+				size_t n = order.size();
+				for (size_t k = lo; k < n; ++k)
+				{
+					if (k > hi && in_step(st, day_cast, k))
+					{
+						const Problem::State& at = _states[k];
+						st.moves += _final.moves - at.moves;
+						st.cast_days += _final.cast_days - at.cast_days;
+						st.day_count += _final.day_count - at.day_count;
+						return _problem.cost(st);
+					}
+					_problem.advance(st, day_cast, order[k]);
+				}
+				if (st.used > 0)
+					_problem.close_day(st, day_cast);
+				return _problem.cost(st);
+			}
+
+			// order changed between lo and hi; refresh the cache
+			void commit(const vector<int>& order, size_t lo, size_t hi)
+			{
+				Problem::State st = _states[lo];
+				uint64_t* day_cast = _scratch.data();
+				memcpy(day_cast, cast_at(lo), _words * sizeof(uint64_t));
+				size_t n = order.size();
+				for (size_t k = lo; k < n; ++k)
+				{
+					if (k > hi && in_step(st, day_cast, k))
+					{
+						// the rest of the cache is offset by a constant
+						const Problem::State at = _states[k];
+						for (size_t m = k; m <= n; ++m)
+						{
+							_states[m].moves += st.moves - at.moves;
+							_states[m].cast_days += st.cast_days - at.cast_days;
+							_states[m].day_count += st.day_count - at.day_count;
+						}
+						_final.moves += st.moves - at.moves;
+						_final.cast_days += st.cast_days - at.cast_days;
+						_final.day_count += st.day_count - at.day_count;
+						return;
+					}
+					_states[k] = st;
+					memcpy(cast_at(k), day_cast, _words * sizeof(uint64_t));
+					_problem.advance(st, day_cast, order[k]);
+				}
+				_states[n] = st;
+				memcpy(cast_at(n), day_cast, _words * sizeof(uint64_t));
+				if (st.used > 0)
+					_problem.close_day(st, day_cast);
+				_final = st;
+			}
+
+		private:
+			uint64_t* cast_at(size_t k) { return &_casts[k * _words]; }
+
+			bool in_step(const Problem::State& st, const uint64_t* day_cast, size_t k)
+			{
+				const Problem::State& at = _states[k];
+				return st.used == at.used && st.prev_set == at.prev_set
+					&& !memcmp(day_cast, cast_at(k), _words * sizeof(uint64_t));
+			}
+
+			const Problem& _problem;
+			size_t _words;
+			vector<Problem::State> _states;
+			vector<uint64_t> _casts;
+			vector<uint64_t> _scratch;
+			Problem::State _final;
+		};
+
+		struct ChainResult
+		{
+			vector<int> order;
+			double cost = 0;
+		};
+
+		ChainResult anneal(const Problem& problem, const vector<int>& start, uint64_t seed)
+		{
+			Random rng(seed);
+			vector<int> order = start;
+			IncrementalCost incremental(problem, order);
+			double cost = incremental.cost();
+
+			ChainResult best = { order, cost };
+			uint32_t n = static_cast<uint32_t>(order.size());
+			if (n < 2)
+				return best;
+
+			const double t0 = max(problem.options.location_move_cost, problem.options.cast_day_cost) * 2;
+			const double t1 = 0.01;
+			const uint32_t local_window = 24;
+			const int iterations = max(1, problem.options.iterations);
+			const double cooling = pow(t1 / t0, 1.0 / iterations);
+			double t = t0;
+
+			for (int it = 0; it < iterations; ++it, t *= cooling)
+			{
+				// mostly short range moves; they are cheap to evaluate and
+				// are the ones still accepted once the board has settled
+				uint32_t i = rng.below(n);
+				uint32_t j;
+				if (n > local_window * 2 && rng.below(8))
+				{
+					uint32_t lo = i > local_window ? i - local_window : 0;
+					uint32_t span = min(n, i + local_window + 1) - lo;
+					j = lo + rng.below(span - 1);
+					if (j >= i)
+						++j;
+				}
+				else
+				{
+					j = rng.below(n - 1);
+					if (j >= i)
+						++j;
+				}
+				uint32_t move = rng.below(3);
+
+				auto apply = [&](bool undo)
+				{
+					switch (move)
+					{
+					case 0:
+						swap(order[i], order[j]);
+						break;
+					case 1:
+						reverse(order.begin() + min(i, j), order.begin() + max(i, j) + 1);
+						break;
+					default:
+						// move the sequence at i to j, shifting the ones between
+						if ((i < j) != undo)
+							rotate(order.begin() + min(i, j), order.begin() + min(i, j) + 1, order.begin() + max(i, j) + 1);
+						else
+							rotate(order.begin() + min(i, j), order.begin() + max(i, j), order.begin() + max(i, j) + 1);
+						break;
+					}
+				};
+
+				size_t lo = min(i, j);
+				size_t hi = max(i, j);
+				apply(false);
+				double next = incremental.trial(order, lo, hi);
+				double delta = next - cost;
+				if (delta <= 0 || rng.unit() < exp(-delta / t))
+				{
+					incremental.commit(order, lo, hi);
+					cost = next;
+					if (cost < best.cost)
+					{
+						best.cost = cost;
+						best.order = order;
+					}
+				}
+				else
+					apply(true);
+			}
+			return best;
+		}
+	}
+
+	ShootingSchedule scheduleShoot(const Script& script, const ScriptMeta& meta, const ScheduleOptions& options)
+	{
+		Problem problem(script, meta, options);
+
+		// start from script order grouped by set, which already removes
+		// most of the moves
+		vector<int> start(problem.count);
+		for (int i = 0; i < problem.count; ++i)
+			start[i] = i;
+		stable_sort(start.begin(), start.end(), [&](int a, int b) { return problem.set_id[a] < problem.set_id[b]; });
+
+		int chains = max(1, options.chains);
+		vector<ChainResult> results(chains);
+		atomic<int> next_chain(0);
+		auto worker = [&]()
+		{
+			for (int c = next_chain++; c < chains; c = next_chain++)
+			{
+				uint64_t s = options.seed + static_cast<uint64_t>(c);
+				results[c] = anneal(problem, start, splitmix64(s));
+			}
+		};
+
+		int threads = options.threads > 0 ? options.threads : static_cast<int>(thread::hardware_concurrency());
+		threads = max(1, min(threads, chains));
+		vector<thread> pool;
+		for (int i = 1; i < threads; ++i)
+			pool.emplace_back(worker);
+		worker();
+		for (auto& t : pool)
+			t.join();
+
+		// lowest cost wins, ties go to the lowest chain, so the choice does
+		// not depend on which thread finished first
+		int best = 0;
+		for (int c = 1; c < chains; ++c)
+			if (results[c].cost < results[best].cost)
+				best = c;
+
+		ShootingSchedule schedule;
+		Problem::State st = problem.evaluate(results[best].order, &schedule.days);
+		schedule.location_moves = st.moves;
+		schedule.cast_days = st.cast_days;
+		schedule.cost = problem.cost(st);
+		return schedule;
+	}
+
+	std::string ShootingSchedule::as_string(const Script& script, const ScriptMeta& meta) const
+	{
+		string r;
+		int total = 0;
+		for (size_t d = 0; d < days.size(); ++d)
+		{
+			r += "Day " + to_string(d + 1) + " - " + pages_string(days[d].eighths) + " pages\n";
+			for (int idx : days[d].sequences)
+			{
+				auto& seq = script.sequences[idx];
+				r += "   ";
+				r += seq.name;
+				r += "  " + seq.as_string() + "  " + pages_string(sequence_eighths(seq));
+				auto chars = meta.sequence_characters.find(seq.name);
+				if (chars != meta.sequence_characters.end() && chars->second.size())
+				{
+					string cast;
+					for (auto& c : chars->second)
+					{
+						if (cast.length())
+							cast += ", ";
+						cast += c;
+					}
+					r += "  (" + cast + ")";
+				}
+				r += "\n";
+			}
+			total += days[d].eighths;
+		}
+		r += "Days: " + to_string(days.size()) + ", pages: " + pages_string(total)
+			+ ", location moves: " + to_string(location_moves)
+			+ ", cast days: " + to_string(cast_days) + "\n";
+		return r;
+	}
+
+} // lab
@@ -0,0 +1,63 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lab
+{
+	// Page lengths follow the stripboard convention of eighths of a page.
+	int sequence_eighths(const Sequence& seq);
+
+	// the printed lines a node takes, with the blank line after it; none
+	// for notes and the boneyard
+	int node_page_lines(const ScriptNode& node);
+	// a sequence's eighths from its lines, counting the heading's two
+	int eighths_for_lines(int lines);
+	// eighths as whole pages and a fraction, as in "2 3/8"
+	std::string pages_string(int eighths);
+
+	struct ScheduleOptions
+	{
+		int max_eighths_per_day = 5 * 8;
+		uint64_t seed = 1;
+
+		// Independent annealing chains. The result depends only on seed and
+		// chains, never on how many threads run them.
+		int chains = 16;
+		int threads = 0;            // 0 uses every hardware thread
+		int iterations = 200000;    // per chain
+
+		double location_move_cost = 4.0;
+		double cast_day_cost = 1.0;
+		double day_cost = 2.0;
+	};
+
+	struct ShootingDay
+	{
+		std::vector<int> sequences;  // indices into Script::sequences
+		int eighths = 0;
+	};
+
+	struct ShootingSchedule
+	{
+		std::vector<ShootingDay> days;
+		int location_moves = 0;
+		int cast_days = 0;
+		double cost = 0;
+
+		std::string as_string(const Script& script, const ScriptMeta& meta) const;
+	};
+
+	// Orders the sequences and breaks them into days so as to minimize
+	// location moves and the number of days each character must be on set.
+	// Days are packed in shooting order, never exceeding the page limit
+	// unless a single sequence is longer than a day.
+	ShootingSchedule scheduleShoot(const Script& script, const ScriptMeta& meta, const ScheduleOptions& options = ScheduleOptions());
+
+} // lab
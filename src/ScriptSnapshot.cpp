@@ -0,0 +1,260 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptSnapshot.h"
+#include <LabText/TextScanner.h>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		bool has_character(const ScriptNode& node)
+		{
+			return isDialogKind(node.kind) || node.kind == NodeKind::Parenthetical;
+		}
+
+		// the set name, as the parser gives it, and the ids of the speakers
+		void describe(const Sequence& seq, bool title_page, string& set, vector<uint32_t>& cast)
+		{
+			if (!title_page)
+				set = TextScanner::ToUpper(seq.as_string());
+			for (auto& n : seq.nodes)
+				if (isDialogKind(n.kind) && n.character != ScriptNode::no_character)
+					cast.push_back(n.character);
+			sort(cast.begin(), cast.end());
+			cast.erase(unique(cast.begin(), cast.end()), cast.end());
+		}
+
+		// the spans cache is filled while the sequence has one owner, so
+		// that concurrent readers only ever read it
+		void fill_spans(const Sequence& seq)
+		{
+			for (auto& n : seq.nodes)
+				n.spans();
+		}
+	}
+
+	shared_ptr<const ScriptSnapshot> ScriptSnapshot::make(Script&& script)
+	{
+		// chunks point into the script, and share ownership of it
+		shared_ptr<Script> owner = make_shared<Script>(std::move(script));
+
+		shared_ptr<Cast> cast = make_shared<Cast>();
+		cast->names.assign(owner->character_names.begin(), owner->character_names.end());
+		for (auto& id : owner->character_ids)
+			cast->ids.emplace(id.first, id.second);
+
+		auto chunk = [&](const Sequence& seq, bool title_page)
+		{
+			shared_ptr<Chunk> c = make_shared<Chunk>();
+			c->sequence = shared_ptr<const Sequence>(owner, &seq);
+			fill_spans(seq);
+			describe(seq, title_page, c->set, c->cast);
+			return c;
+		};
+
+		shared_ptr<ScriptSnapshot> snapshot(new ScriptSnapshot());
+		snapshot->_title = chunk(owner->title, true);
+		vector<shared_ptr<const Chunk>> chunks;
+		chunks.reserve(owner->sequences.size());
+		for (auto& seq : owner->sequences)
+			chunks.push_back(chunk(seq, false));
+		snapshot->set_chunks(chunks);
+		snapshot->_cast = cast;
+		return snapshot->finish_edit(snapshot, true);
+	}
+
+	vector<shared_ptr<const ScriptSnapshot::Chunk>> ScriptSnapshot::chunks() const
+	{
+		vector<shared_ptr<const Chunk>> r;
+		r.reserve(_count);
+		for (auto& leaf : _leaves)
+			r.insert(r.end(), leaf->begin(), leaf->end());
+		return r;
+	}
+
+	void ScriptSnapshot::set_chunks(const vector<shared_ptr<const Chunk>>& chunks)
+	{
+		_leaves.clear();
+		_count = chunks.size();
+		for (size_t b = 0; b < chunks.size(); b += leaf_size)
+			_leaves.push_back(make_shared<Leaf>(chunks.begin() + b, chunks.begin() + min(b + leaf_size, chunks.size())));
+	}
+
+	uint32_t ScriptSnapshot::character_id(string_view cue) const
+	{
+		string_view extension;
+		string canonical;
+		canonicalCharacter(splitCue(cue, extension), canonical);
+		auto i = _cast->ids.find(string_view(canonical));
+		return i == _cast->ids.end() ? ScriptNode::no_character : i->second;
+	}
+
+	shared_ptr<const ScriptSnapshot::Chunk> ScriptSnapshot::make_chunk(Sequence seq, bool title_page, shared_ptr<const Cast>& cast) const
+	{
+		shared_ptr<Sequence> owned = make_shared<Sequence>(std::move(seq), pmr::get_default_resource());
+
+		// a name not yet in the cast is added to a copy of it
+		shared_ptr<Cast> grown;
+		string canonical;
+		for (auto& n : owned->nodes)
+		{
+			if (!has_character(n))
+				continue;
+			canonicalCharacter(n.key, canonical);
+			if (canonical.empty())
+			{
+				n.character = ScriptNode::no_character;
+				continue;
+			}
+			auto i = cast->ids.find(string_view(canonical));
+			if (i != cast->ids.end())
+			{
+				n.character = i->second;
+				continue;
+			}
+			if (!grown)
+			{
+				grown = make_shared<Cast>(*cast);
+				cast = grown;
+			}
+			n.character = static_cast<uint32_t>(grown->names.size());
+			grown->ids.emplace(canonical, n.character);
+			grown->names.emplace_back(n.key.data(), n.key.length());
+		}
+
+		// an edit may have changed content without invalidating its spans
+		for (auto& n : owned->nodes)
+			n.invalidate_spans();
+		fill_spans(*owned);
+
+		shared_ptr<Chunk> c = make_shared<Chunk>();
+		describe(*owned, title_page, c->set, c->cast);
+		c->sequence = std::move(owned);
+		return c;
+	}
+
+	shared_ptr<const ScriptSnapshot> ScriptSnapshot::finish_edit(shared_ptr<ScriptSnapshot> next, bool rebuild_tables) const
+	{
+		if (!rebuild_tables)
+		{
+			next->_tables = _tables;
+			return next;
+		}
+
+		shared_ptr<Tables> tables = make_shared<Tables>();
+		for (uint32_t id : next->_title->cast)
+			tables->characters.insert(next->_cast->names[id]);
+		for (size_t i = 0; i < next->_count; ++i)
+		{
+			const Chunk& c = next->chunk(i);
+			tables->sets.insert(c.set);
+			for (uint32_t id : c.cast)
+				tables->characters.insert(next->_cast->names[id]);
+			tables->sequence_index[string(c.sequence->name)] = static_cast<int>(i);
+		}
+		next->_tables = tables;
+		return next;
+	}
+
+	shared_ptr<const ScriptSnapshot> ScriptSnapshot::with_title(Sequence title) const
+	{
+		shared_ptr<ScriptSnapshot> next(new ScriptSnapshot(*this));
+		next->_title = make_chunk(std::move(title), true, next->_cast);
+		return finish_edit(next, next->_title->cast != _title->cast);
+	}
+
+	shared_ptr<const ScriptSnapshot> ScriptSnapshot::with_sequence(size_t i, Sequence seq) const
+	{
+		if (i >= _count)
+			throw std::out_of_range("No such sequence");
+		shared_ptr<ScriptSnapshot> next(new ScriptSnapshot(*this));
+		const Chunk& old = chunk(i);
+		shared_ptr<const Chunk> c = make_chunk(std::move(seq), false, next->_cast);
+		bool changed = c->set != old.set || c->cast != old.cast || c->sequence->name != old.sequence->name;
+		shared_ptr<Leaf> leaf = make_shared<Leaf>(*_leaves[i / leaf_size]);
+		(*leaf)[i % leaf_size] = c;
+		next->_leaves[i / leaf_size] = leaf;
+		return finish_edit(next, changed);
+	}
+
+	shared_ptr<const ScriptSnapshot> ScriptSnapshot::with_inserted(size_t i, Sequence seq) const
+	{
+		if (i > _count)
+			throw std::out_of_range("No such sequence");
+		shared_ptr<ScriptSnapshot> next(new ScriptSnapshot(*this));
+		// the groups after i all shift, so they are regrouped
+		vector<shared_ptr<const Chunk>> all = chunks();
+		all.insert(all.begin() + i, make_chunk(std::move(seq), false, next->_cast));
+		next->set_chunks(all);
+		return finish_edit(next, true);
+	}
+
+	shared_ptr<const ScriptSnapshot> ScriptSnapshot::without_sequence(size_t i) const
+	{
+		if (i >= _count)
+			throw std::out_of_range("No such sequence");
+		shared_ptr<ScriptSnapshot> next(new ScriptSnapshot(*this));
+		vector<shared_ptr<const Chunk>> all = chunks();
+		all.erase(all.begin() + i);
+		next->set_chunks(all);
+		return finish_edit(next, true);
+	}
+
+	std::string ScriptSnapshot::as_fountain() const
+	{
+		string r;
+		FountainWriter writer;
+		writer.sequence(title(), r);
+		for (auto& node : title().nodes)
+			writer.node(node, r);
+		for (size_t i = 0; i < _count; ++i)
+		{
+			const Sequence& seq = sequence(i);
+			writer.sequence(seq, r);
+			for (auto& node : seq.nodes)
+				writer.node(node, r);
+		}
+		return r;
+	}
+
+	SharedScript::SharedScript(shared_ptr<const ScriptSnapshot> initial)
+	{
+		_slots[0].snapshot = std::move(initial);
+	}
+
+	shared_ptr<const ScriptSnapshot> SharedScript::load() const
+	{
+		for (;;)
+		{
+			unsigned i = _current.load();
+			const Slot& slot = _slots[i];
+			slot.readers.fetch_add(1);
+			// still current, so the writer won't touch the slot until the
+			// announcement is withdrawn
+			if (_current.load() == i)
+			{
+				shared_ptr<const ScriptSnapshot> snapshot = slot.snapshot;
+				slot.readers.fetch_sub(1);
+				return snapshot;
+			}
+			slot.readers.fetch_sub(1);
+		}
+	}
+
+	void SharedScript::publish(shared_ptr<const ScriptSnapshot> next)
+	{
+		Slot& slot = _slots[1 - _current.load()];
+		for (unsigned spins = 0; slot.readers.load() != 0; ++spins)
+			if (spins >= 64)
+				std::this_thread::yield();
+		slot.snapshot = std::move(next);
+		_current.store(static_cast<unsigned>(&slot - _slots));
+	}
+
+} // lab
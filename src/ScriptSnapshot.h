@@ -0,0 +1,163 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "Screenplay.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+	// An immutable version of a script, for many reader threads and one
+	// writer. The title page and each sequence are held in chunks of
+	// their own; an edit makes a new snapshot that shares every chunk but
+	// the one it replaces, and leaves the snapshot it was made from as it
+	// was. The chunks are indexed in groups of leaf_size, so replacing a
+	// sequence copies one group's pointers and the list of groups rather
+	// than a pointer per sequence. The tables of sets, characters, and
+	// sequence names are shared too, unless the edit changes them.
+	//
+	// Character ids are never reused: a name keeps its id in every later
+	// snapshot, even once no sequence speaks it.
+	//
+	// Nothing in a snapshot changes once it is made. Every node's
+	// ScriptNode::spans cache is filled as its chunk is made, before any
+	// reader can see it, so readers may call spans concurrently.
+	class ScriptSnapshot
+	{
+	public:
+		// The script's sequences become the first snapshot's chunks where
+		// they lie, in the script's memory resource, without a copy; the
+		// resource lives for as long as any snapshot uses one of them.
+		static std::shared_ptr<const ScriptSnapshot> make(Script&& script);
+
+		static const size_t leaf_size = 64;
+
+		const Sequence& title() const { return *_title->sequence; }
+		size_t sequence_count() const { return _count; }
+		const Sequence& sequence(size_t i) const { return *chunk(i).sequence; }
+
+		// as in Script; characters holds those who speak in some sequence
+		const std::set<std::string>& sets() const { return _tables->sets; }
+		const std::set<std::string>& characters() const { return _tables->characters; }
+		const std::map<std::string, int>& sequence_index() const { return _tables->sequence_index; }
+		const std::vector<std::string>& character_names() const { return _cast->names; }
+		uint32_t character_id(std::string_view cue) const;
+
+		// New snapshots with one sequence, or the title page, replaced,
+		// inserted, or removed. Dialog and parenthetical nodes of a new
+		// sequence are given character ids by their keys. A sequence is
+		// moved into memory of its own if it is not already on the
+		// default resource.
+		std::shared_ptr<const ScriptSnapshot> with_title(Sequence title) const;
+		std::shared_ptr<const ScriptSnapshot> with_sequence(size_t i, Sequence seq) const;
+		std::shared_ptr<const ScriptSnapshot> with_inserted(size_t i, Sequence seq) const;
+		std::shared_ptr<const ScriptSnapshot> without_sequence(size_t i) const;
+
+		// A new snapshot with sequence i replaced by a copy of it that
+		// edit has changed; edit is called with the copy, a Sequence&.
+		template <typename Edit>
+		std::shared_ptr<const ScriptSnapshot> with_sequence_edited(size_t i, Edit&& edit) const
+		{
+			if (i >= _count)
+				throw std::out_of_range("No such sequence");
+			Sequence seq(sequence(i), std::pmr::get_default_resource());
+			edit(seq);
+			return with_sequence(i, std::move(seq));
+		}
+
+		// true if sequence i of both snapshots is the same chunk
+		bool shares_sequence(size_t i, const ScriptSnapshot& other) const
+		{
+			return i < _count && i < other._count
+				&& (*_leaves[i / leaf_size])[i % leaf_size] == (*other._leaves[i / leaf_size])[i % leaf_size];
+		}
+
+		// as Script::as_fountain
+		std::string as_fountain() const;
+
+	private:
+		struct Chunk
+		{
+			std::shared_ptr<const Sequence> sequence;
+			std::string set;				// as Script::sets names it
+			std::vector<uint32_t> cast;		// ids of those who speak, ascending
+		};
+
+		// grows only, so that ids stay put
+		struct Cast
+		{
+			std::vector<std::string> names;
+			std::map<std::string, uint32_t, std::less<>> ids;	// by canonical name
+		};
+
+		struct Tables
+		{
+			std::set<std::string> sets;
+			std::set<std::string> characters;
+			std::map<std::string, int> sequence_index;
+		};
+
+		using Leaf = std::vector<std::shared_ptr<const Chunk>>;
+
+		ScriptSnapshot() = default;
+
+		const Chunk& chunk(size_t i) const { return *(*_leaves[i / leaf_size])[i % leaf_size]; }
+		std::vector<std::shared_ptr<const Chunk>> chunks() const;
+		void set_chunks(const std::vector<std::shared_ptr<const Chunk>>& chunks);
+
+		std::shared_ptr<const Chunk> make_chunk(Sequence seq, bool title_page, std::shared_ptr<const Cast>& cast) const;
+		// next's tables are rebuilt, or are this snapshot's
+		std::shared_ptr<const ScriptSnapshot> finish_edit(std::shared_ptr<ScriptSnapshot> next, bool rebuild_tables) const;
+
+		std::shared_ptr<const Chunk> _title;
+		std::vector<std::shared_ptr<const Leaf>> _leaves;
+		size_t _count = 0;
+		std::shared_ptr<const Cast> _cast;
+		std::shared_ptr<const Tables> _tables;
+	};
+
+	// The current snapshot of a script, replaced by one writer and read by
+	// any number of threads. Readers never lock or wait on the writer: a
+	// read retries only if a publication lands at the same moment. The
+	// writer waits, briefly, only for readers still copying the pointer to
+	// the snapshot before last. A snapshot a reader holds stays valid for
+	// as long as it is held.
+	class SharedScript
+	{
+	public:
+		explicit SharedScript(std::shared_ptr<const ScriptSnapshot> initial);
+
+		SharedScript(const SharedScript&) = delete;
+		SharedScript& operator=(const SharedScript&) = delete;
+
+		// from any thread
+		std::shared_ptr<const ScriptSnapshot> load() const;
+
+		// from the writer's thread only
+		void publish(std::shared_ptr<const ScriptSnapshot> next);
+
+	private:
+		// Publication alternates between two slots. A reader announces
+		// itself on the current slot before copying it, and the writer
+		// fills a slot only once no reader is announced there.
+		struct alignas(64) Slot
+		{
+			std::shared_ptr<const ScriptSnapshot> snapshot;
+			mutable std::atomic<int> readers{ 0 };
+		};
+		Slot _slots[2];
+		std::atomic<unsigned> _current{ 0 };
+	};
+
+} // lab
@@ -0,0 +1,198 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "ScriptStats.h"
+#include "ScriptUtil.h"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LAB_STATS_SSE2 1
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define LAB_STATS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace lab
+{
+	using namespace std;
+
+	namespace
+	{
+		inline bool is_space(char c)
+		{
+			return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+		}
+
+		inline bool is_sentence_end(char c)
+		{
+			return c == '.' || c == '!' || c == '?';
+		}
+
+		// a bit per byte of a 16 byte block, the first byte in bit 0
+		struct BlockMasks
+		{
+			unsigned space;
+			unsigned end;			// . ! ?
+			unsigned continuation;	// 10xxxxxx, within a UTF-8 sequence
+		};
+
+#if defined(LAB_STATS_NEON)
+		inline unsigned movemask(uint8x16_t m)
+		{
+			static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+			uint8x16_t b = vandq_u8(m, vld1q_u8(weights));
+			return vaddv_u8(vget_low_u8(b)) | (static_cast<unsigned>(vaddv_u8(vget_high_u8(b))) << 8);
+		}
+#endif
+
+		inline BlockMasks block_masks(const char* p)
+		{
+			BlockMasks m;
+#if defined(LAB_STATS_SSE2)
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+			                             _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+			__m128i end = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')), _mm_cmpeq_epi8(v, _mm_set1_epi8('!'))),
+			                           _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+			__m128i cont = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(static_cast<char>(0xC0))), _mm_set1_epi8(static_cast<char>(0x80)));
+			m.space = static_cast<unsigned>(_mm_movemask_epi8(space));
+			m.end = static_cast<unsigned>(_mm_movemask_epi8(end));
+			m.continuation = static_cast<unsigned>(_mm_movemask_epi8(cont));
+#elif defined(LAB_STATS_NEON)
+			uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+			uint8x16_t space = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\n'))),
+			                            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\t')), vceqq_u8(v, vdupq_n_u8('\r'))));
+			uint8x16_t end = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('.')), vceqq_u8(v, vdupq_n_u8('!'))),
+			                          vceqq_u8(v, vdupq_n_u8('?')));
+			uint8x16_t cont = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xC0)), vdupq_n_u8(0x80));
+			m.space = movemask(space);
+			m.end = movemask(end);
+			m.continuation = movemask(cont);
+#else
+			m.space = m.end = m.continuation = 0;
+			for (unsigned i = 0; i < 16; ++i)
+			{
+				unsigned bit = 1u << i;
+				if (is_space(p[i]))
+					m.space |= bit;
+				if (is_sentence_end(p[i]))
+					m.end |= bit;
+				if ((static_cast<unsigned char>(p[i]) & 0xC0) == 0x80)
+					m.continuation |= bit;
+			}
+#endif
+			return m;
+		}
+
+		void add_line(DialogCounts& counts, const TextCounts& text)
+		{
+			++counts.lines;
+			counts.text += text;
+		}
+	}
+
+	TextCounts countText(string_view text)
+	{
+		TextCounts r;
+		const char* p = text.data();
+		size_t n = text.length();
+
+		// Word starts are non-space bytes after a space, and sentence ends
+		// are ends before a space, so each block needs a bit of its
+		// neighbours: whether the byte before it was a space, and whether
+		// its own last byte was an end awaiting the next byte.
+		unsigned space_before = 1;
+		unsigned end_pending = 0;
+		auto count_block = [&](const BlockMasks& m, unsigned valid)
+		{
+			unsigned starts = ~m.space & ((m.space << 1) | space_before) & valid;
+			unsigned ends = m.end & (m.space >> 1);
+			r.words += popcount64(starts);
+			r.sentences += popcount64(ends & 0x7FFF) + (end_pending & m.space & 1);
+			r.characters += popcount64(~m.continuation & valid);
+			space_before = (m.space >> 15) & 1;
+			end_pending = (m.end >> 15) & 1;
+		};
+
+		size_t i = 0;
+		for (; i + 16 <= n; i += 16)
+			count_block(block_masks(p + i), 0xFFFF);
+		if (i < n)
+		{
+			// the tail, padded with spaces that end any sentence before them
+			char block[16];
+			memset(block, ' ', sizeof(block));
+			memcpy(block, p + i, n - i);
+			count_block(block_masks(block), (1u << (n - i)) - 1);
+		}
+		r.sentences += end_pending;	// an end as the text's last byte
+
+		size_t last = n;
+		while (last > 0 && is_space(p[last - 1]))
+			--last;
+		if (last > 0 && !is_sentence_end(p[last - 1]))
+			++r.sentences;
+		return r;
+	}
+
+	void DialogStats::add(const Script& script)
+	{
+		walkScript(script, { this });
+	}
+
+	void DialogStats::begin(const Script& script)
+	{
+		_characters.assign(script.character_names.size(), DialogCounts());
+		_sequences.assign(script.sequences.size(), DialogCounts());
+		_total = DialogCounts();
+		_sequence = nullptr;
+	}
+
+	void DialogStats::sequence(const Sequence& /*seq*/, size_t index)
+	{
+		_sequence = index < _sequences.size() ? &_sequences[index] : nullptr;
+	}
+
+	void DialogStats::node(const ScriptNode& node)
+	{
+		// a cue directly followed by a parenthetical has no text
+		if (!_sequence || !isDialogKind(node.kind) || node.content.empty())
+			return;
+		TextCounts text = countText(node.content);
+		add_line(_total, text);
+		add_line(*_sequence, text);
+		if (node.character < _characters.size())
+			add_line(_characters[node.character], text);
+	}
+
+	void DialogReport::end(const Script& script)
+	{
+		auto row = [this](const char* scope, string_view name, const DialogCounts& c)
+		{
+			char seconds[32];
+			snprintf(seconds, sizeof(seconds), "%.1f", _stats.seconds(c));
+			_out.append(scope);
+			_out.append('\t');
+			append_field(_out, name);
+			for (size_t v : { c.lines, c.text.words, c.text.sentences, c.text.characters })
+			{
+				_out.append('\t');
+				_out.append(to_string(v));
+			}
+			_out.append('\t');
+			_out.append(seconds);
+			_out.append('\n');
+		};
+
+		_out.append("scope\tname\tlines\twords\tsentences\tcharacters\tseconds\n");
+		row("script", string_view(), _stats.total());
+		for (size_t i = 0; i < _stats.characters().size(); ++i)
+			row("character", script.character_names[i], _stats.characters()[i]);
+		for (size_t i = 0; i < _stats.sequences().size(); ++i)
+			row("sequence", script.sequences[i].name, _stats.sequences()[i]);
+	}
+
+} // lab
@@ -0,0 +1,100 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include "ScriptReport.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace lab
+{
+	class OutputBuffer;
+
+	struct TextCounts
+	{
+		size_t words = 0;		// runs of anything but space, tab, CR, and LF
+		size_t sentences = 0;	// see countText
+		size_t characters = 0;	// code points, white space included
+
+		TextCounts& operator+=(const TextCounts& rh)
+		{
+			words += rh.words;
+			sentences += rh.sentences;
+			characters += rh.characters;
+			return *this;
+		}
+	};
+
+	// Counts text in place, 16 bytes at a time where SSE2 or NEON is
+	// available. A sentence ends at a . ! or ? followed by white space or
+	// the end of the text, so that "Wait... what?" is two; text after the
+	// last such end is a sentence too, as dialog often goes unpunctuated.
+	// Abbreviations such as Mr. are counted as ends.
+	TextCounts countText(std::string_view text);
+
+	struct DialogCounts
+	{
+		size_t lines = 0;		// dialog nodes with text
+		TextCounts text;
+	};
+
+	// Word, sentence, and character counts of the dialog in a script, for
+	// each character and for each sequence, with speaking time estimated
+	// from the words at a given rate. Dialog is counted where it lies in
+	// the script; nothing is copied. Filled by a walk over the script, or
+	// by add.
+	class DialogStats : public ScriptReport
+	{
+	public:
+		explicit DialogStats(double words_per_minute = 150.0) : _words_per_minute(words_per_minute) {}
+
+		void add(const Script& script);
+
+		void begin(const Script& script) override;
+		void sequence(const Sequence& seq, size_t index) override;
+		void node(const ScriptNode& node) override;
+
+		double seconds(const DialogCounts& counts) const
+		{
+			return _words_per_minute > 0 ? counts.text.words * 60.0 / _words_per_minute : 0.0;
+		}
+
+		double words_per_minute() const { return _words_per_minute; }
+
+		// indexed by Script::character_names and by Script::sequences
+		const std::vector<DialogCounts>& characters() const { return _characters; }
+		const std::vector<DialogCounts>& sequences() const { return _sequences; }
+		const DialogCounts& total() const { return _total; }
+
+	private:
+		double _words_per_minute;
+		std::vector<DialogCounts> _characters;
+		std::vector<DialogCounts> _sequences;
+		DialogCounts _total;
+		DialogCounts* _sequence = nullptr;
+	};
+
+	// DialogStats as tab separated values: a row for the script, then one
+	// for each character in the order they first speak, then one for each
+	// sequence. Each row gives the dialog's lines, words, sentences,
+	// characters, and estimated seconds.
+	class DialogReport : public ScriptReport
+	{
+	public:
+		DialogReport(OutputBuffer& out, double words_per_minute) : _out(out), _stats(words_per_minute) {}
+
+		void begin(const Script& script) override { _stats.begin(script); }
+		void sequence(const Sequence& seq, size_t index) override { _stats.sequence(seq, index); }
+		void node(const ScriptNode& node) override { _stats.node(node); }
+		void end(const Script& script) override;
+
+	private:
+		OutputBuffer& _out;
+		DialogStats _stats;
+	};
+
+} // lab
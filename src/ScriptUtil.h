@@ -0,0 +1,37 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+// Small helpers shared by the library's sources; not installed.
+
+#include "FileIO.h"
+
+#include <cstdint>
+#include <string_view>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace lab
+{
+	inline uint32_t popcount64(uint64_t x)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		return static_cast<uint32_t>(__popcnt64(x));
+#elif defined(_MSC_VER)
+		return static_cast<uint32_t>(__popcnt(static_cast<unsigned>(x)) + __popcnt(static_cast<unsigned>(x >> 32)));
+#else
+		return static_cast<uint32_t>(__builtin_popcountll(x));
+#endif
+	}
+
+	// a field of a tab separated row, its tabs and line breaks as spaces
+	inline void append_field(OutputBuffer& out, std::string_view s)
+	{
+		for (char c : s)
+			out.append(c == '\t' || c == '\n' ? ' ' : c);
+	}
+
+} // lab
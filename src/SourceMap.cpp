@@ -0,0 +1,104 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "SourceMap.h"
+#include "FileIO.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace lab
+{
+	using namespace std;
+
+	static_assert(host_little_endian, "source maps are little endian, and read with memcpy");
+
+	namespace
+	{
+		const char source_map_magic[8] = { 'L', 'a', 'b', 'S', 'm', 'a', 'p', '\0' };
+	}
+
+	void SourceMap::clear()
+	{
+		_block_base.clear();
+		_line_delta.clear();
+		_sequences.clear();
+	}
+
+	void SourceMap::add_line(uint64_t offset)
+	{
+		if (_line_delta.size() % block_lines == 0)
+			_block_base.push_back(offset);
+		uint64_t delta = offset - _block_base.back();
+		if (delta > 0xffffffffull)
+			throw std::runtime_error("Source map block exceeds 4GB");
+		_line_delta.push_back(static_cast<uint32_t>(delta));
+	}
+
+	uint64_t SourceMap::line_offset(size_t line) const
+	{
+		return _block_base[line / block_lines] + _line_delta[line];
+	}
+
+	size_t SourceMap::line_at(uint64_t offset) const
+	{
+		if (_block_base.empty() || offset < _block_base[0])
+			return npos;
+		size_t block = (upper_bound(_block_base.begin(), _block_base.end(), offset) - _block_base.begin()) - 1;
+		uint64_t delta = offset - _block_base[block];
+		auto first = _line_delta.begin() + block * block_lines;
+		auto last = _line_delta.begin() + min(_line_delta.size(), (block + 1) * block_lines);
+		if (delta > 0xffffffffull)
+			return (last - _line_delta.begin()) - 1;
+		return (upper_bound(first, last, static_cast<uint32_t>(delta)) - _line_delta.begin()) - 1;
+	}
+
+	size_t SourceMap::sequence_at(uint64_t offset) const
+	{
+		auto i = upper_bound(_sequences.begin(), _sequences.end(), offset);
+		if (i == _sequences.begin())
+			return npos;
+		return (i - _sequences.begin()) - 1;
+	}
+
+	void SourceMap::write(OutputBuffer& out) const
+	{
+		static const char padding[8] = {};
+		uint64_t counts[2] = { _line_delta.size(), _sequences.size() };
+		out.append(source_map_magic, sizeof(source_map_magic));
+		out.append(reinterpret_cast<const char*>(counts), sizeof(counts));
+		out.append(reinterpret_cast<const char*>(_block_base.data()), _block_base.size() * sizeof(uint64_t));
+		size_t deltas = _line_delta.size() * sizeof(uint32_t);
+		out.append(reinterpret_cast<const char*>(_line_delta.data()), deltas);
+		out.append(padding, ((deltas + 7) & ~size_t(7)) - deltas);
+		out.append(reinterpret_cast<const char*>(_sequences.data()), _sequences.size() * sizeof(uint64_t));
+	}
+
+	size_t SourceMap::read(const char* data, size_t size)
+	{
+		uint64_t counts[2];
+		if (size < sizeof(source_map_magic) + sizeof(counts) || memcmp(data, source_map_magic, sizeof(source_map_magic)))
+			throw std::runtime_error("Not a source map");
+		memcpy(counts, data + sizeof(source_map_magic), sizeof(counts));
+
+		uint64_t lines = counts[0];
+		uint64_t blocks = (lines + block_lines - 1) / block_lines;
+		uint64_t deltas = (lines * sizeof(uint32_t) + 7) & ~uint64_t(7);
+		size_t used = sizeof(source_map_magic) + sizeof(counts);
+		if (lines > size || counts[1] > size
+			|| blocks * sizeof(uint64_t) + deltas + counts[1] * sizeof(uint64_t) > size - used)
+			throw std::runtime_error("Corrupt source map");
+
+		_block_base.resize(static_cast<size_t>(blocks));
+		memcpy(_block_base.data(), data + used, _block_base.size() * sizeof(uint64_t));
+		used += _block_base.size() * sizeof(uint64_t);
+		_line_delta.resize(static_cast<size_t>(lines));
+		memcpy(_line_delta.data(), data + used, _line_delta.size() * sizeof(uint32_t));
+		used += static_cast<size_t>(deltas);
+		_sequences.resize(static_cast<size_t>(counts[1]));
+		memcpy(_sequences.data(), data + used, _sequences.size() * sizeof(uint64_t));
+		used += _sequences.size() * sizeof(uint64_t);
+		return used;
+	}
+
+} // lab
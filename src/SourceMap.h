@@ -0,0 +1,68 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lab
+{
+	class OutputBuffer;
+
+	// Maps between byte offsets in the source text, line numbers, and
+	// sequences. Lines and sequences are numbered from zero, in source
+	// order. Every lookup is a binary search.
+	//
+	// Line starts are stored as a 64 bit base per block of lines plus a 32
+	// bit offset from that base for each line, which halves the table for
+	// the common case while still allowing inputs beyond 4GB.
+	class SourceMap
+	{
+	public:
+		static const size_t npos = ~size_t(0);
+
+		void clear();
+
+		// must be called in increasing offset order
+		void add_line(uint64_t offset);
+		void add_sequence(uint64_t heading_offset) { _sequences.push_back(heading_offset); }
+
+		size_t line_count() const { return _line_delta.size(); }
+		size_t sequence_count() const { return _sequences.size(); }
+
+		uint64_t line_offset(size_t line) const;
+		size_t line_at(uint64_t offset) const;
+
+		// offset of the heading line of a sequence, an index into
+		// Script::sequences, as found through Script::sequence_index
+		uint64_t sequence_offset(size_t sequence) const { return _sequences[sequence]; }
+		// the sequence containing offset, or npos if it is on the title page
+		size_t sequence_at(uint64_t offset) const;
+
+		// bytes held by the tables
+		size_t memory_usage() const
+		{
+			return _block_base.capacity() * sizeof(uint64_t) + _line_delta.capacity() * sizeof(uint32_t)
+				+ _sequences.capacity() * sizeof(uint64_t);
+		}
+
+		void write(OutputBuffer& out) const;
+		// reads what write produced, returning the number of bytes consumed
+		size_t read(const char* data, size_t size);
+
+		bool operator==(const SourceMap& rh) const
+		{
+			return _block_base == rh._block_base && _line_delta == rh._line_delta && _sequences == rh._sequences;
+		}
+
+	private:
+		static const size_t block_lines = 256;
+
+		std::vector<uint64_t> _block_base;
+		std::vector<uint32_t> _line_delta;
+		std::vector<uint64_t> _sequences;
+	};
+
+} // lab
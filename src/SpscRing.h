@@ -0,0 +1,81 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+
+namespace lab
+{
+	// A bounded lock free queue for exactly one producer thread and one
+	// consumer thread. Capacity must be a power of two.
+	template <typename T, size_t Capacity>
+	class SpscRing
+	{
+		static_assert(Capacity && !(Capacity & (Capacity - 1)), "capacity must be a power of two");
+
+	public:
+		bool try_push(const T& v)
+		{
+			size_t tail = _tail.load(std::memory_order_relaxed);
+			if (tail - _head.load(std::memory_order_acquire) == Capacity)
+				return false;
+			_items[tail & (Capacity - 1)] = v;
+			_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool try_pop(T& v)
+		{
+			size_t head = _head.load(std::memory_order_relaxed);
+			if (head == _tail.load(std::memory_order_acquire))
+				return false;
+			v = _items[head & (Capacity - 1)];
+			_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool empty() const
+		{
+			return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+		}
+
+		// Block until the operation succeeds or stop is set, returning
+		// false for the latter. Waiting spins briefly, then yields, then
+		// sleeps, so an idle side costs little CPU.
+		bool push(const T& v, const std::atomic<bool>& stop)
+		{
+			return wait([&] { return try_push(v); }, stop);
+		}
+		bool pop(T& v, const std::atomic<bool>& stop)
+		{
+			return wait([&] { return try_pop(v); }, stop);
+		}
+
+	private:
+		template <typename Fn>
+		static bool wait(Fn fn, const std::atomic<bool>& stop)
+		{
+			for (unsigned spins = 0; !fn(); ++spins)
+			{
+				if (stop.load(std::memory_order_acquire))
+					return false;
+				if (spins < 64)
+					continue;
+				else if (spins < 128)
+					std::this_thread::yield();
+				else
+					std::this_thread::sleep_for(std::chrono::microseconds(20));
+			}
+			return true;
+		}
+
+		alignas(64) std::atomic<size_t> _head{ 0 };	// next to pop, written by the consumer
+		alignas(64) std::atomic<size_t> _tail{ 0 };	// next to push, written by the producer
+		T _items[Capacity];
+	};
+
+} // lab
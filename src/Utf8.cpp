@@ -0,0 +1,370 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#include "Utf8.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LAB_UTF8_SSE2 1
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define LAB_UTF8_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace lab
+{
+	namespace
+	{
+		const uint32_t case_table_size = 0x500;
+
+		// one entry per code point below U+0500: its case, and its upper
+		// case form, or itself
+		struct CaseTable
+		{
+			LetterCase c[case_table_size];
+			uint16_t upper[case_table_size];
+
+			void range(uint32_t first, uint32_t last, LetterCase lc)
+			{
+				for (uint32_t i = first; i <= last; ++i)
+					c[i] = lc;
+			}
+			// lower case letters, each offset from its capital
+			void lower(uint32_t first, uint32_t last, int32_t offset)
+			{
+				for (uint32_t i = first; i <= last; ++i)
+				{
+					c[i] = LetterCase::Lower;
+					upper[i] = static_cast<uint16_t>(i - offset);
+				}
+			}
+			// alternating pairs; the first of each pair has case first_case
+			void pairs(uint32_t first, uint32_t last, LetterCase first_case)
+			{
+				LetterCase second = first_case == LetterCase::Upper ? LetterCase::Lower : LetterCase::Upper;
+				for (uint32_t i = first; i <= last; ++i)
+				{
+					c[i] = ((i - first) & 1) ? second : first_case;
+					if (c[i] == LetterCase::Lower && first_case == LetterCase::Upper)
+						upper[i] = static_cast<uint16_t>(i - 1);
+				}
+			}
+
+			CaseTable()
+			{
+				range(0, case_table_size - 1, LetterCase::None);
+				for (uint32_t i = 0; i < case_table_size; ++i)
+					upper[i] = static_cast<uint16_t>(i);
+
+				range('A', 'Z', LetterCase::Upper);
+				lower('a', 'z', 0x20);
+
+				// Latin-1 Supplement; the multiplication and division signs
+				// sit among the letters. U+00DF sharp s has no single
+				// capital in common use and so is left caseless.
+				range(0xC0, 0xDE, LetterCase::Upper);
+				lower(0xE0, 0xFE, 0x20);
+				c[0xFF] = LetterCase::Lower;
+				upper[0xFF] = 0x178;
+				c[0xD7] = LetterCase::None;
+				c[0xF7] = LetterCase::None;
+				upper[0xF7] = 0xF7;
+
+				// Latin Extended-A; dotless i and long s are capitalized in
+				// ASCII
+				pairs(0x100, 0x137, LetterCase::Upper);
+				upper[0x131] = 'I';
+				c[0x138] = LetterCase::Lower;
+				pairs(0x139, 0x148, LetterCase::Upper);
+				c[0x149] = LetterCase::Lower;
+				pairs(0x14A, 0x177, LetterCase::Upper);
+				c[0x178] = LetterCase::Upper;
+				pairs(0x179, 0x17E, LetterCase::Upper);
+				c[0x17F] = LetterCase::Lower;
+				upper[0x17F] = 'S';
+
+				// Greek; final sigma is capitalized as sigma
+				c[0x386] = LetterCase::Upper;
+				range(0x388, 0x38A, LetterCase::Upper);
+				c[0x38C] = LetterCase::Upper;
+				range(0x38E, 0x38F, LetterCase::Upper);
+				c[0x390] = LetterCase::Lower;
+				range(0x391, 0x3A1, LetterCase::Upper);
+				range(0x3A3, 0x3AB, LetterCase::Upper);
+				lower(0x3AC, 0x3AC, 0x3AC - 0x386);
+				lower(0x3AD, 0x3AF, 0x3AD - 0x388);
+				c[0x3B0] = LetterCase::Lower;
+				lower(0x3B1, 0x3CB, 0x20);
+				upper[0x3C2] = 0x3A3;
+				lower(0x3CC, 0x3CC, 0x3CC - 0x38C);
+				lower(0x3CD, 0x3CE, 0x3CD - 0x38E);
+
+				// Cyrillic
+				range(0x400, 0x42F, LetterCase::Upper);
+				lower(0x430, 0x44F, 0x20);
+				lower(0x450, 0x45F, 0x50);
+				pairs(0x460, 0x481, LetterCase::Upper);
+				pairs(0x48A, 0x4BF, LetterCase::Upper);
+				c[0x4C0] = LetterCase::Upper;
+				pairs(0x4C1, 0x4CE, LetterCase::Upper);
+				c[0x4CF] = LetterCase::Lower;
+				upper[0x4CF] = 0x4C0;
+				pairs(0x4D0, 0x4FF, LetterCase::Upper);
+			}
+		};
+		const CaseTable case_table;
+
+		// number of leading bytes in [p, p + 16) below 0x80, 16 if all are
+		inline size_t ascii_prefix16(const char* p)
+		{
+#if defined(LAB_UTF8_SSE2)
+			int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+			if (!mask)
+				return 16;
+			size_t n = 0;
+			while (!(mask & 1))
+			{
+				mask >>= 1;
+				++n;
+			}
+			return n;
+#elif defined(LAB_UTF8_NEON)
+			uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+			if (vmaxvq_u8(v) < 0x80)
+				return 16;
+			size_t n = 0;
+			while (static_cast<unsigned char>(p[n]) < 0x80)
+				++n;
+			return n;
+#else
+			size_t n = 0;
+			while (n < 16 && static_cast<unsigned char>(p[n]) < 0x80)
+				++n;
+			return n;
+#endif
+		}
+
+		// for a block of 16 ASCII bytes, true if any is 'a' through 'z'
+		inline bool ascii_has_lower16(const char* p)
+		{
+#if defined(LAB_UTF8_SSE2)
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i ge_a = _mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1));
+			__m128i le_z = _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1));
+			return _mm_movemask_epi8(_mm_and_si128(ge_a, le_z)) != 0;
+#elif defined(LAB_UTF8_NEON)
+			uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+			uint8x16_t in = vandq_u8(vcgeq_u8(v, vdupq_n_u8('a')), vcleq_u8(v, vdupq_n_u8('z')));
+			return vmaxvq_u8(in) != 0;
+#else
+			for (int i = 0; i < 16; ++i)
+				if (p[i] >= 'a' && p[i] <= 'z')
+					return true;
+			return false;
+#endif
+		}
+	}
+
+	size_t utf8_encode(uint32_t cp, char* out)
+	{
+		if (cp < 0x80)
+		{
+			out[0] = static_cast<char>(cp);
+			return 1;
+		}
+		if (cp < 0x800)
+		{
+			out[0] = static_cast<char>(0xC0 | (cp >> 6));
+			out[1] = static_cast<char>(0x80 | (cp & 0x3F));
+			return 2;
+		}
+		if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+			return 0;
+		if (cp < 0x10000)
+		{
+			out[0] = static_cast<char>(0xE0 | (cp >> 12));
+			out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out[2] = static_cast<char>(0x80 | (cp & 0x3F));
+			return 3;
+		}
+		out[0] = static_cast<char>(0xF0 | (cp >> 18));
+		out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+		out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+		out[3] = static_cast<char>(0x80 | (cp & 0x3F));
+		return 4;
+	}
+
+	size_t utf8_decode(const char* p, const char* end, uint32_t& cp)
+	{
+		const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+		size_t avail = static_cast<size_t>(end - p);
+		if (!avail)
+			return 0;
+
+		unsigned char c = s[0];
+		if (c < 0x80)
+		{
+			cp = c;
+			return 1;
+		}
+
+		size_t len;
+		unsigned char lo = 0x80;
+		unsigned char hi = 0xBF;
+		if (c >= 0xC2 && c <= 0xDF)
+		{
+			len = 2;
+			cp = c & 0x1F;
+		}
+		else if (c >= 0xE0 && c <= 0xEF)
+		{
+			len = 3;
+			cp = c & 0x0F;
+			if (c == 0xE0)
+				lo = 0xA0;     // overlong
+			else if (c == 0xED)
+				hi = 0x9F;     // surrogates
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			len = 4;
+			cp = c & 0x07;
+			if (c == 0xF0)
+				lo = 0x90;     // overlong
+			else if (c == 0xF4)
+				hi = 0x8F;     // beyond U+10FFFF
+		}
+		else
+			return 0;
+
+		if (avail < len || s[1] < lo || s[1] > hi)
+			return 0;
+		cp = (cp << 6) | (s[1] & 0x3F);
+		for (size_t i = 2; i < len; ++i)
+		{
+			if ((s[i] & 0xC0) != 0x80)
+				return 0;
+			cp = (cp << 6) | (s[i] & 0x3F);
+		}
+		return len;
+	}
+
+	size_t utf8_find_invalid(const char* data, size_t len)
+	{
+		const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+		const unsigned char* p = s;
+		const unsigned char* end = s + len;
+		while (p < end)
+		{
+			if (end - p >= 16)
+			{
+				size_t n = ascii_prefix16(reinterpret_cast<const char*>(p));
+				p += n;
+				if (n == 16)
+					continue;
+			}
+
+			// stay scalar until 16 bytes of ASCII are likely again; the
+			// second byte's range carries the overlong, surrogate, and
+			// U+10FFFF checks, as in utf8_decode
+			int ascii_run = 0;
+			while (p < end && ascii_run < 8)
+			{
+				unsigned char c = *p;
+				if (c < 0x80)
+				{
+					++p;
+					++ascii_run;
+					continue;
+				}
+				ascii_run = 0;
+				size_t n;
+				unsigned char lo = 0x80;
+				unsigned char hi = 0xBF;
+				if (c >= 0xC2 && c <= 0xDF)
+					n = 2;
+				else if (c >= 0xE0 && c <= 0xEF)
+				{
+					n = 3;
+					if (c == 0xE0)
+						lo = 0xA0;
+					else if (c == 0xED)
+						hi = 0x9F;
+				}
+				else if (c >= 0xF0 && c <= 0xF4)
+				{
+					n = 4;
+					if (c == 0xF0)
+						lo = 0x90;
+					else if (c == 0xF4)
+						hi = 0x8F;
+				}
+				else
+					return static_cast<size_t>(p - s);
+
+				if (static_cast<size_t>(end - p) < n || p[1] < lo || p[1] > hi)
+					return static_cast<size_t>(p - s);
+				if (n > 2 && (p[2] & 0xC0) != 0x80)
+					return static_cast<size_t>(p - s);
+				if (n > 3 && (p[3] & 0xC0) != 0x80)
+					return static_cast<size_t>(p - s);
+				p += n;
+			}
+		}
+		return len;
+	}
+
+	LetterCase letter_case(uint32_t cp)
+	{
+		return cp < case_table_size ? case_table.c[cp] : LetterCase::None;
+	}
+
+	uint32_t to_upper(uint32_t cp)
+	{
+		return cp < case_table_size ? case_table.upper[cp] : cp;
+	}
+
+	bool utf8_has_no_lowercase(const char* begin, const char* end)
+	{
+		const char* p = begin;
+		while (p < end)
+		{
+			if (end - p >= 16)
+			{
+				size_t n = ascii_prefix16(p);
+				if (n == 16)
+				{
+					if (ascii_has_lower16(p))
+						return false;
+					p += 16;
+					continue;
+				}
+				for (const char* q = p + n; p < q; ++p)
+					if (*p >= 'a' && *p <= 'z')
+						return false;
+			}
+
+			unsigned char c = static_cast<unsigned char>(*p);
+			if (c < 0x80)
+			{
+				if (c >= 'a' && c <= 'z')
+					return false;
+				++p;
+				continue;
+			}
+
+			uint32_t cp;
+			size_t n = utf8_decode(p, end, cp);
+			if (!n)
+			{
+				++p;
+				continue;
+			}
+			if (letter_case(cp) == LetterCase::Lower)
+				return false;
+			p += n;
+		}
+		return true;
+	}
+
+} // lab
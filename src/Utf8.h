@@ -0,0 +1,42 @@
+// License: BSD 3-clause
+// Copyright: Nick Porcino, 2017
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace lab
+{
+	// Decodes one UTF-8 sequence at p, storing the code point in cp.
+	// Returns the length of the sequence, or 0 if it is not well formed:
+	// truncated, overlong, a surrogate, or beyond U+10FFFF.
+	size_t utf8_decode(const char* p, const char* end, uint32_t& cp);
+
+	// Writes cp as UTF-8 to out, which has room for four bytes, and
+	// returns the length; 0 for a surrogate or a value beyond U+10FFFF.
+	size_t utf8_encode(uint32_t cp, char* out);
+
+	// Returns the offset of the first ill formed sequence, or len if the
+	// whole buffer is valid UTF-8. Only runs of ASCII are checked 16 bytes
+	// at a time; multibyte sequences are checked a byte at a time, without
+	// decoding them.
+	size_t utf8_find_invalid(const char* data, size_t len);
+	inline bool utf8_is_valid(const char* data, size_t len) { return utf8_find_invalid(data, len) == len; }
+
+	enum class LetterCase : uint8_t { None, Lower, Upper };
+
+	// case of a code point in ASCII, Latin-1, Latin Extended-A, Greek, or
+	// Cyrillic; None for anything else, including caseless letters
+	LetterCase letter_case(uint32_t cp);
+
+	// the capital of a lower case letter in the scripts above, where it is
+	// a single code point; any other code point is itself
+	uint32_t to_upper(uint32_t cp);
+
+	// True if [begin, end) holds no lowercase letter in the scripts above.
+	// Pure ASCII blocks are tested 16 bytes at a time; bytes that are not
+	// valid UTF-8 are skipped.
+	bool utf8_has_no_lowercase(const char* begin, const char* end);
+
+} // lab
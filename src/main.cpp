@@ -2,119 +2,544 @@
 // License: BSD 3-clause
 // Copyright: Nick Porcino, 2017
 
+#include "FileIO.h"
 #include "OptionParser.h"
 #include "Screenplay.h"
+#include "ScriptCast.h"
+#include "ScriptColumns.h"
+#include "ScriptDaemon.h"
+#include "ScriptDrafts.h"
+#include "ScriptEmit.h"
+#include "ScriptFdx.h"
+#include "ScriptIndex.h"
+#include "ScriptJson.h"
+#include "ScriptReport.h"
+#include "ScriptSchedule.h"
+#include "ScriptStats.h"
 
+#include <cstdio>
 #include <string>
 #include <iostream>
-#include <fstream>
+#include <memory>
 #include <set>
+#include <vector>
 
 using namespace std;
 
-std::string path;
+std::vector<std::string> paths;
 
 void stringcallback(const std::string& str)
 {
-    path = str;
+    paths.push_back(str);
 }
 
-
-int main(int argc, char** argv) try
+// nullptr if path doesn't exist; a .gz script is inflated as it is read
+std::unique_ptr<lab::ChunkReader> openScript(const std::string& path)
 {
-	std::cout << "LabScreenplay 20171202.1850" << "\n";
-
-	char * text = nullptr;
-    char * end = nullptr;
+	if (!lab::filesystem::exists(path))
+		return nullptr;
+	return lab::open_chunk_reader(path);
+}
 
-    OptionParser op("screenplay");
-    op.StringCallback(stringcallback, "file to parse");
+// counts the bytes a reader delivers, inflated if the file was compressed
+class CountingReader : public lab::ChunkReader
+{
+public:
+	explicit CountingReader(lab::ChunkReader& reader) : _reader(reader) {}
 
-	if (op.Parse(argc, argv))
+	uint64_t size() const override { return _reader.size(); }
+	const char* next(size_t& length) override
 	{
-        if (path.length() == 0) {
-            op.Usage();
-            exit(1);
-        }
+		const char* chunk = _reader.next(length);
+		if (chunk)
+			bytes += length;
+		return chunk;
+	}
 
-        FILE* f = fopen(path.c_str(), "rb");
-		if (!f) {
-			std::cout << path << " not found" << std::endl;
-			exit(1);
-		}
+	uint64_t bytes = 0;
 
-		fseek(f, 0, SEEK_END);
-		size_t len = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		text = new char[len + 1];
-		fread(text, 1, len, f);
-		text[len] = '\0';
-		fclose(f);
-        end = text + len;
-    }
+private:
+	lab::ChunkReader& _reader;
+};
 
-    if (!text) {
-        std::cerr << "could not read " << path << endl;
+// text_bytes, if given, receives the length of the text parsed
+lab::Script readScript(lab::ChunkReader* reader, const std::string& path, uint64_t* text_bytes = nullptr)
+{
+	if (!reader) {
+		std::cerr << path << " not found" << std::endl;
 		exit(1);
-    }
+	}
+
+	// the next buffers are read while this one is parsed, and the text
+	// is never held whole
+	uint64_t invalid;
+	CountingReader counted(*reader);
+	lab::Script script = lab::parseScriptInArena(counted, path, &invalid);
+	if (text_bytes)
+		*text_bytes = counted.bytes;
+	if (invalid != lab::FountainStream::npos)
+		std::cerr << path << ":" << script.source_map.line_at(invalid) + 1 << ": invalid UTF-8 at byte " << invalid << std::endl;
+
+	return script;
+}
 
-	string scriptText(text, end);
-	delete[] text;
-	lab::Script script = lab:: Script::parseFountain(scriptText);
+// the reports --report can write, and the suffix of each one's file
+struct ReportKind
+{
+	const char* name;
+	const char* suffix;
+};
+
+const ReportKind report_kinds[] =
+{
+	{ "summary", ".summary.txt" },
+	{ "json", ".json" },
+	{ "emit", ".emit.fountain" },
+	{ "stats", ".stats.txt" },
+	{ "breakdown", ".breakdown.tsv" },
+	{ "dialog", ".dialog.tsv" },
+	{ "cast", ".cast.tsv" },
+	{ "centrality", ".centrality.tsv" },
+};
 
-	std::ofstream out("C:\\tmp\\test.fountain");
-	for (auto& node : script.title.nodes)
-		out << node.as_string() << "\n";
-	out << "\n\n";
-	for (auto& seq : script.sequences)
+const ReportKind* findReportKind(const std::string& name)
+{
+	for (auto& k : report_kinds)
+		if (name == k.name)
+			return &k;
+	return nullptr;
+}
+
+// the file a report is written to
+struct ReportFile
+{
+	ReportFile(const std::string& path)
+		: fd(lab::open_output_fd(path))
+		, out(new lab::OutputBuffer(fd))
+	{
+	}
+	~ReportFile()
 	{
-		out << seq.as_string() << "\n\n";
-		for (auto& node : seq.nodes)
-			out << node.as_string() << "\n";
+		out->flush();
+		out.reset();
+		lab::close_output_fd(fd);
 	}
 
+	int fd;
+	std::unique_ptr<lab::OutputBuffer> out;
+};
 
-	lab::ScriptMeta meta(script);
+// script.fountain and script.fountain.gz both report as script
+std::string reportStem(const std::string& path)
+{
+	lab::filesystem::path name = lab::filesystem::path(path).filename();
+	if (name.extension() == ".gz")
+		name = name.stem();
+	return name.stem().string();
+}
 
-    std::cout << "\nSummary:\n";
-    std::cout << "----------------------------------------------------\n";
+// Answers --find from the index, a script a line, or for a prefix a term
+// and a script a line. No script is parsed.
+int runFind(const std::string& index_path, const std::string& query)
+{
+    size_t space = query.find(' ');
+    std::string kind_name = query.substr(0, space);
+    std::string name = space == std::string::npos ? std::string() : query.substr(space + 1);
+    lab::CorpusTerm kind;
+    if (kind_name == "character")
+        kind = lab::CorpusTerm::Character;
+    else if (kind_name == "location")
+        kind = lab::CorpusTerm::Location;
+    else if (kind_name == "set")
+        kind = lab::CorpusTerm::Set;
+    else
+    {
+        std::cerr << "Unknown query " << query << "; use character, location, or set, then a name" << std::endl;
+        return 1;
+    }
 
-	std::cout << "Location count: " << script.sets.size() << "\n";
-	std::cout << "Character count: " << script.characters.size() << "\n";
-	std::cout << "Sequence count:" << script.sequences.size() << "\n";
+    lab::MappedFile file(index_path);
+    lab::CorpusIndex index(file.data(), file.size());
+    lab::OutputBuffer out(1);
+    if (name.length() && name.back() == '*')
+    {
+        name.pop_back();
+        for (auto& match : index.find_prefix(kind, name))
+            for (uint32_t id : match.scripts)
+            {
+                out.append(match.name);
+                out.append('\t');
+                out.append(index.script_name(id));
+                out.append('\n');
+            }
+    }
+    else
+    {
+        for (uint32_t id : index.find(kind, name))
+        {
+            out.append(index.script_name(id));
+            out.append('\n');
+        }
+    }
+    out.flush();
+    return 0;
+}
 
-    std::cout << "\nLocations:\n";
-    std::cout << "----------------------------------------------------\n";
+// Writes the latest draft of a name in the store as Fountain text to stdout
+int runCheckout(const std::string& drafts_path, const std::string& name)
+{
+    lab::DraftStore store(drafts_path);
+    size_t draft = store.find(name);
+    if (draft == lab::DraftStore::npos)
+    {
+        std::cerr << "No draft named " << name << " in " << drafts_path << std::endl;
+        return 1;
+    }
+    std::string text = store.draft(draft).as_fountain();
+    lab::write_fully(1, text.data(), text.length());
+    return 0;
+}
 
-    for (auto& l : script.sets)
-        std::cout << l << "\n";
+// a row of --memory: the script's and its meta's bytes by category, and
+// their total per megabyte of text parsed
+void writeMemoryUsage(lab::OutputBuffer& out, const std::string& path, uint64_t text_bytes,
+                      const lab::Script& script, const lab::ScriptMeta& meta)
+{
+    lab::MemoryUsage usage = script.memory_usage();
+    usage += meta.memory_usage();
+    out.append(path);
+    for (size_t v : { size_t(text_bytes), usage.node_strings, usage.node_vectors, usage.containers, usage.source_map,
+                      usage.metadata, usage.overhead, usage.total(), usage.allocations })
+    {
+        out.append('\t');
+        out.append(std::to_string(v));
+    }
+    char per_mb[32];
+    snprintf(per_mb, sizeof(per_mb), "%.0f", text_bytes ? usage.total() * (1024.0 * 1024.0) / text_bytes : 0.0);
+    out.append('\t');
+    out.append(per_mb);
+    out.append('\n');
+}
 
-    std::cout << "\nSequences:\n";
-    std::cout << "----------------------------------------------------\n";
+// Writes each answer to stdout, or JSON to json_path; reports failures
+// on stderr and carries on with the next script.
+int runClient(const std::string& socket_path, const std::string& json_path, const std::string& query, bool stop)
+{
+	lab::DaemonClient client(socket_path);
+	lab::DaemonRequest kind = query.length() ? lab::DaemonRequest::Query
+		: json_path.length() ? lab::DaemonRequest::Json : lab::DaemonRequest::Summary;
+	int fd = kind == lab::DaemonRequest::Json ? lab::open_output_fd(json_path) : 1;
 
-	for (auto& sc : meta.sequence_characters)
+	int status = 0;
+	std::string response;
+	for (auto& path : paths)
 	{
-		int idx = script.sequence_index[sc.first];
-		string location = script.sequences[idx].location;
-		std::cout << "Sequence: " << sc.first << " - " << location << "\n";
-		for (auto& c : sc.second)
+		if (client.request(kind, path, query, response))
+			lab::write_fully(fd, response.data(), response.length());
+		else
 		{
-			std::cout << "   " << c << "\n";
+			std::cerr << response << std::endl;
+			status = 1;
 		}
 	}
-	std::cout << "\n";
-    
-    std::cout << "\nCharacters:\n";
-    std::cout << "----------------------------------------------------\n";
-    
-    for (auto& cd : meta.character_dialog)
+	if (fd != 1)
+		lab::close_output_fd(fd);
+
+	if (stop)
+		client.request(lab::DaemonRequest::Stop, std::string(), std::string(), response);
+	return status;
+}
+
+int main(int argc, char** argv) try
+{
+	std::string json_path;
+	std::string output_path;
+	std::string columns_path;
+	std::string memory_path;
+	std::string index_path;
+	std::string find;
+	std::string drafts_path;
+	std::string checkout;
+	std::string cast_path;
+	std::string centrality_path;
+	std::string schedule_path;
+	std::string serve_path;
+	std::string client_path;
+	std::string query;
+	float day_pages = 5.f;
+	float words_per_minute = 150.f;
+	int seed = 1;
+	bool stop = false;
+	std::string report_list;
+	std::string report_dir = ".";
+
+    OptionParser::Verbose(false);
+    OptionParser op("screenplay");
+    op.StringCallback(stringcallback, "file(s) to parse");
+    op.AddStringOption("j", "-json", json_path, "write each script as a line of JSON to file, - for stdout");
+    op.AddStringOption("o", "-output", output_path, "write each script, in turn, back out as Fountain to file, - for stdout");
+    op.AddStringOption("", "-columns", columns_path, "write scene and line tables of all scripts to a columnar file");
+    op.AddStringOption("", "-cast", cast_path, "write the characters who share sequences across all scripts to file, as an edge list");
+    op.AddStringOption("", "-centrality", centrality_path, "write each character's degree and centrality across all scripts to file");
+    op.AddStringOption("", "-index", index_path, "add each script's characters, sets, and locations to the corpus index in file");
+    op.AddStringOption("", "-find", find, "with --index: the scripts with a character, location, or set NAME; NAME* for every name beginning so");
+    op.AddStringOption("", "-drafts", drafts_path, "add each script as a draft, named by its path, to the draft store in file");
+    op.AddStringOption("", "-checkout", checkout, "with --drafts: write the latest draft named NAME to stdout as Fountain");
+    op.AddStringOption("", "-memory", memory_path, "write the memory each parsed script and its meta hold, by category, to file");
+    op.AddStringOption("", "-schedule", schedule_path, "write a stripboard shooting schedule for each script to file");
+    op.AddFloatOption("", "-day-pages", day_pages, "maximum pages shot per day for --schedule, default 5");
+    op.AddIntOption("", "-seed", seed, "random seed for --schedule, default 1");
+    op.AddStringOption("", "-report", report_list, "reports to write for each script from one pass, any of summary,json,emit,stats,breakdown,dialog,cast,centrality");
+    op.AddFloatOption("", "-wpm", words_per_minute, "speaking rate for the dialog report's times, in words per minute, default 150");
+    op.AddStringOption("", "-report-dir", report_dir, "directory for --report files, named after each script, default .");
+    op.AddStringOption("", "-serve", serve_path, "keep parsed scripts resident, answering requests on a Unix domain socket");
+    op.AddStringOption("", "-client", client_path, "ask the daemon on a socket for each script's summary, or its JSON with --json");
+    op.AddStringOption("", "-query", query, "with --client: locations, characters, sequences, dialog NAME, or scene NAME");
+    op.AddTrueOption("", "-stop", stop, "with --client, stop the daemon");
+
+	bool parsed = op.Parse(argc, argv);
+	bool finding = index_path.length() && find.length();
+	bool checking_out = drafts_path.length() && checkout.length();
+	if (!parsed || (paths.empty() && serve_path.empty() && !(client_path.length() && stop) && !finding && !checking_out))
 	{
-		std::cout << "Character: " << cd.first << ", line count: " << cd.second.size() << "\n";
-	}
-	std::cout << std::endl;
+        op.Usage();
+        exit(1);
+    }
+
+    if (serve_path.length())
+    {
+        lab::ScriptDaemon daemon;
+        daemon.serve(serve_path);
+        return 0;
+    }
+
+    if (client_path.length())
+        return runClient(client_path, json_path, query, stop);
+
+    if (finding)
+        return runFind(index_path, find);
+
+    if (checking_out)
+        return runCheckout(drafts_path, checkout);
+
+    std::vector<const ReportKind*> reports;
+    for (size_t b = 0; b < report_list.length();)
+    {
+        size_t e = report_list.find(',', b);
+        if (e == std::string::npos)
+            e = report_list.length();
+        std::string name = report_list.substr(b, e - b);
+        const ReportKind* kind = findReportKind(name);
+        if (!kind)
+        {
+            std::cerr << "Unknown report " << name << std::endl;
+            op.Usage();
+            exit(1);
+        }
+        reports.push_back(kind);
+        b = e + 1;
+    }
+
+    // checked before any output is opened, so that a mistyped directory
+    // fails without truncating the files the other options name
+    if (reports.size() && !lab::filesystem::is_directory(report_dir))
+    {
+        std::cerr << "No such directory " << report_dir << " for --report-dir" << std::endl;
+        return 1;
+    }
+
+    // with JSON or Fountain on stdout the text report would corrupt the
+    // stream; with --report the summary goes to a file instead
+    bool verbose = json_path != "-" && output_path != "-";
+    if (verbose)
+        std::cout << "LabScreenplay 20171202.1850" << "\n" << std::flush;
+    bool print_summary = verbose && reports.empty();
+    std::unique_ptr<lab::OutputBuffer> stdout_buffer;
+    if (print_summary)
+        stdout_buffer.reset(new lab::OutputBuffer(1));
+
+    std::unique_ptr<lab::OutputBuffer> json;
+    int json_fd = -1;
+    if (json_path.length())
+    {
+        json_fd = lab::open_output_fd(json_path);
+        json.reset(new lab::OutputBuffer(json_fd, 1024 * 1024));
+    }
+
+    int output_fd = -1;
+    if (output_path.length())
+        output_fd = lab::open_output_fd(output_path);
+
+    std::unique_ptr<lab::ColumnarWriter> columns;
+    if (columns_path.length())
+        columns.reset(new lab::ColumnarWriter());
+
+    // one graph over every script, as the episodes of a season
+    std::unique_ptr<lab::CastGraph> cast;
+    if (cast_path.length() || centrality_path.length())
+        cast.reset(new lab::CastGraph());
+
+    // scripts are numbered on from those the index already has, and
+    // appended to it once all are read; a path it has is skipped
+    std::unique_ptr<lab::CorpusIndexWriter> corpus_index;
+    if (index_path.length())
+        corpus_index.reset(new lab::CorpusIndexWriter(index_path));
+
+    // each script is stored as it is read, costing only its new sequences
+    std::unique_ptr<lab::DraftStore> drafts;
+    if (drafts_path.length())
+        drafts.reset(new lab::DraftStore(drafts_path));
+
+    std::unique_ptr<ReportFile> memory;
+    if (memory_path.length())
+    {
+        memory.reset(new ReportFile(memory_path));
+        memory->out->append("script\ttext_bytes\tnode_strings\tnode_vectors\tcontainers\tsource_map\tmetadata\toverhead\ttotal\tallocations\tbytes_per_text_mb\n");
+    }
+
+    std::unique_ptr<lab::OutputBuffer> schedule;
+    int schedule_fd = -1;
+    if (schedule_path.length())
+    {
+        schedule_fd = lab::open_output_fd(schedule_path);
+        schedule.reset(new lab::OutputBuffer(schedule_fd));
+    }
+
+    // the next script is opened, and so read and inflated ahead, while
+    // this one is parsed
+    std::unique_ptr<lab::ChunkReader> next_reader = openScript(paths[0]);
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        const std::string& path = paths[i];
+        std::unique_ptr<lab::ChunkReader> reader = std::move(next_reader);
+        if (i + 1 < paths.size())
+            next_reader = openScript(paths[i + 1]);
+
+        uint64_t text_bytes = 0;
+        lab::Script script = readScript(reader.get(), path, &text_bytes);
+        reader.reset();
 
+        // the meta most reports read is built on every thread, then every
+        // report is written from one walk
+        lab::ScriptMeta meta = lab::ScriptMeta::build(script);
+
+        if (memory)
+            writeMemoryUsage(*memory->out, path, text_bytes, script, meta);
+        std::vector<lab::ScriptReport*> walk;
+        std::vector<std::unique_ptr<lab::ScriptReport>> owned;
+        auto add = [&](lab::ScriptReport* r)
+        {
+            owned.emplace_back(r);
+            walk.push_back(r);
+        };
+        if (json)
+            add(new lab::JsonReport(*json, &meta));
+        if (print_summary)
+            add(new lab::SummaryReport(*stdout_buffer, meta));
+        if (cast)
+            walk.push_back(cast.get());
+
+        std::vector<std::unique_ptr<ReportFile>> files;
+        for (auto kind : reports)
+        {
+            lab::filesystem::path file = lab::filesystem::path(report_dir) / (reportStem(path) + kind->suffix);
+            files.emplace_back(new ReportFile(file.string()));
+            lab::OutputBuffer& out = *files.back()->out;
+            std::string name = kind->name;
+            if (name == "summary")
+                add(new lab::SummaryReport(out, meta));
+            else if (name == "json")
+                add(new lab::JsonReport(out, &meta));
+            else if (name == "emit")
+                add(new lab::FountainReport(out));
+            else if (name == "stats")
+                add(new lab::StatsReport(out));
+            else if (name == "breakdown")
+                add(new lab::BreakdownReport(out));
+            else if (name == "dialog")
+                add(new lab::DialogReport(out, words_per_minute));
+            else
+                add(new lab::CastReport(out, name == "centrality"));
+        }
+
+        lab::walkScript(script, walk);
+        files.clear();
+        if (stdout_buffer)
+            stdout_buffer->flush();
+
+        if (schedule)
+        {
+            lab::ScheduleOptions options;
+            options.max_eighths_per_day = static_cast<int>(day_pages * 8);
+            options.seed = static_cast<uint64_t>(seed);
+            lab::ShootingSchedule shoot = lab::scheduleShoot(script, meta, options);
+            schedule->append("Schedule: " + path + "\n");
+            schedule->append(shoot.as_string(script, meta));
+            schedule->append("\n");
+        }
+
+        // a big script's sequences are formatted on every thread
+        if (output_fd >= 0)
+            lab::writeFountain(output_fd, script);
+
+        if (columns)
+            columns->add(script);
+
+        if (corpus_index)
+            corpus_index->add(script, path);
+
+        if (drafts)
+            drafts->add(script, path);
+    }
+
+    if (json)
+    {
+        json->flush();
+        json.reset();
+        lab::close_output_fd(json_fd);
+    }
+
+    if (output_fd >= 0)
+        lab::close_output_fd(output_fd);
+
+    if (schedule)
+    {
+        schedule->flush();
+        schedule.reset();
+        lab::close_output_fd(schedule_fd);
+    }
+
+    if (columns)
+    {
+        int fd = lab::open_output_fd(columns_path);
+        columns->write(fd);
+        lab::close_output_fd(fd);
+    }
+
+    if (corpus_index)
+        lab::appendCorpusIndex(index_path, *corpus_index);
+
+    if (cast)
+    {
+        lab::CastNetwork network = cast->network();
+        if (cast_path.length())
+        {
+            ReportFile file(cast_path);
+            lab::writeCastEdges(*file.out, network);
+        }
+        if (centrality_path.length())
+        {
+            ReportFile file(centrality_path);
+            lab::writeCastCentrality(*file.out, network);
+        }
+    }
     return 0;
 }
+catch (std::exception& e)
+{
+	std::cerr << e.what() << std::endl;
+	return 1;
+}
 catch (...)
 {
 	std::cerr << "Problem encountered" << std::endl;